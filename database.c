@@ -40,6 +40,9 @@
 #include "face_common.h"
 
 #define DATABASE_TABLE "face_data"
+/* optional product quantizer codebook and the codes of the features */
+#define DATABASE_PQ_TABLE "face_pq"
+#define DATABASE_CODE_TABLE "face_code"
 
 static sqlite3 *g_db = NULL;
 
@@ -61,6 +64,16 @@ int database_init(void)
         printf("%s create table %s failed!\n", __func__, DATABASE_TABLE);
         return -1;
     }
+    snprintf(cmd, sizeof(cmd),
+             "CREATE TABLE IF NOT EXISTS %s (id INTEGER PRIMARY KEY, data blob);"
+             "CREATE TABLE IF NOT EXISTS %s (code blob, name varchar(%d) UNIQUE)",
+             DATABASE_PQ_TABLE, DATABASE_CODE_TABLE, NAME_LEN);
+    if (sqlite3_exec(g_db, cmd, 0, 0, &err) != SQLITE_OK) {
+        sqlite3_close(g_db);
+        g_db = NULL;
+        printf("%s create table %s failed!\n", __func__, DATABASE_CODE_TABLE);
+        return -1;
+    }
 
     return 0;
 }
@@ -143,6 +156,27 @@ int database_get_data(void *dst, const int cnt, size_t d_size, size_t d_off,
     return index;
 }
 
+/* hands every row to cb until it returns nonzero, returns the rows handed */
+int database_for_each_data(database_data_cb cb, void *arg)
+{
+    char cmd[256];
+    sqlite3_stmt *stat = NULL;
+    int index = 0;
+
+    snprintf(cmd, sizeof(cmd), "SELECT * FROM %s;", DATABASE_TABLE);
+    if (sqlite3_prepare(g_db, cmd, -1, &stat, 0) != SQLITE_OK)
+        return 0;
+    while (sqlite3_step(stat) == SQLITE_ROW) {
+        index++;
+        if (cb(sqlite3_column_blob(stat, 0), sqlite3_column_bytes(stat, 0),
+               (const char *)sqlite3_column_text(stat, 1), arg))
+            break;
+    }
+    sqlite3_finalize(stat);
+
+    return index;
+}
+
 bool database_is_name_exist(char *name)
 {
     bool exist = false;
@@ -226,14 +260,110 @@ exit:
     return ret_id;
 }
 
-void database_delete(char *name, bool sync_flag)
+void database_delete(const char *name, bool sync_flag)
 {
     char cmd[256];
 
     snprintf(cmd, sizeof(cmd), "DELETE FROM %s WHERE name = '%s';", DATABASE_TABLE, name);
     sqlite3_exec(g_db, "begin transaction", NULL, NULL, NULL);
     sqlite3_exec(g_db, cmd, NULL, NULL, NULL);
+    snprintf(cmd, sizeof(cmd), "DELETE FROM %s WHERE name = '%s';", DATABASE_CODE_TABLE, name);
+    sqlite3_exec(g_db, cmd, NULL, NULL, NULL);
     sqlite3_exec(g_db, "commit transaction", NULL, NULL, NULL);
     if (sync_flag)
         sync();
 }
+
+int database_set_codebook(void *data, size_t size)
+{
+    char cmd[256];
+    sqlite3_stmt *stat = NULL;
+
+    snprintf(cmd, sizeof(cmd), "INSERT OR REPLACE INTO %s VALUES(0, ?);", DATABASE_PQ_TABLE);
+    if (sqlite3_prepare(g_db, cmd, -1, &stat, 0) != SQLITE_OK)
+        return -1;
+    sqlite3_exec(g_db, "begin transaction", NULL, NULL, NULL);
+    /* a new codebook makes every stored code stale */
+    snprintf(cmd, sizeof(cmd), "DELETE FROM %s;", DATABASE_CODE_TABLE);
+    sqlite3_exec(g_db, cmd, NULL, NULL, NULL);
+    sqlite3_bind_blob(stat, 1, data, size, NULL);
+    sqlite3_step(stat);
+    sqlite3_finalize(stat);
+    sqlite3_exec(g_db, "commit transaction", NULL, NULL, NULL);
+    sync();
+
+    return 0;
+}
+
+/* the caller frees *data */
+int database_get_codebook(void **data, size_t *size)
+{
+    int ret = -1;
+    char cmd[256];
+    sqlite3_stmt *stat = NULL;
+
+    *data = NULL;
+    *size = 0;
+    snprintf(cmd, sizeof(cmd), "SELECT data FROM %s WHERE id = 0;", DATABASE_PQ_TABLE);
+    if (sqlite3_prepare(g_db, cmd, -1, &stat, 0) != SQLITE_OK)
+        return -1;
+    if (sqlite3_step(stat) == SQLITE_ROW) {
+        *size = sqlite3_column_bytes(stat, 0);
+        *data = malloc(*size);
+        if (*data) {
+            memcpy(*data, sqlite3_column_blob(stat, 0), *size);
+            ret = 0;
+        }
+    }
+    sqlite3_finalize(stat);
+
+    return ret;
+}
+
+/* groups many database_insert_code() calls into one commit */
+void database_begin(void)
+{
+    sqlite3_exec(g_db, "begin transaction", NULL, NULL, NULL);
+}
+
+void database_commit(bool sync_flag)
+{
+    sqlite3_exec(g_db, "commit transaction", NULL, NULL, NULL);
+    if (sync_flag)
+        sync();
+}
+
+int database_insert_code(void *code, size_t size, const char *name)
+{
+    char cmd[256];
+    sqlite3_stmt *stat = NULL;
+
+    snprintf(cmd, sizeof(cmd), "INSERT OR REPLACE INTO %s VALUES(?, '%s');",
+             DATABASE_CODE_TABLE, name);
+    if (sqlite3_prepare(g_db, cmd, -1, &stat, 0) != SQLITE_OK)
+        return -1;
+    sqlite3_bind_blob(stat, 1, code, size, NULL);
+    sqlite3_step(stat);
+    sqlite3_finalize(stat);
+
+    return 0;
+}
+
+int database_get_code(const char *name, void *code, size_t size)
+{
+    int ret = -1;
+    char cmd[256];
+    sqlite3_stmt *stat = NULL;
+
+    snprintf(cmd, sizeof(cmd), "SELECT code FROM %s WHERE name = '%s' LIMIT 1;",
+             DATABASE_CODE_TABLE, name);
+    if (sqlite3_prepare(g_db, cmd, -1, &stat, 0) != SQLITE_OK)
+        return -1;
+    if (sqlite3_step(stat) == SQLITE_ROW && sqlite3_column_bytes(stat, 0) == size) {
+        memcpy(code, sqlite3_column_blob(stat, 0), size);
+        ret = 0;
+    }
+    sqlite3_finalize(stat);
+
+    return ret;
+}
@@ -44,9 +44,17 @@ int database_insert(void *data, size_t size, char *name, size_t n_size, bool syn
 int database_record_count();
 int database_get_data(void *dst, const int cnt, size_t d_size, size_t d_off,
                       size_t n_size, size_t n_off);
+typedef int (*database_data_cb)(const void *data, size_t size, const char *name, void *arg);
+int database_for_each_data(database_data_cb cb, void *arg);
 bool database_is_name_exist(char *name);
 int database_get_user_name_id(void);
-void database_delete(char *name, bool sync_flag);
+void database_delete(const char *name, bool sync_flag);
+int database_set_codebook(void *data, size_t size);
+int database_get_codebook(void **data, size_t *size);
+void database_begin(void);
+void database_commit(bool sync_flag);
+int database_insert_code(void *code, size_t size, const char *name);
+int database_get_code(const char *name, void *code, size_t size);
 
 #ifdef __cplusplus
 }
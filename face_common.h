@@ -45,11 +45,6 @@ extern "C" {
 #define NAME_LEN 128
 #define USER_NAME "User_"
 
-struct face_data {
-    rockface_feature_t feature;
-    char name[NAME_LEN];
-};
-
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,398 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "face_gallery.h"
+
+/*
+ * Gallery storage that grows by whole chunks of FACE_GALLERY_CHUNK
+ * features, cache line aligned. A q8 gallery keeps the int8 copy of every
+ * feature instead of the fp32 one, about 520 instead of 2052 bytes.
+ * Features are packed back to back, the names live apart in one string
+ * pool, so a scan only streams feature bytes and the pipeline carries the
+ * entry index as the identity id.
+ * Features never move once appended, only the small chunk table, the
+ * offsets and the pool are reallocated. The limit is a registration
+ * policy, not an allocation, a small site only pays for the chunks it
+ * fills.
+ *
+ * A gallery can be shared into a new one that then grows on its own, for
+ * the next version of the library while the current one is searched. The
+ * chunks are reference counted and not copied, the slots past the end of
+ * the older gallery are only ever written by the newer one, so galleries
+ * must be shared from the newest only. The small tables and the pool are
+ * copied.
+ *
+ * Codes derived from the features, e.g. product quantizer codes, are
+ * appended in order to chunks of their own, shared the same way, so a new
+ * version only encodes what it added.
+ *
+ * Entries are never removed in place, chunks may be shared. A delete
+ * compacts the entries kept into fresh chunks of a new gallery, the old
+ * chunks go away with the last gallery using them. The footprint only
+ * counts the chunks a gallery holds alone, those shared with another are
+ * reported apart, so the footprints of live galleries add up.
+ */
+
+#define FACE_GALLERY_ALIGN 64
+
+/* the reference count sits in front of the entries of every chunk */
+static inline int *face_gallery_refs(void *chunk)
+{
+    return (int *)((char *)chunk - FACE_GALLERY_ALIGN);
+}
+
+static void *face_gallery_chunk_alloc(size_t size)
+{
+    void *chunk;
+
+    if (posix_memalign(&chunk, FACE_GALLERY_ALIGN, FACE_GALLERY_ALIGN + size))
+        return NULL;
+    memset(chunk, 0, FACE_GALLERY_ALIGN + size);
+    *(int *)chunk = 1;
+
+    return (char *)chunk + FACE_GALLERY_ALIGN;
+}
+
+static void *face_gallery_get(void *chunk)
+{
+    __atomic_add_fetch(face_gallery_refs(chunk), 1, __ATOMIC_RELAXED);
+
+    return chunk;
+}
+
+static void face_gallery_put(void *chunk)
+{
+    if (!__atomic_sub_fetch(face_gallery_refs(chunk), 1, __ATOMIC_ACQ_REL))
+        free(face_gallery_refs(chunk));
+}
+
+void face_gallery_init(struct face_gallery *gallery, int limit, bool q8)
+{
+    memset(gallery, 0, sizeof(*gallery));
+    gallery->limit = limit;
+    gallery->q8 = q8;
+}
+
+void face_gallery_release(struct face_gallery *gallery)
+{
+    for (int i = 0; i < gallery->chunk_cnt; i++)
+        face_gallery_put(gallery->chunks[i]);
+    for (int i = 0; i < gallery->code_chunks; i++)
+        face_gallery_put(gallery->codes[i]);
+    free(gallery->chunks);
+    free(gallery->codes);
+    free(gallery->names);
+    free(gallery->pool);
+    face_gallery_init(gallery, gallery->limit, gallery->q8);
+}
+
+static int face_gallery_grow(struct face_gallery *gallery)
+{
+    void *chunk;
+
+    if (gallery->chunk_cnt == gallery->chunk_cap) {
+        int cap = gallery->chunk_cap ? gallery->chunk_cap * 2 : 8;
+        void **chunks = (void **)realloc(gallery->chunks, cap * sizeof(*chunks));
+        if (!chunks)
+            return -1;
+        gallery->chunks = chunks;
+        gallery->chunk_cap = cap;
+    }
+
+    chunk = face_gallery_chunk_alloc(FACE_GALLERY_CHUNK * face_gallery_entry_size(gallery));
+    if (!chunk)
+        return -1;
+    gallery->chunks[gallery->chunk_cnt++] = chunk;
+
+    return 0;
+}
+
+/* dst, which must be unused, gets the entries of src and grows on its own */
+int face_gallery_share(struct face_gallery *dst, const struct face_gallery *src)
+{
+    face_gallery_init(dst, src->limit, src->q8);
+    dst->chunks = (void **)malloc(src->chunk_cap * sizeof(*dst->chunks));
+    dst->names = (uint32_t *)malloc(src->names_cap * sizeof(*dst->names));
+    dst->pool = (char *)malloc(src->pool_cap);
+    dst->codes = (uint8_t **)malloc(src->code_cap * sizeof(*dst->codes));
+    if ((src->chunk_cap && !dst->chunks) || (src->names_cap && !dst->names) ||
+        (src->pool_cap && !dst->pool) || (src->code_cap && !dst->codes)) {
+        printf("%s: alloc fail\n", __func__);
+        face_gallery_release(dst);
+        return -1;
+    }
+
+    for (int i = 0; i < src->chunk_cnt; i++)
+        dst->chunks[i] = face_gallery_get(src->chunks[i]);
+    dst->chunk_cnt = src->chunk_cnt;
+    dst->chunk_cap = src->chunk_cap;
+    memcpy(dst->names, src->names, src->num * sizeof(*dst->names));
+    dst->names_cap = src->names_cap;
+    memcpy(dst->pool, src->pool, src->pool_len);
+    dst->pool_len = src->pool_len;
+    dst->pool_cap = src->pool_cap;
+    dst->num = src->num;
+    for (int i = 0; i < src->code_chunks; i++)
+        dst->codes[i] = (uint8_t *)face_gallery_get(src->codes[i]);
+    dst->code_chunks = src->code_chunks;
+    dst->code_cap = src->code_cap;
+    dst->code_num = src->code_num;
+    dst->code_size = src->code_size;
+
+    return 0;
+}
+
+static void *face_gallery_add(struct face_gallery *gallery, const char *name);
+
+/*
+ * dst, which must be unused, gets the entries of src keep is true for, in
+ * order and with their codes, in fresh chunks. Ids move.
+ */
+int face_gallery_compact(struct face_gallery *dst, const struct face_gallery *src,
+                         const bool *keep)
+{
+    face_gallery_init(dst, src->limit, src->q8);
+    for (int i = 0; i < src->num; i++) {
+        void *entry;
+
+        if (!keep[i])
+            continue;
+        entry = face_gallery_add(dst, face_gallery_name(src, i));
+        if (!entry)
+            goto fail;
+        memcpy(entry, face_gallery_entry(src, i), face_gallery_entry_size(src));
+        /* codes stay a prefix of the entries */
+        if (i < src->code_num && dst->code_num == dst->num - 1 &&
+            face_gallery_append_code(dst, face_gallery_code(src, i), src->code_size))
+            goto fail;
+    }
+
+    return 0;
+
+fail:
+    printf("%s: %d of %d entries fail\n", __func__, dst->num, src->num);
+    face_gallery_release(dst);
+    return -1;
+}
+
+/* the code of entry code_num, all codes of a gallery have the same size */
+int face_gallery_append_code(struct face_gallery *gallery, const void *code, int size)
+{
+    int id = gallery->code_num;
+
+    if (id >= gallery->num || (gallery->code_size && size != gallery->code_size))
+        return -1;
+    gallery->code_size = size;
+    if (id == gallery->code_chunks * FACE_GALLERY_CHUNK) {
+        if (gallery->code_chunks == gallery->code_cap) {
+            int cap = gallery->code_cap ? gallery->code_cap * 2 : 8;
+            uint8_t **codes = (uint8_t **)realloc(gallery->codes, cap * sizeof(*codes));
+            if (!codes)
+                return -1;
+            gallery->codes = codes;
+            gallery->code_cap = cap;
+        }
+        gallery->codes[gallery->code_chunks] =
+            (uint8_t *)face_gallery_chunk_alloc((size_t)FACE_GALLERY_CHUNK * size);
+        if (!gallery->codes[gallery->code_chunks]) {
+            printf("%s: alloc chunk %d fail\n", __func__, gallery->code_chunks);
+            return -1;
+        }
+        gallery->code_chunks++;
+    }
+    memcpy(face_gallery_code(gallery, id), code, size);
+    gallery->code_num++;
+
+    return 0;
+}
+
+/* stores name and its label at the end of the pool, returns the offset */
+static int face_gallery_intern(struct face_gallery *gallery, const char *name, uint32_t *off)
+{
+    size_t len = strnlen(name, NAME_LEN - 1);
+    size_t label = len;
+    size_t need;
+
+    while (label && name[label - 1] != '.')
+        label--;
+    label = label ? label - 1 : len;
+    need = gallery->pool_len + len + label + 2;
+
+    if (need > UINT32_MAX)
+        return -1;
+    if (need > gallery->pool_cap) {
+        size_t cap = gallery->pool_cap ? gallery->pool_cap : 4096;
+        char *pool;
+        while (cap < need)
+            cap *= 2;
+        pool = (char *)realloc(gallery->pool, cap);
+        if (!pool)
+            return -1;
+        gallery->pool = pool;
+        gallery->pool_cap = cap;
+    }
+
+    *off = gallery->pool_len;
+    memcpy(gallery->pool + gallery->pool_len, name, len);
+    gallery->pool[gallery->pool_len + len] = '\0';
+    memcpy(gallery->pool + gallery->pool_len + len + 1, name, label);
+    gallery->pool[gallery->pool_len + len + 1 + label] = '\0';
+    gallery->pool_len = need;
+
+    return 0;
+}
+
+/* a new entry named name, the caller fills it in, NULL at the limit or out of memory */
+static void *face_gallery_add(struct face_gallery *gallery, const char *name)
+{
+    int id = gallery->num;
+
+    if (face_gallery_full(gallery, 0))
+        return NULL;
+    if (id == gallery->chunk_cnt * FACE_GALLERY_CHUNK && face_gallery_grow(gallery)) {
+        printf("%s: alloc chunk %d fail\n", __func__, gallery->chunk_cnt);
+        return NULL;
+    }
+    if (id == gallery->names_cap) {
+        int cap = gallery->chunk_cnt * FACE_GALLERY_CHUNK;
+        uint32_t *names = (uint32_t *)realloc(gallery->names, cap * sizeof(*names));
+        if (!names)
+            return NULL;
+        gallery->names = names;
+        gallery->names_cap = cap;
+    }
+    if (face_gallery_intern(gallery, name, &gallery->names[id])) {
+        printf("%s: alloc name fail\n", __func__);
+        return NULL;
+    }
+    gallery->num++;
+
+    return face_gallery_entry(gallery, id);
+}
+
+/* the id of a new entry, -1 at the limit or out of memory */
+int face_gallery_append(struct face_gallery *gallery, const void *feature, size_t size,
+                        const char *name)
+{
+    rockface_feature_t f;
+    void *entry;
+
+    if (size > sizeof(f))
+        return -1;
+    memset(&f, 0, sizeof(f));
+    memcpy(&f, feature, size);
+    entry = face_gallery_add(gallery, name);
+    if (!entry)
+        return -1;
+    if (gallery->q8)
+        face_search_q8_encode(&f, (struct face_search_q8 *)entry);
+    else
+        memcpy(entry, &f, sizeof(f));
+
+    return gallery->num - 1;
+}
+
+/* the unit vector of entry id into v, returns its length */
+int face_gallery_unit(const struct face_gallery *gallery, int id, float *v)
+{
+    const rockface_feature_t *f = (const rockface_feature_t *)face_gallery_entry(gallery, id);
+    float norm = 0;
+
+    if (gallery->q8)
+        return face_search_q8_unit((const struct face_search_q8 *)f, v);
+    if (f->len <= 0 || f->len > (int)FACE_SEARCH_DIM)
+        return 0;
+    for (int j = 0; j < f->len; j++)
+        norm += f->feature[j] * f->feature[j];
+    norm = norm > 0 ? 1 / sqrtf(norm) : 0;
+    for (int j = 0; j < f->len; j++)
+        v[j] = f->feature[j] * norm;
+
+    return f->len;
+}
+
+/* the feature of entry id as the SDK takes it, an int8 one scaled back */
+void face_gallery_feature(const struct face_gallery *gallery, int id, rockface_feature_t *feature)
+{
+    const struct face_search_q8 *q = (const struct face_search_q8 *)face_gallery_entry(gallery, id);
+
+    if (!gallery->q8) {
+        memcpy(feature, q, sizeof(*feature));
+        return;
+    }
+    memset(feature, 0, sizeof(*feature));
+    feature->version = q->version;
+    feature->len = q->len > 0 && q->len <= (int)FACE_SEARCH_DIM ? q->len : 0;
+    for (int j = 0; j < feature->len; j++)
+        feature->feature[j] = q->v[j] * q->scale;
+}
+
+/* true once pending more entries would pass the limit */
+bool face_gallery_full(const struct face_gallery *gallery, int pending)
+{
+    return gallery->limit > 0 && gallery->num + pending >= gallery->limit;
+}
+
+static size_t face_gallery_chunk_bytes(void *chunk, size_t size, size_t *shared)
+{
+    if (__atomic_load_n(face_gallery_refs(chunk), __ATOMIC_RELAXED) == 1)
+        return FACE_GALLERY_ALIGN + size;
+    if (shared)
+        *shared += FACE_GALLERY_ALIGN + size;
+
+    return 0;
+}
+
+/* bytes held by this gallery alone, shared gets those of chunks shared with others */
+size_t face_gallery_footprint(const struct face_gallery *gallery, size_t *shared)
+{
+    size_t own = gallery->chunk_cap * sizeof(void *) +
+                 gallery->names_cap * sizeof(uint32_t) + gallery->pool_cap +
+                 gallery->code_cap * sizeof(uint8_t *);
+
+    if (shared)
+        *shared = 0;
+    for (int i = 0; i < gallery->chunk_cnt; i++)
+        own += face_gallery_chunk_bytes(gallery->chunks[i],
+                                        FACE_GALLERY_CHUNK * face_gallery_entry_size(gallery),
+                                        shared);
+    for (int i = 0; i < gallery->code_chunks; i++)
+        own += face_gallery_chunk_bytes(gallery->codes[i],
+                                        (size_t)FACE_GALLERY_CHUNK * gallery->code_size, shared);
+
+    return own;
+}
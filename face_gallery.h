@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __FACE_GALLERY_H__
+#define __FACE_GALLERY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "face_common.h"
+#include "face_search.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 1024 packed entries per chunk, about 2 MB of fp32 or 512 KB of int8 features */
+#define FACE_GALLERY_CHUNK_SHIFT 10
+#define FACE_GALLERY_CHUNK (1 << FACE_GALLERY_CHUNK_SHIFT)
+
+/*
+ * Identity id i is entry i, its feature sits in the chunks and its names in
+ * the pool at names[i], the stored name followed by the label shown on
+ * screen, the stored name up to its extension. The entries are
+ * rockface_feature_t, or struct face_search_q8 in a q8 gallery.
+ */
+struct face_gallery {
+    void **chunks;
+    int chunk_cnt;
+    int chunk_cap;
+    int num;
+    int limit;
+    bool q8;
+
+    uint32_t *names;
+    int names_cap;
+    char *pool;
+    size_t pool_len;
+    size_t pool_cap;
+
+    /* optional codes of the first code_num entries, code_size bytes each */
+    uint8_t **codes;
+    int code_chunks;
+    int code_cap;
+    int code_num;
+    int code_size;
+};
+
+void face_gallery_init(struct face_gallery *gallery, int limit, bool q8);
+void face_gallery_release(struct face_gallery *gallery);
+int face_gallery_append(struct face_gallery *gallery, const void *feature, size_t size,
+                        const char *name);
+int face_gallery_share(struct face_gallery *dst, const struct face_gallery *src);
+int face_gallery_compact(struct face_gallery *dst, const struct face_gallery *src,
+                         const bool *keep);
+int face_gallery_append_code(struct face_gallery *gallery, const void *code, int size);
+bool face_gallery_full(const struct face_gallery *gallery, int pending);
+size_t face_gallery_footprint(const struct face_gallery *gallery, size_t *shared);
+int face_gallery_unit(const struct face_gallery *gallery, int id, float *v);
+void face_gallery_feature(const struct face_gallery *gallery, int id, rockface_feature_t *feature);
+
+static inline size_t face_gallery_entry_size(const struct face_gallery *gallery)
+{
+    return gallery->q8 ? sizeof(struct face_search_q8) : sizeof(rockface_feature_t);
+}
+
+static inline void *face_gallery_entry(const struct face_gallery *gallery, int id)
+{
+    return (char *)gallery->chunks[id >> FACE_GALLERY_CHUNK_SHIFT] +
+           (id & (FACE_GALLERY_CHUNK - 1)) * face_gallery_entry_size(gallery);
+}
+
+static inline uint8_t *face_gallery_code(const struct face_gallery *gallery, int id)
+{
+    return gallery->codes[id >> FACE_GALLERY_CHUNK_SHIFT] +
+           (id & (FACE_GALLERY_CHUNK - 1)) * gallery->code_size;
+}
+
+/* the name in the database */
+static inline const char *face_gallery_name(const struct face_gallery *gallery, int id)
+{
+    return gallery->pool + gallery->names[id];
+}
+
+static inline const char *face_gallery_label(const struct face_gallery *gallery, int id)
+{
+    const char *name = face_gallery_name(gallery, id);
+
+    return name + strlen(name) + 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <float.h>
+#include <math.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "face_pq.h"
+
+/*
+ * Product quantizer for unit length features. The vector is split into
+ * FACE_PQ_M slices and every slice is replaced by the index of the closest
+ * of FACE_PQ_K centroids, trained by k-means on the gallery. A query is
+ * not quantized, its dot product with every centroid goes into a lookup
+ * table once, and the score of a code is then one table read per slice.
+ * The table is 64 KB, so the gallery scan stays in L2 for the table and
+ * streams the codes.
+ *
+ * The same training set also gets up to FACE_PQ_LISTS coarse centroids,
+ * the lists of an inverted file. Every code carries the list of its
+ * feature in a last byte, so a search can score only the codes of the few
+ * lists nearest to the query instead of all of them.
+ */
+
+#define FACE_PQ_MAGIC 0x32515046 /* "FPQ2" */
+/* training features per coarse centroid, at least and at most */
+#define FACE_PQ_LIST_MIN 16
+#define FACE_PQ_LIST_MAX 32
+
+struct face_pq_header {
+    uint32_t magic;
+    uint32_t dim;
+    uint32_t m;
+    uint32_t k;
+    uint32_t lists;
+};
+
+/* four lanes, NEON or SSE, unaligned loads are fine */
+typedef float face_pq_v4uf __attribute__((vector_size(16), aligned(4)));
+
+static inline float face_pq_dist(const float *a, const float *b, int n)
+{
+    face_pq_v4uf acc = {0};
+    float d;
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        face_pq_v4uf t = *(const face_pq_v4uf *)(a + i) - *(const face_pq_v4uf *)(b + i);
+        acc += t * t;
+    }
+    d = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+    for (; i < n; i++)
+        d += (a[i] - b[i]) * (a[i] - b[i]);
+
+    return d;
+}
+
+static int face_pq_nearest(const float *c, int n, const float *v, int sub)
+{
+    float best = FLT_MAX;
+    int idx = 0;
+
+    for (int k = 0; k < n; k++, c += sub) {
+        float d = face_pq_dist(c, v, sub);
+        if (d < best) {
+            best = d;
+            idx = k;
+        }
+    }
+
+    return idx;
+}
+
+/*
+ * k-means of one slice into kc centroids, seeded from evenly spaced
+ * samples. With unit set the centroids are scaled back to unit length,
+ * shorter means of many features would otherwise draw ever more of them.
+ */
+static void face_pq_kmeans(float *c, int kc, const float *vecs, int n, int dim, int off,
+                           int sub, int iters, bool unit, float *sum, int *cnt)
+{
+    for (int k = 0; k < kc; k++)
+        memcpy(c + k * sub, vecs + (long)k * n / kc * dim + off, sub * sizeof(float));
+
+    for (int it = 0; it < iters; it++) {
+        memset(sum, 0, kc * sub * sizeof(float));
+        memset(cnt, 0, kc * sizeof(int));
+        for (int i = 0; i < n; i++) {
+            const float *v = vecs + (long)i * dim + off;
+            int k = face_pq_nearest(c, kc, v, sub);
+            for (int j = 0; j < sub; j++)
+                sum[k * sub + j] += v[j];
+            cnt[k]++;
+        }
+        /* an empty cluster keeps its centroid */
+        for (int k = 0; k < kc; k++) {
+            float norm = 0;
+            if (!cnt[k])
+                continue;
+            for (int j = 0; j < sub; j++)
+                c[k * sub + j] = sum[k * sub + j] / cnt[k];
+            if (!unit)
+                continue;
+            for (int j = 0; j < sub; j++)
+                norm += c[k * sub + j] * c[k * sub + j];
+            norm = norm > 0 ? 1 / sqrtf(norm) : 0;
+            for (int j = 0; j < sub; j++)
+                c[k * sub + j] *= norm;
+        }
+    }
+}
+
+int face_pq_train(struct face_pq *pq, const float *vecs, int n, int dim, int iters)
+{
+    float *sum;
+    int *cnt;
+    int step;
+
+    if (dim % FACE_PQ_M || n < FACE_PQ_K) {
+        printf("%s: need %d vectors of a multiple of %d dims\n", __func__, FACE_PQ_K, FACE_PQ_M);
+        return -1;
+    }
+
+    face_pq_release(pq);
+    pq->dim = dim;
+    pq->sub = dim / FACE_PQ_M;
+    pq->lists = n / FACE_PQ_LIST_MIN < FACE_PQ_LISTS ? n / FACE_PQ_LIST_MIN : FACE_PQ_LISTS;
+    pq->centroids = (float *)malloc(FACE_PQ_M * FACE_PQ_K * pq->sub * sizeof(float));
+    pq->coarse = (float *)malloc((size_t)pq->lists * dim * sizeof(float));
+    /* dim >= FACE_PQ_M, so the coarse sums are the larger ones */
+    sum = (float *)malloc((size_t)FACE_PQ_LISTS * dim * sizeof(float));
+    cnt = (int *)malloc(FACE_PQ_LISTS * sizeof(int));
+    if (!pq->centroids || !pq->coarse || !sum || !cnt) {
+        printf("%s: alloc fail\n", __func__);
+        free(sum);
+        free(cnt);
+        face_pq_release(pq);
+        return -1;
+    }
+
+    for (int m = 0; m < FACE_PQ_M; m++)
+        face_pq_kmeans(pq->centroids + m * FACE_PQ_K * pq->sub, FACE_PQ_K, vecs, n, dim,
+                       m * pq->sub, pq->sub, iters, false, sum, cnt);
+    /* every step-th feature is enough for the coarse centroids */
+    step = (n + pq->lists * FACE_PQ_LIST_MAX - 1) / (pq->lists * FACE_PQ_LIST_MAX);
+    face_pq_kmeans(pq->coarse, pq->lists, vecs, n / step, dim * step, 0, dim, iters, true, sum,
+                   cnt);
+
+    free(sum);
+    free(cnt);
+    return 0;
+}
+
+void face_pq_release(struct face_pq *pq)
+{
+    free(pq->centroids);
+    free(pq->coarse);
+    memset(pq, 0, sizeof(*pq));
+}
+
+/* FACE_PQ_CODE bytes, the list last */
+void face_pq_encode(const struct face_pq *pq, const float *v, uint8_t *code)
+{
+    for (int m = 0; m < FACE_PQ_M; m++)
+        code[m] = face_pq_nearest(pq->centroids + m * FACE_PQ_K * pq->sub, FACE_PQ_K,
+                                  v + m * pq->sub, pq->sub);
+    code[FACE_PQ_M] = face_pq_nearest(pq->coarse, pq->lists, v, pq->dim);
+}
+
+/* the n lists nearest to q, nearest first, n is at most pq->lists */
+void face_pq_probe(const struct face_pq *pq, const float *q, int n, int *lists)
+{
+    float dist[FACE_PQ_LISTS];
+    int cnt = 0;
+
+    for (int l = 0; l < pq->lists; l++) {
+        float d = face_pq_dist(pq->coarse + (size_t)l * pq->dim, q, pq->dim);
+        int i;
+
+        if (cnt == n && d >= dist[n - 1])
+            continue;
+        i = cnt < n ? cnt++ : n - 1;
+        for (; i > 0 && dist[i - 1] > d; i--) {
+            dist[i] = dist[i - 1];
+            lists[i] = lists[i - 1];
+        }
+        dist[i] = d;
+        lists[i] = l;
+    }
+}
+
+/* lut holds FACE_PQ_M * FACE_PQ_K dot products */
+void face_pq_lut(const struct face_pq *pq, const float *q, float *lut)
+{
+    const float *c = pq->centroids;
+
+    for (int m = 0; m < FACE_PQ_M; m++) {
+        const float *v = q + m * pq->sub;
+        for (int k = 0; k < FACE_PQ_K; k++, c += pq->sub) {
+            float dot = 0;
+            for (int j = 0; j < pq->sub; j++)
+                dot += v[j] * c[j];
+            *lut++ = dot;
+        }
+    }
+}
+
+/*
+ * ARMv7 NEON has no gather, so the reads are unrolled into four
+ * independent sums instead, which keeps the loads in flight.
+ */
+float face_pq_score(const float *lut, const uint8_t *code)
+{
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+
+    for (int m = 0; m < FACE_PQ_M; m += 4, lut += 4 * FACE_PQ_K) {
+        s0 += lut[code[m]];
+        s1 += lut[FACE_PQ_K + code[m + 1]];
+        s2 += lut[2 * FACE_PQ_K + code[m + 2]];
+        s3 += lut[3 * FACE_PQ_K + code[m + 3]];
+    }
+
+    return (s0 + s1) + (s2 + s3);
+}
+
+typedef float face_pq_v4sf __attribute__((vector_size(16)));
+
+/*
+ * Scores of four codes side by side, the table reads of a slice go into
+ * one vector and the sums are vector adds. AVX2 gathers the four reads,
+ * NEON loads them lane by lane.
+ */
+void face_pq_score4(const float *lut, const uint8_t *const *codes, float *scores)
+{
+    const uint8_t *c0 = codes[0], *c1 = codes[1], *c2 = codes[2], *c3 = codes[3];
+    face_pq_v4sf a0 = {0}, a1 = {0};
+
+    for (int m = 0; m < FACE_PQ_M; m += 2, lut += 2 * FACE_PQ_K) {
+#ifdef __AVX2__
+        a0 += (face_pq_v4sf)_mm_i32gather_ps(lut, _mm_setr_epi32(c0[m], c1[m], c2[m], c3[m]), 4);
+        a1 += (face_pq_v4sf)_mm_i32gather_ps(lut + FACE_PQ_K, _mm_setr_epi32(c0[m + 1], c1[m + 1],
+                                             c2[m + 1], c3[m + 1]), 4);
+#else
+        const float *l1 = lut + FACE_PQ_K;
+        face_pq_v4sf v0 = {lut[c0[m]], lut[c1[m]], lut[c2[m]], lut[c3[m]]};
+        face_pq_v4sf v1 = {l1[c0[m + 1]], l1[c1[m + 1]], l1[c2[m + 1]], l1[c3[m + 1]]};
+        a0 += v0;
+        a1 += v1;
+#endif
+    }
+    a0 += a1;
+    memcpy(scores, &a0, sizeof(a0));
+}
+
+static size_t face_pq_centroid_size(const struct face_pq *pq)
+{
+    return FACE_PQ_M * FACE_PQ_K * pq->sub * sizeof(float);
+}
+
+size_t face_pq_size(const struct face_pq *pq)
+{
+    return sizeof(struct face_pq_header) + face_pq_centroid_size(pq) +
+           (size_t)pq->lists * pq->dim * sizeof(float);
+}
+
+int face_pq_save(const struct face_pq *pq, void *blob, size_t size)
+{
+    struct face_pq_header h = {FACE_PQ_MAGIC, pq->dim, FACE_PQ_M, FACE_PQ_K, pq->lists};
+    char *p = (char *)blob + sizeof(h);
+
+    if (!pq->centroids || !pq->coarse || size < face_pq_size(pq))
+        return -1;
+    memcpy(blob, &h, sizeof(h));
+    memcpy(p, pq->centroids, face_pq_centroid_size(pq));
+    memcpy(p + face_pq_centroid_size(pq), pq->coarse, (size_t)pq->lists * pq->dim * sizeof(float));
+
+    return 0;
+}
+
+int face_pq_load(struct face_pq *pq, const void *blob, size_t size)
+{
+    struct face_pq_header h;
+
+    if (size < sizeof(h))
+        return -1;
+    memcpy(&h, blob, sizeof(h));
+    if (h.magic != FACE_PQ_MAGIC || h.m != FACE_PQ_M || h.k != FACE_PQ_K ||
+        !h.dim || h.dim % FACE_PQ_M || !h.lists || h.lists > FACE_PQ_LISTS)
+        return -1;
+
+    face_pq_release(pq);
+    pq->dim = h.dim;
+    pq->sub = h.dim / FACE_PQ_M;
+    pq->lists = h.lists;
+    if (size != face_pq_size(pq)) {
+        memset(pq, 0, sizeof(*pq));
+        return -1;
+    }
+    pq->centroids = (float *)malloc(face_pq_centroid_size(pq));
+    pq->coarse = (float *)malloc((size_t)pq->lists * pq->dim * sizeof(float));
+    if (!pq->centroids || !pq->coarse) {
+        face_pq_release(pq);
+        return -1;
+    }
+    memcpy(pq->centroids, (const char *)blob + sizeof(h), face_pq_centroid_size(pq));
+    memcpy(pq->coarse, (const char *)blob + sizeof(h) + face_pq_centroid_size(pq),
+           (size_t)pq->lists * pq->dim * sizeof(float));
+
+    return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __FACE_PQ_H__
+#define __FACE_PQ_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 64 subquantizers of 256 centroids, one byte each, 64 bytes per 512-d feature */
+#define FACE_PQ_M 64
+#define FACE_PQ_K 256
+/* coarse centroids of the inverted file, a code ends with the byte of its list */
+#define FACE_PQ_LISTS 256
+#define FACE_PQ_CODE (FACE_PQ_M + 1)
+
+struct face_pq {
+    int dim;
+    int sub;
+    float *centroids;
+    int lists;
+    float *coarse;
+};
+
+int face_pq_train(struct face_pq *pq, const float *vecs, int n, int dim, int iters);
+void face_pq_release(struct face_pq *pq);
+void face_pq_encode(const struct face_pq *pq, const float *v, uint8_t *code);
+void face_pq_lut(const struct face_pq *pq, const float *q, float *lut);
+float face_pq_score(const float *lut, const uint8_t *code);
+void face_pq_score4(const float *lut, const uint8_t *const *codes, float *scores);
+void face_pq_probe(const struct face_pq *pq, const float *q, int n, int *lists);
+size_t face_pq_size(const struct face_pq *pq);
+int face_pq_save(const struct face_pq *pq, void *blob, size_t size);
+int face_pq_load(struct face_pq *pq, const void *blob, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
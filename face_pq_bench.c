@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "face_pq.h"
+
+/*
+ * Memory, latency and recall of the product quantized gallery on
+ * synthetic identities. Every identity is a cluster center plus its own
+ * offset, regenerated from its index, so a million of them need no fp32
+ * copy. A query is an identity plus noise and is correct at rank 1 when it
+ * finds that identity, by the PQ score alone and after an exact re-rank
+ * of the best FACE_PQ_BENCH_RERANK.
+ */
+
+#define FACE_PQ_BENCH_DIM 512
+#define FACE_PQ_BENCH_CENTERS 1024
+#define FACE_PQ_BENCH_TRAIN 16384
+#define FACE_PQ_BENCH_QUERIES 200
+#define FACE_PQ_BENCH_RERANK 256
+
+static float g_centers[FACE_PQ_BENCH_CENTERS][FACE_PQ_BENCH_DIM];
+
+static long long face_pq_bench_us(void)
+{
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000000LL + t.tv_usec;
+}
+
+static inline uint32_t face_pq_bench_rand(uint32_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+static inline float face_pq_bench_uniform(uint32_t *s)
+{
+    return (face_pq_bench_rand(s) >> 8) / 16777216.0f - 0.5f;
+}
+
+static void face_pq_bench_unit(float *v)
+{
+    float norm = 0;
+
+    for (int j = 0; j < FACE_PQ_BENCH_DIM; j++)
+        norm += v[j] * v[j];
+    norm = 1 / sqrtf(norm);
+    for (int j = 0; j < FACE_PQ_BENCH_DIM; j++)
+        v[j] *= norm;
+}
+
+static void face_pq_bench_identity(int id, float *v)
+{
+    uint32_t s = id * 2654435761u + 1;
+    const float *c = g_centers[id % FACE_PQ_BENCH_CENTERS];
+
+    for (int j = 0; j < FACE_PQ_BENCH_DIM; j++)
+        v[j] = c[j] + 0.8f * face_pq_bench_uniform(&s);
+    face_pq_bench_unit(v);
+}
+
+static void face_pq_bench_query(int id, uint32_t *s, float *v)
+{
+    face_pq_bench_identity(id, v);
+    for (int j = 0; j < FACE_PQ_BENCH_DIM; j++)
+        v[j] += 0.3f * face_pq_bench_uniform(s);
+    face_pq_bench_unit(v);
+}
+
+static float face_pq_bench_dot(const float *a, const float *b)
+{
+    float dot = 0;
+
+    for (int j = 0; j < FACE_PQ_BENCH_DIM; j++)
+        dot += a[j] * b[j];
+
+    return dot;
+}
+
+struct face_pq_bench_hit {
+    int index;
+    float score;
+};
+
+/* keeps the n best, sorted, small n only */
+static void face_pq_bench_insert(struct face_pq_bench_hit *hits, int *cnt, int n, int index,
+                                 float score)
+{
+    int i;
+
+    if (*cnt == n && score <= hits[n - 1].score)
+        return;
+    i = *cnt < n ? (*cnt)++ : n - 1;
+    for (; i > 0 && hits[i - 1].score < score; i--)
+        hits[i] = hits[i - 1];
+    hits[i].index = index;
+    hits[i].score = score;
+}
+
+static int face_pq_bench_run(struct face_pq *pq, int num)
+{
+    static struct face_pq_bench_hit hits[FACE_PQ_BENCH_RERANK];
+    static float lut[FACE_PQ_M * FACE_PQ_K];
+    float v[FACE_PQ_BENCH_DIM], q[FACE_PQ_BENCH_DIM];
+    uint8_t *codes;
+    uint32_t s = 12345;
+    long long t0, encode_us, scan_us = 0;
+    int adc_ok = 0, rerank_ok = 0;
+
+    /* score4 reads whole groups of four */
+    codes = (uint8_t *)calloc((size_t)(num + 3) & ~3, FACE_PQ_CODE);
+    if (!codes) {
+        printf("%s: alloc %d codes fail\n", __func__, num);
+        return -1;
+    }
+
+    t0 = face_pq_bench_us();
+    for (int i = 0; i < num; i++) {
+        face_pq_bench_identity(i, v);
+        face_pq_encode(pq, v, codes + (size_t)i * FACE_PQ_CODE);
+    }
+    encode_us = face_pq_bench_us() - t0;
+
+    for (int n = 0; n < FACE_PQ_BENCH_QUERIES; n++) {
+        int id = face_pq_bench_rand(&s) % num;
+        int cnt = 0, best = -1;
+        float best_score = -2;
+
+        face_pq_bench_query(id, &s, q);
+        t0 = face_pq_bench_us();
+        face_pq_lut(pq, q, lut);
+        for (int i = 0; i < num; i += 4) {
+            const uint8_t *c = codes + (size_t)i * FACE_PQ_CODE;
+            const uint8_t *group[4] = {c, c + FACE_PQ_CODE, c + 2 * FACE_PQ_CODE,
+                                       c + 3 * FACE_PQ_CODE};
+            float scores[4];
+            face_pq_score4(lut, group, scores);
+            for (int t = 0; t < 4 && i + t < num; t++)
+                face_pq_bench_insert(hits, &cnt, FACE_PQ_BENCH_RERANK, i + t, scores[t]);
+        }
+        scan_us += face_pq_bench_us() - t0;
+
+        if (cnt && hits[0].index == id)
+            adc_ok++;
+        for (int i = 0; i < cnt; i++) {
+            float score;
+            face_pq_bench_identity(hits[i].index, v);
+            score = face_pq_bench_dot(q, v);
+            if (score > best_score) {
+                best_score = score;
+                best = hits[i].index;
+            }
+        }
+        if (best == id)
+            rerank_ok++;
+    }
+
+    printf("%d identities: memory fp32 %zu MB, binary %zu MB, pq %zu MB + %zu KB codebook, "
+           "int8 re-rank copy %zu MB\n",
+           num, (size_t)num * FACE_PQ_BENCH_DIM * sizeof(float) >> 20,
+           (size_t)num * FACE_PQ_BENCH_DIM / 8 >> 20, (size_t)num * FACE_PQ_CODE >> 20,
+           face_pq_size(pq) >> 10, (size_t)num * (FACE_PQ_BENCH_DIM + 8) >> 20);
+    printf("%d identities: encode %lld ms, pq scan avg %lld us, recall@1 pq %.1f%%, "
+           "re-ranked top %d %.1f%%\n", num, encode_us / 1000, scan_us / FACE_PQ_BENCH_QUERIES,
+           adc_ok * 100.0f / FACE_PQ_BENCH_QUERIES, FACE_PQ_BENCH_RERANK,
+           rerank_ok * 100.0f / FACE_PQ_BENCH_QUERIES);
+
+    free(codes);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static const int sizes[] = {100000, 500000, 1000000};
+    struct face_pq pq;
+    float *vecs;
+    uint32_t s = 1;
+    long long t0;
+
+    memset(&pq, 0, sizeof(pq));
+    for (int c = 0; c < FACE_PQ_BENCH_CENTERS; c++)
+        for (int j = 0; j < FACE_PQ_BENCH_DIM; j++)
+            g_centers[c][j] = face_pq_bench_uniform(&s);
+
+    vecs = (float *)malloc((size_t)FACE_PQ_BENCH_TRAIN * FACE_PQ_BENCH_DIM * sizeof(float));
+    if (!vecs) {
+        printf("%s: alloc fail\n", __func__);
+        return -1;
+    }
+    /* training identities are spread over the largest gallery */
+    for (int i = 0; i < FACE_PQ_BENCH_TRAIN; i++)
+        face_pq_bench_identity(i * 61, vecs + (size_t)i * FACE_PQ_BENCH_DIM);
+    t0 = face_pq_bench_us();
+    if (face_pq_train(&pq, vecs, FACE_PQ_BENCH_TRAIN, FACE_PQ_BENCH_DIM, 8)) {
+        free(vecs);
+        return -1;
+    }
+    printf("trained %d x %d codebook on %d features in %lld ms\n", FACE_PQ_M, FACE_PQ_K,
+           FACE_PQ_BENCH_TRAIN, (face_pq_bench_us() - t0) / 1000);
+    free(vecs);
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++)
+            face_pq_bench_run(&pq, atoi(argv[i]));
+    } else {
+        for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+            face_pq_bench_run(&pq, sizes[i]);
+    }
+
+    face_pq_release(&pq);
+    return 0;
+}
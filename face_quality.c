@@ -0,0 +1,245 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "face_quality.h"
+
+/*
+ * Cheap CPU checks that run before the NPU spends an extraction on a face.
+ * The face box of the RGB888 detect image is sampled on a grid of at most
+ * QUALITY_GRID x QUALITY_GRID points for the brightness, the contrast and
+ * the variance of the Laplacian, which drops quickly with motion or focus
+ * blur. The pose is estimated from the five landmarks. A threshold of 0
+ * turns the check off.
+ */
+
+#define QUALITY_GRID 64
+
+struct face_quality_config {
+    int blur;
+    int dark;
+    int bright;
+    int contrast;
+    int yaw;
+    int pitch;
+};
+
+static struct face_quality_config g_config = {
+    .blur = 60,
+    .dark = 40,
+    .bright = 220,
+    .contrast = 16,
+    .yaw = 35,
+    .pitch = 30,
+};
+
+static const char *g_reason_name[FACE_QUALITY_REASON_NUM] = {
+    "ok", "blur", "dark", "bright", "contrast", "pose",
+};
+
+/* "blur=60,dark=40,bright=220,contrast=16,yaw=35,pitch=30", any subset */
+int face_quality_set_config(const char *config)
+{
+    char buf[128];
+    char *save, *tok, *val;
+
+    if (!config)
+        return 0;
+
+    strncpy(buf, config, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        val = strchr(tok, '=');
+        if (!val) {
+            printf("%s: bad option %s\n", __func__, tok);
+            return -1;
+        }
+        *val++ = '\0';
+        if (!strcmp(tok, "blur"))
+            g_config.blur = atoi(val);
+        else if (!strcmp(tok, "dark"))
+            g_config.dark = atoi(val);
+        else if (!strcmp(tok, "bright"))
+            g_config.bright = atoi(val);
+        else if (!strcmp(tok, "contrast"))
+            g_config.contrast = atoi(val);
+        else if (!strcmp(tok, "yaw"))
+            g_config.yaw = atoi(val);
+        else if (!strcmp(tok, "pitch"))
+            g_config.pitch = atoi(val);
+        else {
+            printf("%s: unknown option %s\n", __func__, tok);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+const char *face_quality_reason_name(enum face_quality_reason reason)
+{
+    if (reason < 0 || reason >= FACE_QUALITY_REASON_NUM)
+        return "unknown";
+
+    return g_reason_name[reason];
+}
+
+static inline int face_quality_gray(const uint8_t *data, int stride, int x, int y)
+{
+    const uint8_t *p = data + y * stride + x * 3;
+
+    return (p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8;
+}
+
+static int face_quality_sqrt(long long v)
+{
+    int r = 0;
+
+    while ((long long)(r + 1) * (r + 1) <= v)
+        r++;
+
+    return r;
+}
+
+/* combines the measures into 0..100, used to compare frames of one face */
+static void face_quality_score(struct face_quality *q)
+{
+    int blur = g_config.blur ? q->blur * 50 / (g_config.blur * 4) : 50;
+    int yaw = g_config.yaw ? 30 - abs(q->yaw) * 30 / g_config.yaw : 30;
+    int pitch = g_config.pitch ? 20 - abs(q->pitch) * 20 / g_config.pitch : 20;
+
+    if (blur > 50)
+        blur = 50;
+    if (yaw < 0)
+        yaw = 0;
+    if (pitch < 0)
+        pitch = 0;
+    q->score = blur + yaw + pitch;
+}
+
+enum face_quality_reason face_quality_image(const rockface_image_t *image,
+                                            const rockface_rect_t *box,
+                                            struct face_quality *q)
+{
+    int stride = image->width * 3;
+    int left = box->left, top = box->top, right = box->right, bottom = box->bottom;
+    int step_x, step_y;
+    long long sum = 0, sum2 = 0, lsum = 0, lsum2 = 0;
+    int cnt = 0;
+
+    memset(q, 0, sizeof(*q));
+    if (left < 0)
+        left = 0;
+    if (top < 0)
+        top = 0;
+    if (right > (int)image->width)
+        right = image->width;
+    if (bottom > (int)image->height)
+        bottom = image->height;
+    if (right - left < 3 || bottom - top < 3)
+        return FACE_QUALITY_BLUR;
+
+    /* the Laplacian taps are one pixel apart, only the sample grid is sparse */
+    step_x = (right - left) / QUALITY_GRID + 1;
+    step_y = (bottom - top) / QUALITY_GRID + 1;
+    for (int y = top + 1; y < bottom - 1; y += step_y) {
+        for (int x = left + 1; x < right - 1; x += step_x) {
+            int c = face_quality_gray(image->data, stride, x, y);
+            int l = 4 * c - face_quality_gray(image->data, stride, x - 1, y) -
+                    face_quality_gray(image->data, stride, x + 1, y) -
+                    face_quality_gray(image->data, stride, x, y - 1) -
+                    face_quality_gray(image->data, stride, x, y + 1);
+            sum += c;
+            sum2 += c * c;
+            lsum += l;
+            lsum2 += l * l;
+            cnt++;
+        }
+    }
+    if (!cnt)
+        return FACE_QUALITY_BLUR;
+
+    q->luma = sum / cnt;
+    q->contrast = face_quality_sqrt(sum2 / cnt - (long long)q->luma * q->luma);
+    q->blur = lsum2 / cnt - (lsum / cnt) * (lsum / cnt);
+    face_quality_score(q);
+
+    if (g_config.dark && q->luma < g_config.dark)
+        return FACE_QUALITY_DARK;
+    if (g_config.bright && q->luma > g_config.bright)
+        return FACE_QUALITY_BRIGHT;
+    if (g_config.contrast && q->contrast < g_config.contrast)
+        return FACE_QUALITY_CONTRAST;
+    if (g_config.blur && q->blur < g_config.blur)
+        return FACE_QUALITY_BLUR;
+
+    return FACE_QUALITY_OK;
+}
+
+/*
+ * landmark5 order: left eye, right eye, nose, left and right mouth corner.
+ * The nose drifts off the eye center line with yaw and moves between the
+ * eye and the mouth line with pitch, frontal faces sit at about 45% of it.
+ */
+enum face_quality_reason face_quality_pose(const rockface_landmark_t *landmark,
+                                           struct face_quality *q)
+{
+    const rockface_point_t *p = landmark->landmarks;
+    int eye_x, eye_y, eye_dist, mouth_y, face_h;
+
+    if (landmark->landmarks_count < 5)
+        return FACE_QUALITY_OK;
+
+    eye_x = (p[0].x + p[1].x) / 2;
+    eye_y = (p[0].y + p[1].y) / 2;
+    eye_dist = abs(p[1].x - p[0].x);
+    mouth_y = (p[3].y + p[4].y) / 2;
+    face_h = mouth_y - eye_y;
+    if (eye_dist <= 0 || face_h <= 0)
+        return FACE_QUALITY_POSE;
+
+    /* a nose over one eye is roughly 45 degrees */
+    q->yaw = (p[2].x - eye_x) * 90 / eye_dist;
+    q->pitch = ((p[2].y - eye_y) * 100 / face_h - 45) * 90 / 100;
+    face_quality_score(q);
+
+    if (g_config.yaw && abs(q->yaw) > g_config.yaw)
+        return FACE_QUALITY_POSE;
+    if (g_config.pitch && abs(q->pitch) > g_config.pitch)
+        return FACE_QUALITY_POSE;
+
+    return FACE_QUALITY_OK;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __FACE_QUALITY_H__
+#define __FACE_QUALITY_H__
+
+#include <rockface/rockface.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum face_quality_reason {
+    FACE_QUALITY_OK,
+    FACE_QUALITY_BLUR,
+    FACE_QUALITY_DARK,
+    FACE_QUALITY_BRIGHT,
+    FACE_QUALITY_CONTRAST,
+    FACE_QUALITY_POSE,
+    FACE_QUALITY_REASON_NUM,
+};
+
+struct face_quality {
+    int blur;
+    int luma;
+    int contrast;
+    int yaw;
+    int pitch;
+    int score;
+};
+
+int face_quality_set_config(const char *config);
+enum face_quality_reason face_quality_image(const rockface_image_t *image,
+                                            const rockface_rect_t *box,
+                                            struct face_quality *q);
+enum face_quality_reason face_quality_pose(const rockface_landmark_t *landmark,
+                                           struct face_quality *q);
+const char *face_quality_reason_name(enum face_quality_reason reason);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
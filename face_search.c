@@ -0,0 +1,945 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "video_common.h"
+#include "face_search.h"
+
+/*
+ * Exhaustive cosine search over the gallery entries, which are records
+ * with a rockface_feature_t at some offset, either one array, the layout
+ * rockface_face_library_init() takes, or chunks of a power of two entries
+ * as face_gallery keeps them. The gallery is not copied, only the
+ * inverse norm of every entry is kept. The top k hits come back with their
+ * scores and the margin between the best and the second best. A hit at or
+ * above stop ends the scan early, the margin then only covers the entries
+ * scanned so far. Entries are either fp32 features or, to keep a large
+ * gallery small, int8 copies of them, struct face_search_q8, which are
+ * scaled back to floats one at a time where they are scored.
+ * The caller serializes searches and publishing, the
+ * hot set and the scratch buffers are shared, while an index is built
+ * without the lock. Every gallery change builds a new index next to the
+ * searched one, and face_search_publish() swaps it in.
+ *
+ * Most passes come from a small group of regulars, so the identities
+ * matched most often lately are also kept as unit vectors in one
+ * contiguous hot block, searched first against a stricter threshold.
+ * Every accepted match counts for its identity, the counts are halved
+ * every FACE_SEARCH_HOT_AGE matches so the set follows who is around,
+ * and a new identity replaces the entry with the lowest count.
+ *
+ * Galleries of FACE_SEARCH_CASCADE_MIN entries and more are searched in
+ * two stages. Every entry also gets a binary code, the signs of its unit
+ * vector minus the gallery mean, 64 bytes for 512 dimensions. The query
+ * code is compared to all of them by popcount Hamming distance, and only
+ * the FACE_SEARCH_RERANK closest entries are scored exactly. When product
+ * quantizer codes are set, they replace the binary codes, the prefilter
+ * then ranks by the asymmetric PQ score, which is closer to the exact
+ * one, and the FACE_SEARCH_RERANK best are kept in a heap. The PQ codes
+ * also name the coarse list of their entry, the index groups the entries
+ * by list, and only the FACE_SEARCH_PROBES lists nearest to the query are
+ * scored, about a sixteenth of the gallery with 256 lists. With -p one
+ * search in FACE_SEARCH_RECALL_EVERY is repeated exhaustively, and the
+ * recall@1 of the cascade against it is printed.
+ *
+ * face_search_batch() scores many probes exhaustively in one pass, e.g.
+ * to deduplicate an import. The gallery is walked in blocks small enough
+ * to stay in cache, and every block is scored against all probes, four at
+ * a time, before the next one is read, so the gallery streams from memory
+ * once per batch instead of once per probe.
+ */
+
+#define FACE_SEARCH_HOT_AGE (FACE_SEARCH_HOT_SIZE * 8)
+#define FACE_SEARCH_CASCADE_MIN 4096
+#define FACE_SEARCH_RERANK 256
+#define FACE_SEARCH_PROBES 16
+#define FACE_SEARCH_RECALL_EVERY 16
+#define FACE_SEARCH_WORDS ((FACE_SEARCH_DIM + 63) / 64)
+/* 32 gallery features are about 64 KB */
+#define FACE_SEARCH_BATCH_BLOCK 32
+#define FACE_SEARCH_BATCH_PROBES 4
+
+/* four lanes, NEON or SSE, unaligned loads are fine */
+typedef float face_search_v4sf __attribute__((vector_size(16), aligned(4)));
+
+struct face_search_hot_entry {
+    int index;
+    int len;
+    unsigned int count;
+    unsigned int last;
+};
+
+struct face_search_stat {
+    long long t0;
+    int hits;
+    int misses;
+    long long hot_us;
+    long long full_us;
+    unsigned int sampled;
+    int recall_n;
+    int recall_hits;
+};
+
+/*
+ * One version of the gallery index, never changed once built, so a new
+ * one can be built next to the one being searched. What a search writes
+ * lives in struct face_search.
+ */
+struct face_search_index {
+    void *const *chunks;
+    int shift;
+    int num;
+    size_t size;
+    size_t off;
+    enum face_search_format format;
+    float *inv_norm;
+
+    /* cascade prefilter, codes is NULL for small galleries */
+    uint64_t *codes;
+    int code_len;
+    float mean[FACE_SEARCH_DIM];
+    const struct face_pq *pq;
+    const uint8_t *const *pq_codes;
+    bool pq_en;
+    /* entries by coarse list, those of list l are list_ids[list_off[l]..list_off[l + 1]) */
+    int *list_off;
+    int *list_ids;
+};
+
+struct face_search {
+    struct face_search_index *index;
+    /* built by face_search_init(), freed by the next one */
+    struct face_search_index *owned;
+    void *single;
+    float lut[FACE_PQ_M * FACE_PQ_K];
+    /* Hamming distance of every entry to the query, grown to the largest index */
+    uint16_t *dist;
+    int dist_cap;
+
+    float hot_vec[FACE_SEARCH_HOT_SIZE][FACE_SEARCH_DIM] __attribute__((aligned(64)));
+    struct face_search_hot_entry hot[FACE_SEARCH_HOT_SIZE];
+    int hot_cnt;
+    unsigned int hot_events;
+    struct face_search_stat stat;
+};
+
+static struct face_search_index g_search_empty;
+static struct face_search g_search = {
+    .index = &g_search_empty,
+};
+
+static long long face_search_us(void)
+{
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000000LL + t.tv_usec;
+}
+
+static inline void *face_search_entry_at(const struct face_search_index *ix, int index)
+{
+    return (char *)ix->chunks[index >> ix->shift] + (index & ((1 << ix->shift) - 1)) * ix->size;
+}
+
+static inline const rockface_feature_t *face_search_feature(const struct face_search_index *ix,
+                                                            int index)
+{
+    return (const rockface_feature_t *)((char *)face_search_entry_at(ix, index) + ix->off);
+}
+
+static float face_search_inv_norm(const float *v, int len)
+{
+    float norm = 0;
+
+    for (int i = 0; i < len; i++)
+        norm += v[i] * v[i];
+
+    return norm > 0 ? 1 / sqrtf(norm) : 0;
+}
+
+static inline int face_search_len(const struct face_search_index *ix, int index)
+{
+    const char *e = (const char *)face_search_entry_at(ix, index) + ix->off;
+
+    if (ix->format == FACE_SEARCH_Q8)
+        return ((const struct face_search_q8 *)e)->len;
+
+    return ((const rockface_feature_t *)e)->len;
+}
+
+/* the stored vector of an entry, an int8 one is scaled into tmp */
+static inline const float *face_search_vec(const struct face_search_index *ix, int index,
+                                           float *tmp)
+{
+    const struct face_search_q8 *q;
+
+    if (ix->format != FACE_SEARCH_Q8)
+        return face_search_feature(ix, index)->feature;
+    q = (const struct face_search_q8 *)((char *)face_search_entry_at(ix, index) + ix->off);
+    for (int j = 0; j < q->len; j++)
+        tmp[j] = q->v[j] * q->scale;
+
+    return tmp;
+}
+
+void face_search_q8_encode(const rockface_feature_t *feature, struct face_search_q8 *q)
+{
+    int len = feature->len;
+    float max = 0;
+
+    memset(q, 0, sizeof(*q));
+    q->version = feature->version;
+    q->len = len;
+    if (len <= 0 || len > (int)FACE_SEARCH_DIM)
+        return;
+    for (int j = 0; j < len; j++)
+        if (fabsf(feature->feature[j]) > max)
+            max = fabsf(feature->feature[j]);
+    if (max == 0)
+        return;
+    q->scale = max / 127;
+    for (int j = 0; j < len; j++)
+        q->v[j] = (int8_t)lrintf(feature->feature[j] / q->scale);
+}
+
+/* the unit vector of q into v, returns its length */
+int face_search_q8_unit(const struct face_search_q8 *q, float *v)
+{
+    float inv;
+
+    if (q->len <= 0 || q->len > (int)FACE_SEARCH_DIM)
+        return 0;
+    for (int j = 0; j < q->len; j++)
+        v[j] = q->v[j] * q->scale;
+    inv = face_search_inv_norm(v, q->len);
+    for (int j = 0; j < q->len; j++)
+        v[j] *= inv;
+
+    return q->len;
+}
+
+static void face_search_encode(const struct face_search_index *ix, const float *v, float inv,
+                               int len, uint64_t *code)
+{
+    memset(code, 0, FACE_SEARCH_WORDS * sizeof(uint64_t));
+    for (int j = 0; j < len; j++)
+        if (v[j] * inv > ix->mean[j])
+            code[j / 64] |= 1ULL << (j % 64);
+}
+
+static int face_search_build_codes(struct face_search_index *ix)
+{
+    int num = ix->num;
+    int len = face_search_len(ix, 0);
+    float tmp[FACE_SEARCH_DIM];
+
+    if (len <= 0 || len > (int)FACE_SEARCH_DIM)
+        return 0;
+    ix->codes = (uint64_t *)malloc(num * FACE_SEARCH_WORDS * sizeof(uint64_t));
+    if (!ix->codes) {
+        printf("%s: alloc %d codes fail\n", __func__, num);
+        return -1;
+    }
+
+    ix->code_len = len;
+    memset(ix->mean, 0, sizeof(ix->mean));
+    for (int i = 0; i < num; i++) {
+        const float *f = face_search_vec(ix, i, tmp);
+        if (face_search_len(ix, i) == len)
+            for (int j = 0; j < len; j++)
+                ix->mean[j] += f[j] * ix->inv_norm[i];
+    }
+    for (int j = 0; j < len; j++)
+        ix->mean[j] /= num;
+    for (int i = 0; i < num; i++) {
+        const float *f = face_search_vec(ix, i, tmp);
+        face_search_encode(ix, f, ix->inv_norm[i], face_search_len(ix, i) == len ? len : 0,
+                           ix->codes + i * FACE_SEARCH_WORDS);
+    }
+
+    return 0;
+}
+
+static inline const uint8_t *face_search_pq_code(const struct face_search_index *ix, int index)
+{
+    return ix->pq_codes[index >> ix->shift] + (index & ((1 << ix->shift) - 1)) * FACE_PQ_CODE;
+}
+
+/* the inverted file, a counting sort of the entries by the list in their code */
+static int face_search_build_lists(struct face_search_index *ix)
+{
+    int lists = ix->pq->lists;
+
+    ix->list_off = (int *)calloc(lists + 1, sizeof(int));
+    ix->list_ids = (int *)malloc(ix->num * sizeof(int));
+    if (!ix->list_off || !ix->list_ids) {
+        printf("%s: alloc %d lists fail\n", __func__, lists);
+        return -1;
+    }
+    for (int i = 0; i < ix->num; i++) {
+        int l = face_search_pq_code(ix, i)[FACE_PQ_M];
+        ix->list_off[(l < lists ? l : lists - 1) + 1]++;
+    }
+    for (int l = 0; l < lists; l++)
+        ix->list_off[l + 1] += ix->list_off[l];
+    for (int i = 0; i < ix->num; i++) {
+        int l = face_search_pq_code(ix, i)[FACE_PQ_M];
+        ix->list_ids[ix->list_off[l < lists ? l : lists - 1]++] = i;
+    }
+    /* the fill moved every offset to the start of the next list */
+    memmove(ix->list_off + 1, ix->list_off, lists * sizeof(int));
+    ix->list_off[0] = 0;
+
+    return 0;
+}
+
+void face_search_index_free(struct face_search_index *ix)
+{
+    if (!ix)
+        return;
+    free(ix->inv_norm);
+    free(ix->codes);
+    free(ix->list_off);
+    free(ix->list_ids);
+    free(ix);
+}
+
+/*
+ * Index over chunks of 1 << shift entries each, with the product quantizer
+ * codes of the entries, FACE_PQ_CODE bytes each in chunks of as many, if pq
+ * is trained. The chunk tables, the entries and the codes must outlive the
+ * index. Only reads the
+ * gallery, so it runs on any thread while searches go on.
+ */
+struct face_search_index *face_search_build(void *const *chunks, int shift, int num,
+                                            size_t size, size_t off,
+                                            enum face_search_format format,
+                                            const struct face_pq *pq,
+                                            const uint8_t *const *codes)
+{
+    struct face_search_index *ix;
+    float tmp[FACE_SEARCH_DIM];
+
+    ix = (struct face_search_index *)calloc(1, sizeof(*ix));
+    if (!ix) {
+        printf("%s: alloc fail\n", __func__);
+        return NULL;
+    }
+    ix->chunks = chunks;
+    ix->shift = shift;
+    ix->num = num > 0 ? num : 0;
+    ix->size = size;
+    ix->off = off;
+    ix->format = format;
+    ix->pq = pq;
+    ix->pq_codes = codes;
+    if (!ix->num)
+        return ix;
+
+    ix->inv_norm = (float *)malloc(num * sizeof(float));
+    if (!ix->inv_norm) {
+        printf("%s: alloc %d norms fail\n", __func__, num);
+        goto fail;
+    }
+    for (int i = 0; i < num; i++) {
+        int len = face_search_len(ix, i);
+        ix->inv_norm[i] = len > 0 && len <= (int)FACE_SEARCH_DIM ?
+                          face_search_inv_norm(face_search_vec(ix, i, tmp), len) : 0;
+    }
+
+    if (num >= FACE_SEARCH_CASCADE_MIN && pq && codes && pq->centroids &&
+        pq->dim == face_search_len(ix, 0)) {
+        ix->pq_en = true;
+        if (pq->lists >= FACE_SEARCH_PROBES * 2 && face_search_build_lists(ix))
+            goto fail;
+    } else if (num >= FACE_SEARCH_CASCADE_MIN && face_search_build_codes(ix))
+        goto fail;
+
+    return ix;
+
+fail:
+    face_search_index_free(ix);
+    return NULL;
+}
+
+/*
+ * Makes ix the index searched from now on, under the lock the caller
+ * serializes searches with. With stable false gallery indexes may have
+ * moved and the hot set warms up again, otherwise ix only added entries
+ * and the hot set is kept. The previous index is not freed.
+ */
+void face_search_publish(struct face_search_index *ix, bool stable)
+{
+    g_search.index = ix ? ix : &g_search_empty;
+    if (!stable)
+        g_search.hot_cnt = 0;
+}
+
+/* one array, owned by face_search until the next init or exit */
+int face_search_init(void *data, int num, size_t size, size_t off)
+{
+    struct face_search_index *ix;
+
+    g_search.single = data;
+    ix = face_search_build(&g_search.single, 30, num, size, off, FACE_SEARCH_FP32, NULL, NULL);
+    if (!ix)
+        return -1;
+    face_search_publish(ix, false);
+    face_search_index_free(g_search.owned);
+    g_search.owned = ix;
+
+    return 0;
+}
+
+void face_search_exit(void)
+{
+    face_search_publish(NULL, false);
+    face_search_index_free(g_search.owned);
+    g_search.owned = NULL;
+    free(g_search.dist);
+    g_search.dist = NULL;
+    g_search.dist_cap = 0;
+}
+
+int face_search_num(void)
+{
+    return g_search.index->num;
+}
+
+static void face_search_insert(struct face_search_result *result, int k, int index, float score)
+{
+    int i;
+
+    if (result->cnt == k && score <= result->hits[k - 1].score)
+        return;
+    i = result->cnt < k ? result->cnt++ : k - 1;
+    for (; i > 0 && result->hits[i - 1].score < score; i--)
+        result->hits[i] = result->hits[i - 1];
+    result->hits[i].index = index;
+    result->hits[i].score = score;
+}
+
+static inline float face_search_dot1(const float *g, const float *p, int len)
+{
+    face_search_v4sf a = {0};
+    float dot;
+    int j;
+
+    for (j = 0; j + 4 <= len; j += 4)
+        a += *(const face_search_v4sf *)(g + j) * *(const face_search_v4sf *)(p + j);
+    dot = a[0] + a[1] + a[2] + a[3];
+    for (; j < len; j++)
+        dot += g[j] * p[j];
+
+    return dot;
+}
+
+static inline float face_search_score(const struct face_search_index *ix,
+                                      const rockface_feature_t *feature, float inv, int index)
+{
+    float tmp[FACE_SEARCH_DIM];
+    const float *f = face_search_vec(ix, index, tmp);
+
+    return face_search_dot1(feature->feature, f, feature->len) * inv * ix->inv_norm[index];
+}
+
+static void face_search_margin(struct face_search_result *result)
+{
+    if (result->cnt > 1)
+        result->margin = result->hits[0].score - result->hits[1].score;
+    else if (result->cnt == 1)
+        result->margin = result->hits[0].score;
+}
+
+static void face_search_exact(const struct face_search_index *ix,
+                              const rockface_feature_t *feature, float inv, int k, float stop,
+                              struct face_search_result *result)
+{
+    for (int i = 0; i < ix->num; i++) {
+        float score;
+
+        if (face_search_len(ix, i) != feature->len)
+            continue;
+        score = face_search_score(ix, feature, inv, i);
+        result->scanned++;
+        face_search_insert(result, k, i, score);
+        if (score >= stop) {
+            result->stopped = true;
+            break;
+        }
+    }
+}
+
+static bool face_search_dist_reserve(int num)
+{
+    uint16_t *dist;
+
+    if (num <= g_search.dist_cap)
+        return true;
+    dist = (uint16_t *)realloc(g_search.dist, num * sizeof(uint16_t));
+    if (!dist) {
+        printf("%s: alloc %d distances fail\n", __func__, num);
+        return false;
+    }
+    g_search.dist = dist;
+    g_search.dist_cap = num;
+
+    return true;
+}
+
+static void face_search_cascade(const struct face_search_index *ix,
+                                const rockface_feature_t *feature, float inv, int k, float stop,
+                                struct face_search_result *result)
+{
+    uint64_t code[FACE_SEARCH_WORDS];
+    int hist[FACE_SEARCH_DIM + 1];
+    const uint64_t *c = ix->codes;
+    uint16_t *dist = g_search.dist;
+    int limit, below = 0, ties;
+
+    face_search_encode(ix, feature->feature, inv, feature->len, code);
+    memset(hist, 0, sizeof(hist));
+    for (int i = 0; i < ix->num; i++, c += FACE_SEARCH_WORDS) {
+        int d = 0;
+        for (int w = 0; w < (int)FACE_SEARCH_WORDS; w++)
+            d += __builtin_popcountll(code[w] ^ c[w]);
+        dist[i] = d;
+        hist[d]++;
+    }
+
+    /* the distance that takes the candidates up to FACE_SEARCH_RERANK */
+    for (limit = 0; limit < (int)FACE_SEARCH_DIM; limit++) {
+        if (below + hist[limit] >= FACE_SEARCH_RERANK)
+            break;
+        below += hist[limit];
+    }
+    ties = FACE_SEARCH_RERANK - below;
+
+    for (int i = 0; i < ix->num; i++) {
+        float score;
+
+        if (dist[i] > limit || (dist[i] == limit && ties-- <= 0))
+            continue;
+        if (face_search_len(ix, i) != feature->len)
+            continue;
+        score = face_search_score(ix, feature, inv, i);
+        result->scanned++;
+        face_search_insert(result, k, i, score);
+        if (score >= stop) {
+            result->stopped = true;
+            break;
+        }
+    }
+}
+
+/* min heap on the score, the root is the weakest candidate kept */
+static void face_search_heap_push(struct face_search_hit *heap, int *n, int index, float score)
+{
+    int i;
+
+    if (*n == FACE_SEARCH_RERANK) {
+        if (score <= heap[0].score)
+            return;
+        for (i = 0;;) {
+            int c = 2 * i + 1;
+            if (c >= *n)
+                break;
+            if (c + 1 < *n && heap[c + 1].score < heap[c].score)
+                c++;
+            if (heap[c].score >= score)
+                break;
+            heap[i] = heap[c];
+            i = c;
+        }
+    } else {
+        for (i = (*n)++; i > 0 && heap[(i - 1) / 2].score > score; i = (i - 1) / 2)
+            heap[i] = heap[(i - 1) / 2];
+    }
+    heap[i].index = index;
+    heap[i].score = score;
+}
+
+/* ADC scores of up to four codes into the heap */
+static inline void face_search_score_codes(struct face_search_hit *heap, int *n,
+                                           const uint8_t **codes, const int *ids, int m)
+{
+    float scores[4];
+
+    if (m == 4) {
+        face_pq_score4(g_search.lut, codes, scores);
+        for (int t = 0; t < 4; t++)
+            face_search_heap_push(heap, n, ids[t], scores[t]);
+        return;
+    }
+    for (int t = 0; t < m; t++)
+        face_search_heap_push(heap, n, ids[t], face_pq_score(g_search.lut, codes[t]));
+}
+
+static void face_search_cascade_pq(const struct face_search_index *ix,
+                                   const rockface_feature_t *feature, float inv, int k,
+                                   float stop, struct face_search_result *result)
+{
+    struct face_search_hit heap[FACE_SEARCH_RERANK];
+    const uint8_t *codes[4];
+    int ids[4];
+    float q[FACE_SEARCH_DIM];
+    int lists[FACE_SEARCH_PROBES];
+    int probes = ix->list_off ? FACE_SEARCH_PROBES : 1;
+    int n = 0, m = 0;
+
+    for (int j = 0; j < feature->len; j++)
+        q[j] = feature->feature[j] * inv;
+    face_pq_lut(ix->pq, q, g_search.lut);
+    if (ix->list_off)
+        face_pq_probe(ix->pq, q, probes, lists);
+
+    /* without lists the one probe is the whole gallery */
+    for (int p = 0; p < probes; p++) {
+        int i = ix->list_off ? ix->list_off[lists[p]] : 0;
+        int end = ix->list_off ? ix->list_off[lists[p] + 1] : ix->num;
+        for (; i < end; i++) {
+            ids[m] = ix->list_off ? ix->list_ids[i] : i;
+            codes[m] = face_search_pq_code(ix, ids[m]);
+            if (++m < 4)
+                continue;
+            face_search_score_codes(heap, &n, codes, ids, m);
+            m = 0;
+        }
+    }
+    face_search_score_codes(heap, &n, codes, ids, m);
+
+    for (int i = 0; i < n; i++) {
+        float score;
+
+        if (face_search_len(ix, heap[i].index) != feature->len)
+            continue;
+        score = face_search_score(ix, feature, inv, heap[i].index);
+        result->scanned++;
+        face_search_insert(result, k, heap[i].index, score);
+        if (score >= stop) {
+            result->stopped = true;
+            break;
+        }
+    }
+}
+
+static inline bool face_search_cascaded(const struct face_search_index *ix,
+                                       const rockface_feature_t *feature)
+{
+    if (ix->pq_en)
+        return feature->len == ix->pq->dim;
+
+    return ix->codes && feature->len == ix->code_len;
+}
+
+int face_search_topk(const rockface_feature_t *feature, int k, float stop,
+                     struct face_search_result *result)
+{
+    const struct face_search_index *ix = g_search.index;
+    float inv;
+
+    memset(result, 0, sizeof(*result));
+    if (k <= 0)
+        return 0;
+    if (k > FACE_SEARCH_MAX_K)
+        k = FACE_SEARCH_MAX_K;
+    inv = face_search_inv_norm(feature->feature, feature->len);
+    if (inv == 0)
+        return 0;
+
+    if (face_search_cascaded(ix, feature) && ix->pq_en)
+        face_search_cascade_pq(ix, feature, inv, k, stop, result);
+    else if (face_search_cascaded(ix, feature) && face_search_dist_reserve(ix->num))
+        face_search_cascade(ix, feature, inv, k, stop, result);
+    else
+        face_search_exact(ix, feature, inv, k, stop, result);
+    face_search_margin(result);
+
+    return result->cnt;
+}
+
+/* the cascade top hit against the exhaustive one */
+static void face_search_recall(const rockface_feature_t *feature,
+                               const struct face_search_result *result)
+{
+    struct face_search_result exact;
+    float inv = face_search_inv_norm(feature->feature, feature->len);
+
+    memset(&exact, 0, sizeof(exact));
+    face_search_exact(g_search.index, feature, inv, 1, 2.0f, &exact);
+    if (!exact.cnt)
+        return;
+    g_search.stat.recall_n++;
+    if (result->cnt && result->hits[0].index == exact.hits[0].index)
+        g_search.stat.recall_hits++;
+}
+
+int face_search_hot(const rockface_feature_t *feature, float accept,
+                    struct face_search_result *result)
+{
+    int len = feature->len;
+    float inv;
+
+    memset(result, 0, sizeof(*result));
+    inv = face_search_inv_norm(feature->feature, len);
+    if (inv == 0)
+        return 0;
+
+    for (int i = 0; i < g_search.hot_cnt; i++) {
+        float dot;
+
+        if (g_search.hot[i].len != len)
+            continue;
+        dot = face_search_dot1(feature->feature, g_search.hot_vec[i], len);
+        result->scanned++;
+        face_search_insert(result, 2, g_search.hot[i].index, dot * inv);
+    }
+    if (!result->cnt || result->hits[0].score < accept) {
+        result->cnt = 0;
+        return 0;
+    }
+
+    result->hot = true;
+    result->margin = result->cnt > 1 ? result->hits[0].score - result->hits[1].score :
+                     result->hits[0].score;
+    result->cnt = 1;
+
+    return 1;
+}
+
+void face_search_hot_update(int index)
+{
+    const struct face_search_index *ix = g_search.index;
+    float tmp[FACE_SEARCH_DIM];
+    const float *f;
+    struct face_search_hot_entry *e = NULL;
+    int len;
+
+    if (index < 0 || index >= ix->num)
+        return;
+
+    g_search.hot_events++;
+    if (!(g_search.hot_events % FACE_SEARCH_HOT_AGE))
+        for (int i = 0; i < g_search.hot_cnt; i++)
+            g_search.hot[i].count >>= 1;
+
+    for (int i = 0; i < g_search.hot_cnt; i++) {
+        if (g_search.hot[i].index == index) {
+            g_search.hot[i].count++;
+            g_search.hot[i].last = g_search.hot_events;
+            return;
+        }
+    }
+
+    len = face_search_len(ix, index);
+    if (len <= 0 || len > (int)FACE_SEARCH_DIM || ix->inv_norm[index] == 0)
+        return;
+
+    if (g_search.hot_cnt < FACE_SEARCH_HOT_SIZE) {
+        e = &g_search.hot[g_search.hot_cnt++];
+    } else {
+        e = &g_search.hot[0];
+        for (int i = 1; i < FACE_SEARCH_HOT_SIZE; i++) {
+            struct face_search_hot_entry *c = &g_search.hot[i];
+            if (c->count < e->count || (c->count == e->count && c->last < e->last))
+                e = c;
+        }
+    }
+
+    e->index = index;
+    e->len = len;
+    e->count = 1;
+    e->last = g_search.hot_events;
+    f = face_search_vec(ix, index, tmp);
+    for (int j = 0; j < len; j++)
+        g_search.hot_vec[e - g_search.hot][j] = f[j] * ix->inv_norm[index];
+}
+
+static void face_search_stat(long long now)
+{
+    struct face_search_stat *stat = &g_search.stat;
+    int cnt = stat->hits + stat->misses;
+
+    if (!stat->t0)
+        stat->t0 = now;
+    if (now - stat->t0 < 1000000 || !cnt)
+        return;
+
+    printf("face search: hot hit %d/%d (%d%%), hot set %d, hot avg: %lldus, full avg: %lldus\n",
+           stat->hits, cnt, stat->hits * 100 / cnt, g_search.hot_cnt,
+           stat->hot_us / cnt, stat->misses ? stat->full_us / stat->misses : 0);
+    stat->hits = 0;
+    stat->misses = 0;
+    stat->hot_us = 0;
+    stat->full_us = 0;
+    stat->t0 = now;
+    /* recall is sampled sparsely, so it is kept since start */
+    if (stat->recall_n)
+        printf("face search: %s cascade over %d entries, recall@1 %d/%d (%.1f%%)\n",
+               g_search.index->pq_en ? "pq" : "binary", g_search.index->num, stat->recall_hits,
+               stat->recall_n,
+               stat->recall_hits * 100.0f / stat->recall_n);
+}
+
+/* the hot set first, the whole gallery on a miss */
+int face_search(const rockface_feature_t *feature, int k, float stop, float hot_accept,
+                struct face_search_result *result)
+{
+    long long t0, t1, t2;
+    int ret;
+
+    t0 = face_search_us();
+    ret = face_search_hot(feature, hot_accept, result);
+    t1 = face_search_us();
+    if (!ret)
+        ret = face_search_topk(feature, k, stop, result);
+    t2 = face_search_us();
+
+    g_search.stat.hot_us += t1 - t0;
+    if (result->hot) {
+        g_search.stat.hits++;
+    } else {
+        g_search.stat.misses++;
+        g_search.stat.full_us += t2 - t1;
+        if (g_perf_en && face_search_cascaded(g_search.index, feature) &&
+            !(++g_search.stat.sampled % FACE_SEARCH_RECALL_EVERY))
+            face_search_recall(feature, result);
+    }
+    if (g_perf_en)
+        face_search_stat(t2);
+
+    return ret;
+}
+
+/* dot products of one gallery vector with four probes, stride floats apart */
+static inline void face_search_dot4(const float *g, const float *p, int len, int stride,
+                                    float *out)
+{
+    face_search_v4sf a0 = {0}, a1 = {0}, a2 = {0}, a3 = {0};
+    int j;
+
+    for (j = 0; j + 4 <= len; j += 4) {
+        face_search_v4sf x = *(const face_search_v4sf *)(g + j);
+        a0 += x * *(const face_search_v4sf *)(p + j);
+        a1 += x * *(const face_search_v4sf *)(p + stride + j);
+        a2 += x * *(const face_search_v4sf *)(p + 2 * stride + j);
+        a3 += x * *(const face_search_v4sf *)(p + 3 * stride + j);
+    }
+    out[0] = a0[0] + a0[1] + a0[2] + a0[3];
+    out[1] = a1[0] + a1[1] + a1[2] + a1[3];
+    out[2] = a2[0] + a2[1] + a2[2] + a2[3];
+    out[3] = a3[0] + a3[1] + a3[2] + a3[3];
+    for (; j < len; j++)
+        for (int i = 0; i < 4; i++)
+            out[i] += g[j] * p[i * stride + j];
+}
+
+/*
+ * Exhaustive top k of n probes of the same length, no early stop, the
+ * hot set is not used. Returns -1 if the probe buffer can not be had.
+ */
+int face_search_batch(const rockface_feature_t *const *features, int n, int k,
+                      struct face_search_result *results)
+{
+    const struct face_search_index *ix = g_search.index;
+    int groups = (n + FACE_SEARCH_BATCH_PROBES - 1) / FACE_SEARCH_BATCH_PROBES;
+    int stride = FACE_SEARCH_DIM;
+    int len;
+    float *probes;
+
+    if (n <= 0)
+        return 0;
+    if (k > FACE_SEARCH_MAX_K)
+        k = FACE_SEARCH_MAX_K;
+    len = features[0]->len;
+    memset(results, 0, n * sizeof(*results));
+    if (k <= 0 || len <= 0 || len > (int)FACE_SEARCH_DIM)
+        return 0;
+
+    probes = (float *)calloc((size_t)groups * FACE_SEARCH_BATCH_PROBES, stride * sizeof(float));
+    if (!probes) {
+        printf("%s: alloc %d probes fail\n", __func__, n);
+        return -1;
+    }
+    for (int p = 0; p < n; p++) {
+        float inv;
+        if (features[p]->len != len)
+            continue;
+        inv = face_search_inv_norm(features[p]->feature, len);
+        for (int j = 0; j < len; j++)
+            probes[p * stride + j] = features[p]->feature[j] * inv;
+    }
+
+    for (int b = 0; b < ix->num; b += FACE_SEARCH_BATCH_BLOCK) {
+        int end = b + FACE_SEARCH_BATCH_BLOCK < ix->num ? b + FACE_SEARCH_BATCH_BLOCK : ix->num;
+        for (int g = 0; g < groups; g++) {
+            const float *p = probes + (size_t)g * FACE_SEARCH_BATCH_PROBES * stride;
+            int cnt = n - g * FACE_SEARCH_BATCH_PROBES;
+            if (cnt > FACE_SEARCH_BATCH_PROBES)
+                cnt = FACE_SEARCH_BATCH_PROBES;
+            for (int i = b; i < end; i++) {
+                float tmp[FACE_SEARCH_DIM];
+                float dot[FACE_SEARCH_BATCH_PROBES];
+                const float *f;
+                if (face_search_len(ix, i) != len)
+                    continue;
+                f = face_search_vec(ix, i, tmp);
+                /* a last partial group goes probe by probe */
+                if (cnt == FACE_SEARCH_BATCH_PROBES)
+                    face_search_dot4(f, p, len, stride, dot);
+                else
+                    for (int q = 0; q < cnt; q++)
+                        dot[q] = face_search_dot1(f, p + q * stride, len);
+                for (int q = 0; q < cnt; q++) {
+                    int idx = g * FACE_SEARCH_BATCH_PROBES + q;
+                    if (features[idx]->len != len)
+                        continue;
+                    results[idx].scanned++;
+                    face_search_insert(&results[idx], k, i, dot[q] * ix->inv_norm[i]);
+                }
+            }
+        }
+    }
+
+    for (int p = 0; p < n; p++)
+        face_search_margin(&results[p]);
+    free(probes);
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __FACE_SEARCH_H__
+#define __FACE_SEARCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <rockface/rockface.h>
+
+#include "face_pq.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FACE_SEARCH_MAX_K 8
+/* 128 x 512 floats, 256 KB, sized to stay in L2 */
+#define FACE_SEARCH_HOT_SIZE 128
+#define FACE_SEARCH_DIM (sizeof(((rockface_feature_t *)0)->feature) / sizeof(float))
+
+/*
+ * Scalar int8 copy of a feature, a quarter of the fp32 size, what the
+ * gallery keeps with -q. The value of v[j] is v[j] * scale.
+ */
+struct face_search_q8 {
+    float scale;
+    int version;
+    int len;
+    int8_t v[FACE_SEARCH_DIM];
+};
+
+enum face_search_format {
+    FACE_SEARCH_FP32,
+    FACE_SEARCH_Q8,
+};
+
+struct face_search_hit {
+    int index;
+    float score;
+};
+
+/* hits sorted by descending cosine similarity */
+struct face_search_result {
+    int cnt;
+    struct face_search_hit hits[FACE_SEARCH_MAX_K];
+    float margin;
+    int scanned;
+    bool stopped;
+    bool hot;
+};
+
+struct face_search_index;
+
+struct face_search_index *face_search_build(void *const *chunks, int shift, int num,
+                                            size_t size, size_t off,
+                                            enum face_search_format format,
+                                            const struct face_pq *pq,
+                                            const uint8_t *const *codes);
+void face_search_q8_encode(const rockface_feature_t *feature, struct face_search_q8 *q);
+int face_search_q8_unit(const struct face_search_q8 *q, float *v);
+void face_search_index_free(struct face_search_index *ix);
+void face_search_publish(struct face_search_index *ix, bool stable);
+int face_search_init(void *data, int num, size_t size, size_t off);
+void face_search_exit(void);
+int face_search_num(void);
+int face_search_topk(const rockface_feature_t *feature, int k, float stop,
+                     struct face_search_result *result);
+int face_search_hot(const rockface_feature_t *feature, float accept,
+                    struct face_search_result *result);
+void face_search_hot_update(int index);
+int face_search(const rockface_feature_t *feature, int k, float stop, float hot_accept,
+                struct face_search_result *result);
+int face_search_batch(const rockface_feature_t *const *features, int n, int k,
+                      struct face_search_result *results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "face_pq.h"
+#include "face_search.h"
+
+/*
+ * Throughput of face_search_batch() against the same exhaustive scan one
+ * probe at a time, and latency and recall@1 against it of
+ * face_search_topk() with the binary prefilter and with the product
+ * quantizer and its inverted file, the two cascades of large galleries.
+ * Identities are cluster centers plus their own offset, the layout the
+ * gate loads, and probes are noisy identities. Usage: face_search_bench
+ * [gallery size] [probes].
+ */
+
+#define FACE_SEARCH_BENCH_NUM 100000
+#define FACE_SEARCH_BENCH_PROBES 200
+#define FACE_SEARCH_BENCH_K 3
+#define FACE_SEARCH_BENCH_CENTERS 1024
+#define FACE_SEARCH_BENCH_TRAIN 16384
+
+static long long face_search_bench_us(void)
+{
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000000LL + t.tv_usec;
+}
+
+static float face_search_bench_uniform(void)
+{
+    return rand() / (float)RAND_MAX - 0.5f;
+}
+
+/* unit length copy of f into v */
+static void face_search_bench_unit(const rockface_feature_t *f, float *v)
+{
+    float norm = 0;
+
+    for (int j = 0; j < f->len; j++)
+        norm += f->feature[j] * f->feature[j];
+    norm = norm > 0 ? 1 / sqrtf(norm) : 0;
+    for (int j = 0; j < f->len; j++)
+        v[j] = f->feature[j] * norm;
+}
+
+/* top-k of every probe, its latency and how often its top hit is the exhaustive one */
+static void face_search_bench_topk(const char *name, rockface_feature_t *probes, int n,
+                                   const struct face_search_result *exact)
+{
+    struct face_search_result result;
+    long long t0, us = 0, scanned = 0;
+    int agree = 0;
+
+    for (int p = 0; p < n; p++) {
+        t0 = face_search_bench_us();
+        face_search_topk(&probes[p], FACE_SEARCH_BENCH_K, 2.0f, &result);
+        us += face_search_bench_us() - t0;
+        scanned += result.scanned;
+        if (result.cnt && exact[p].cnt && result.hits[0].index == exact[p].hits[0].index)
+            agree++;
+    }
+    printf("%s %lld us/probe, %lld scored exactly, recall@1 %.1f%%\n", name, us / n,
+           scanned / n, agree * 100.0f / n);
+}
+
+/* the product quantizer of the gallery, its codes in one array and the index over them */
+static struct face_search_index *face_search_bench_pq(rockface_feature_t *data, int num,
+                                                      struct face_pq *pq, uint8_t **codes)
+{
+    static void *chunks;
+    int n = num < FACE_SEARCH_BENCH_TRAIN ? num : FACE_SEARCH_BENCH_TRAIN;
+    float *vecs;
+    long long t0;
+
+    vecs = (float *)malloc((size_t)n * FACE_SEARCH_DIM * sizeof(float));
+    *codes = (uint8_t *)malloc((size_t)num * FACE_PQ_CODE);
+    if (!vecs || !*codes) {
+        printf("%s: alloc fail\n", __func__);
+        free(vecs);
+        return NULL;
+    }
+    for (int i = 0; i < n; i++)
+        face_search_bench_unit(&data[(long)i * num / n], vecs + (size_t)i * FACE_SEARCH_DIM);
+    t0 = face_search_bench_us();
+    if (face_pq_train(pq, vecs, n, FACE_SEARCH_DIM, 8)) {
+        free(vecs);
+        return NULL;
+    }
+    for (int i = 0; i < num; i++) {
+        face_search_bench_unit(&data[i], vecs);
+        face_pq_encode(pq, vecs, *codes + (size_t)i * FACE_PQ_CODE);
+    }
+    printf("trained %d lists and encoded %d entries in %lld ms\n", pq->lists, num,
+           (face_search_bench_us() - t0) / 1000);
+    free(vecs);
+    chunks = data;
+
+    return face_search_build(&chunks, 30, num, sizeof(*data), 0, FACE_SEARCH_FP32, pq,
+                             (const uint8_t *const *)codes);
+}
+
+int main(int argc, char *argv[])
+{
+    int num = argc > 1 ? atoi(argv[1]) : FACE_SEARCH_BENCH_NUM;
+    int n = argc > 2 ? atoi(argv[2]) : FACE_SEARCH_BENCH_PROBES;
+    rockface_feature_t *data;
+    rockface_feature_t *probes;
+    const rockface_feature_t **ptrs;
+    struct face_search_result *exact, *batch;
+    struct face_search_index *ix;
+    struct face_pq pq;
+    uint8_t *codes = NULL;
+    float (*centers)[FACE_SEARCH_DIM];
+    long long t0, exact_us, batch_us;
+    int agree = 0;
+
+    if (num <= 0 || n <= 0)
+        return -1;
+    data = (rockface_feature_t *)calloc(num, sizeof(*data));
+    probes = (rockface_feature_t *)calloc(n, sizeof(*probes));
+    ptrs = (const rockface_feature_t **)calloc(n, sizeof(*ptrs));
+    exact = (struct face_search_result *)calloc(n, sizeof(*exact));
+    batch = (struct face_search_result *)calloc(n, sizeof(*batch));
+    centers = (float (*)[FACE_SEARCH_DIM])malloc(FACE_SEARCH_BENCH_CENTERS * sizeof(*centers));
+    if (!data || !probes || !ptrs || !exact || !batch || !centers) {
+        printf("%s: alloc fail\n", __func__);
+        return -1;
+    }
+
+    srand(1);
+    for (int c = 0; c < FACE_SEARCH_BENCH_CENTERS; c++)
+        for (int j = 0; j < (int)FACE_SEARCH_DIM; j++)
+            centers[c][j] = face_search_bench_uniform();
+    for (int i = 0; i < num; i++) {
+        const float *c = centers[rand() % FACE_SEARCH_BENCH_CENTERS];
+        data[i].len = FACE_SEARCH_DIM;
+        for (int j = 0; j < (int)FACE_SEARCH_DIM; j++)
+            data[i].feature[j] = c[j] + 0.8f * face_search_bench_uniform();
+    }
+    for (int p = 0; p < n; p++) {
+        probes[p] = data[rand() % num];
+        for (int j = 0; j < (int)FACE_SEARCH_DIM; j++)
+            probes[p].feature[j] += 0.3f * face_search_bench_uniform();
+        ptrs[p] = &probes[p];
+    }
+    if (face_search_init(data, num, sizeof(*data), 0))
+        return -1;
+
+    /* the exhaustive scan is the reference of the recall */
+    t0 = face_search_bench_us();
+    for (int p = 0; p < n; p++)
+        face_search_batch(&ptrs[p], 1, FACE_SEARCH_BENCH_K, &exact[p]);
+    exact_us = face_search_bench_us() - t0;
+
+    t0 = face_search_bench_us();
+    face_search_batch(ptrs, n, FACE_SEARCH_BENCH_K, batch);
+    batch_us = face_search_bench_us() - t0;
+
+    for (int p = 0; p < n; p++)
+        if (exact[p].cnt && batch[p].cnt && exact[p].hits[0].index == batch[p].hits[0].index)
+            agree++;
+
+    printf("%d probes x %d entries\n", n, num);
+    printf("single: %lld us/probe, %.1f GFLOPS\n", exact_us / n,
+           2.0 * n * num * FACE_SEARCH_DIM / exact_us / 1000);
+    printf("batch:  %lld us/probe, %.1f GFLOPS, top hit agrees %d/%d\n", batch_us / n,
+           2.0 * n * num * FACE_SEARCH_DIM / batch_us / 1000, agree, n);
+    face_search_bench_topk("binary:", probes, n, exact);
+
+    memset(&pq, 0, sizeof(pq));
+    ix = face_search_bench_pq(data, num, &pq, &codes);
+    if (ix) {
+        face_search_publish(ix, false);
+        face_search_bench_topk("pq ivf:", probes, n, exact);
+        face_search_publish(NULL, false);
+        face_search_index_free(ix);
+    }
+
+    face_search_exit();
+    face_pq_release(&pq);
+    free(codes);
+    free(data);
+    free(probes);
+    free(ptrs);
+    free(exact);
+    free(batch);
+    free(centers);
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "feature_pool.h"
+
+/*
+ * Worker threads for extraction heavy batches such as enrollment. There is
+ * one worker per recognizer handle, each job checks a handle out of the
+ * npu_scheduler itself, so image decoding and the CPU side of the models
+ * overlap while the NPU stays busy. One batch runs at a time, the caller
+ * blocks until every job of it is done.
+ */
+
+struct feature_pool {
+    pthread_t tid[FEATURE_POOL_MAX_WORKERS];
+    int workers;
+    bool run;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_cond_t done_cond;
+    pthread_mutex_t batch_mutex;
+    feature_pool_func func;
+    char *jobs;
+    size_t size;
+    int cnt;
+    int next;
+    int done;
+};
+
+static struct feature_pool g_pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+    .batch_mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void *feature_pool_thread(void *arg)
+{
+    struct feature_pool *pool = (struct feature_pool *)arg;
+    void *job;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->run) {
+        if (pool->next >= pool->cnt) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
+        job = pool->jobs + pool->next * pool->size;
+        pool->next++;
+        pthread_mutex_unlock(&pool->mutex);
+
+        pool->func(job);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (++pool->done == pool->cnt)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    pthread_exit(NULL);
+}
+
+void feature_pool_run(feature_pool_func func, void *jobs, int cnt, size_t size)
+{
+    struct feature_pool *pool = &g_pool;
+
+    if (cnt <= 0)
+        return;
+
+    /* without workers the batch simply runs on the caller */
+    if (!pool->workers) {
+        for (int i = 0; i < cnt; i++)
+            func((char *)jobs + i * size);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->batch_mutex);
+    pthread_mutex_lock(&pool->mutex);
+    pool->func = func;
+    pool->jobs = (char *)jobs;
+    pool->size = size;
+    pool->cnt = cnt;
+    pool->next = 0;
+    pool->done = 0;
+    pthread_cond_broadcast(&pool->cond);
+    while (pool->done < pool->cnt)
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    pool->cnt = 0;
+    pool->next = 0;
+    pthread_mutex_unlock(&pool->mutex);
+    pthread_mutex_unlock(&pool->batch_mutex);
+}
+
+int feature_pool_workers(void)
+{
+    return g_pool.workers;
+}
+
+int feature_pool_init(int workers)
+{
+    struct feature_pool *pool = &g_pool;
+
+    if (workers > FEATURE_POOL_MAX_WORKERS)
+        workers = FEATURE_POOL_MAX_WORKERS;
+
+    pool->run = true;
+    for (pool->workers = 0; pool->workers < workers; pool->workers++) {
+        if (pthread_create(&pool->tid[pool->workers], NULL, feature_pool_thread, pool)) {
+            printf("%s: pthread_create fail\n", __func__);
+            feature_pool_exit();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void feature_pool_exit(void)
+{
+    struct feature_pool *pool = &g_pool;
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->run = false;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->mutex);
+    for (int i = 0; i < pool->workers; i++)
+        pthread_join(pool->tid[i], NULL);
+    pool->workers = 0;
+}
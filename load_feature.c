@@ -37,10 +37,17 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
 #include "face_common.h"
 #include "load_feature.h"
 #include "database.h"
+#include "feature_pool.h"
+
+/* images extracted in parallel before they are handed over */
+#define LOAD_BATCH 16
+/* progress is printed this often */
+#define LOAD_PROGRESS_MS 1000
 
 static get_path_feature_t get_path_feature_cb = NULL;
 void register_get_path_feature(get_path_feature_t cb)
@@ -75,39 +82,136 @@ int count_file(const char *path, char *fmt)
     return cnt;
 }
 
-int load_feature(const char *path, char *fmt, void *data, unsigned int cnt)
+struct load_job {
+    char path[512];
+    char name[NAME_LEN];
+    rockface_feature_t feature;
+    int ret;
+};
+
+struct load_batch {
+    struct load_job jobs[LOAD_BATCH];
+    int cnt;
+    load_feature_cb cb;
+    void *arg;
+    bool stop;
+    int index;
+    int extracted;
+    int total;
+    struct timeval t0;
+    struct timeval progress;
+};
+
+static long long load_feature_ms(struct timeval *t0, struct timeval *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) * 1000LL + (t1->tv_usec - t0->tv_usec) / 1000;
+}
+
+static void load_feature_job(void *arg)
+{
+    struct load_job *job = (struct load_job *)arg;
+
+    job->ret = get_path_feature_cb(job->path, &job->feature);
+}
+
+/* extracts the queued images on the feature pool, then hands them over in order */
+static void load_feature_flush(struct load_batch *batch)
+{
+    struct timeval t1;
+
+    feature_pool_run(load_feature_job, batch->jobs, batch->cnt, sizeof(struct load_job));
+    batch->extracted += batch->cnt;
+
+    for (int i = 0; i < batch->cnt && !batch->stop; i++) {
+        struct load_job *job = &batch->jobs[i];
+        if (job->ret)
+            continue;
+        if (batch->cb(&job->feature, job->name, batch->arg))
+            batch->stop = true;
+        else
+            batch->index++;
+    }
+    batch->cnt = 0;
+
+    gettimeofday(&t1, NULL);
+    if (load_feature_ms(&batch->progress, &t1) >= LOAD_PROGRESS_MS) {
+        printf("load feature: %d/%d images, %d features, %lld ms\n", batch->extracted,
+               batch->total, batch->index, load_feature_ms(&batch->t0, &t1));
+        batch->progress = t1;
+    }
+}
+
+static void load_feature_dir(const char *path, char *fmt, struct load_batch *batch)
 {
     struct dirent *ent = NULL;
     DIR *dir;
     struct stat st;
     char name[512];
-    int index = 0;
 
     dir = opendir(path);
     if (!dir) {
         printf("%s is not exist or is not a directory!\n", path);
-        return index;
+        return;
     }
-    while ((ent = readdir(dir))) {
+    while (!batch->stop && (ent = readdir(dir))) {
         snprintf(name, sizeof(name), "%s/%s", path, ent->d_name);
         stat(name, &st);
         if (S_ISDIR(st.st_mode)) {
             if (strcmp(".", ent->d_name) && strcmp("..", ent->d_name))
-                index += load_feature(name, fmt, (struct face_data*)data + index, cnt - index);
+                load_feature_dir(name, fmt, batch);
         } else if (strstr(ent->d_name, fmt)) {
-            if (index >= cnt)
-                break;
+            /* only saves the extraction, whoever inserts has to check again */
             if (database_is_name_exist(ent->d_name))
                 continue;
-            struct face_data *face_data = (struct face_data*)data + index;
-            if (get_path_feature_cb && get_path_feature_cb(name, &face_data->feature) == 0) {
-                strncpy(face_data->name, ent->d_name, sizeof(face_data->name) - 1);
-                index++;
-                database_insert(&face_data->feature, sizeof(face_data->feature),
-                                face_data->name, sizeof(face_data->name), false);
-            }
+            struct load_job *job = &batch->jobs[batch->cnt++];
+            strncpy(job->path, name, sizeof(job->path) - 1);
+            job->path[sizeof(job->path) - 1] = '\0';
+            strncpy(job->name, ent->d_name, sizeof(job->name) - 1);
+            job->name[sizeof(job->name) - 1] = '\0';
+            if (batch->cnt == LOAD_BATCH)
+                load_feature_flush(batch);
         }
     }
     closedir(dir);
+}
+
+/*
+ * Hands the features of the images under path that are not in the
+ * database yet to cb, until it returns non zero. Returns their number.
+ */
+int load_feature(const char *path, char *fmt, load_feature_cb cb, void *arg)
+{
+    struct load_batch *batch;
+    struct timeval t1;
+    long long ms;
+    int index;
+
+    if (!get_path_feature_cb)
+        return 0;
+
+    batch = (struct load_batch *)calloc(1, sizeof(*batch));
+    if (!batch) {
+        printf("%s: alloc fail\n", __func__);
+        return 0;
+    }
+    batch->cb = cb;
+    batch->arg = arg;
+
+    gettimeofday(&batch->t0, NULL);
+    batch->progress = batch->t0;
+    batch->total = count_file(path, fmt);
+    load_feature_dir(path, fmt, batch);
+    if (batch->cnt && !batch->stop)
+        load_feature_flush(batch);
+    gettimeofday(&t1, NULL);
+
+    ms = load_feature_ms(&batch->t0, &t1);
+    if (batch->extracted)
+        printf("%s: %d images, %d features in %lldms, %lld extractions/s with %d workers\n",
+               path, batch->extracted, batch->index, ms,
+               ms ? batch->extracted * 1000LL / ms : 0, feature_pool_workers());
+    index = batch->index;
+    free(batch);
+
     return index;
 }
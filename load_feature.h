@@ -33,12 +33,16 @@
 #ifndef __LOAD_FEATURE_H__
 #define __LOAD_FEATURE_H__
 
+#include "face_common.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 int count_file(const char *path, char *fmt);
-int load_feature(const char *path, char *fmt, void *data, unsigned int cnt);
+/* takes one new face, a non zero return ends the import */
+typedef int (*load_feature_cb)(const rockface_feature_t *feature, const char *name, void *arg);
+int load_feature(const char *path, char *fmt, load_feature_cb cb, void *arg);
 typedef int (*get_path_feature_t)(char *path, void *feature);
 void register_get_path_feature(get_path_feature_t cb);
 
@@ -48,18 +48,73 @@
 #include "rkcif_control.h"
 #include "shadow_display.h"
 #include "video_common.h"
+#include "npu_scheduler.h"
+#include "face_quality.h"
+
+#define DEFAULT_ISP_NAME "rkisp1_mainpath"
+#define DEFAULT_CIF_NAME "stream_cif_dvp"
 
 extern bool g_expo_weights_en;
+extern bool g_expo_luma_en;
+extern bool g_face_pq_en;
+
+struct lane_config {
+    char isp[32];
+    char cif[32];
+};
+
+static struct lane_config g_lane_config[MAX_LANE] = {
+    {DEFAULT_ISP_NAME, DEFAULT_CIF_NAME},
+};
+static int g_lane_config_cnt;
+
+/* "isp:cif" names the video nodes of one lane, either side may be empty */
+static int add_lane(const char *arg)
+{
+    struct lane_config *lane;
+    const char *sep;
+    int len;
+
+    if (g_lane_config_cnt >= MAX_LANE) {
+        printf("at most %d lanes\n", MAX_LANE);
+        return -1;
+    }
+
+    lane = &g_lane_config[g_lane_config_cnt++];
+    memset(lane, 0, sizeof(*lane));
+    sep = strchr(arg, ':');
+    len = sep ? sep - arg : strlen(arg);
+    if (len >= sizeof(lane->isp))
+        len = sizeof(lane->isp) - 1;
+    memcpy(lane->isp, arg, len);
+    if (sep)
+        strncpy(lane->cif, sep + 1, sizeof(lane->cif) - 1);
+
+    return 0;
+}
 
 void usage(const char *name)
 {
     printf("Usage: %s options\n", name);
     printf("-h --help  Display this usage information.\n"
-           "-f --face  Set face number.\n"
+           "-f --face  Set the face number limit, the gallery grows as needed.\n"
            "-e --expo  Set expo weights.\n"
+           "-l --luma  Steer expo weights by face luminance.\n"
            "-i --isp   Use isp camera.\n"
-           "-c --cif   Use cif camera.\n");
+           "-c --cif   Use cif camera.\n"
+           "-p --perf  Print performance statistics.\n"
+           "-a --audio Set alsa playback device, e.g. hw:0,0 or null.\n"
+           "-P --period Set alsa period time in ms.\n"
+           "-B --buffer Set alsa buffer time in ms.\n"
+           "-L --lane  Add a lane as isp:cif video node names, up to %d.\n"
+           "-N --npu   Set the number of recognizer handles, up to %d.\n"
+           "-Q --quality Set face quality thresholds, 0 turns a check off,\n"
+           "           e.g. blur=60,dark=40,bright=220,contrast=16,yaw=35,pitch=30.\n"
+           "-q --pq    Keep int8 features and search large galleries by product\n"
+           "           quantized codes, about 600 bytes per face instead of 2 KB.\n",
+           MAX_LANE, NPU_MAX_HANDLES);
     printf("e.g. %s -f 30000 -e -i -c\n", name);
+    printf("e.g. %s -i -c -L rkisp1_mainpath:stream_cif_dvp -L rkisp1_selfpath:\n", name);
     exit(0);
 }
 
@@ -67,14 +122,28 @@ int MiniGUIMain(int argc, const char *argv[])
 {
     int face_cnt = 0;
     int next_option;
+    const char *audio = NULL;
+    int period = 0;
+    int buffer = 0;
+    int npu_cnt = 1;
 
-    const char* const short_options = "hf:eic";
+    const char* const short_options = "hf:elicpa:P:B:L:N:Q:q";
     const struct option long_options[] = {
         {"help", 0, NULL, 'h'},
         {"face", 1, NULL, 'f'},
         {"expo", 0, NULL, 'e'},
+        {"luma", 0, NULL, 'l'},
         {"isp", 0, NULL, 'i'},
         {"cif", 0, NULL, 'c'},
+        {"perf", 0, NULL, 'p'},
+        {"audio", 1, NULL, 'a'},
+        {"period", 1, NULL, 'P'},
+        {"buffer", 1, NULL, 'B'},
+        {"lane", 1, NULL, 'L'},
+        {"npu", 1, NULL, 'N'},
+        {"quality", 1, NULL, 'Q'},
+        {"pq", 0, NULL, 'q'},
+        {NULL, 0, NULL, 0},
     };
 
     do {
@@ -86,12 +155,41 @@ int MiniGUIMain(int argc, const char *argv[])
         case 'e':
             g_expo_weights_en = true;
             break;
+        case 'l':
+            g_expo_luma_en = true;
+            break;
         case 'i':
             g_isp_en = true;
             break;
         case 'c':
             g_cif_en = true;
             break;
+        case 'p':
+            g_perf_en = true;
+            break;
+        case 'a':
+            audio = optarg;
+            break;
+        case 'P':
+            period = atoi(optarg);
+            break;
+        case 'B':
+            buffer = atoi(optarg);
+            break;
+        case 'L':
+            if (add_lane(optarg))
+                usage(argv[0]);
+            break;
+        case 'N':
+            npu_cnt = atoi(optarg);
+            break;
+        case 'q':
+            g_face_pq_en = true;
+            break;
+        case 'Q':
+            if (face_quality_set_config(optarg))
+                usage(argv[0]);
+            break;
         case -1:
             break;
         default:
@@ -106,27 +204,44 @@ int MiniGUIMain(int argc, const char *argv[])
     register_shadow_display_vertical(shadow_display_vertical);
     register_get_path_feature(rockface_control_get_path_feature);
 
+    play_wav_set_config(audio, period, buffer);
     if (play_wav_thread_init())
         return -1;
 
     play_wav_signal(WELCOME_WAV);
 
-    rockface_control_init(face_cnt);
+    if (g_lane_config_cnt)
+        g_lane_cnt = g_lane_config_cnt;
+
+    rockface_control_init(face_cnt, g_lane_cnt, npu_cnt);
+
+    if (g_isp_en || g_cif_en)
+        video_device_init(NULL, NULL);
 
-    if (g_isp_en)
-        if (rkisp_control_init())
-            return -1;
+    for (int i = 0; i < g_lane_cnt; i++) {
+        struct lane_config *lane = &g_lane_config[i];
+        bool isp = g_isp_en && lane->isp[0];
 
-    if (g_cif_en)
-        rkcif_control_init();
+        if (isp)
+            if (rkisp_control_init(i, lane->isp))
+                return -1;
+
+        /* the IR stream is only shown when the lane has no RGB camera */
+        if (g_cif_en && lane->cif[0])
+            rkcif_control_init(i, lane->cif, !isp);
+    }
 
     ui_run();
 
-    if (g_isp_en)
-        rkisp_control_exit();
+    for (int i = 0; i < g_lane_cnt; i++) {
+        if (g_isp_en && g_lane_config[i].isp[0])
+            rkisp_control_exit(i);
+
+        if (g_cif_en && g_lane_config[i].cif[0])
+            rkcif_control_exit(i);
+    }
 
-    if (g_cif_en)
-        rkcif_control_exit();
+    video_device_exit();
 
     rockface_control_exit();
 
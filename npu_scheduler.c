@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "video_common.h"
+#include "npu_scheduler.h"
+
+/*
+ * Admission control for the NPU. A caller queues a job of some class and
+ * blocks until one of the recognizer handles is free and no more urgent
+ * job is waiting, then runs the job on its own thread and hands the slot
+ * back. Waiting jobs are ordered by class, then by deadline, then by
+ * arrival, so lanes of the same class still take turns. A job whose
+ * deadline passed while queued is dropped and the caller gets -1, e.g. a
+ * detection of a frame that a newer one has already replaced.
+ */
+
+struct npu_job {
+    enum npu_job_class cls;
+    long long deadline;
+    unsigned int seq;
+    long long ts;
+    int slot;
+    bool expired;
+    struct npu_job *next;
+};
+
+struct npu_slot {
+    rockface_handle_t handle;
+    bool busy;
+    enum npu_job_class cls;
+    long long start;
+};
+
+struct npu_stat {
+    int jobs;
+    int expired;
+    long long wait_sum;
+    long long wait_max;
+    long long run_sum;
+};
+
+static const char *g_class_name[NPU_JOB_CLASS_NUM] = {"gate", "detect", "opportunistic"};
+
+static pthread_mutex_t g_npu_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_npu_cond = PTHREAD_COND_INITIALIZER;
+static struct npu_slot g_slots[NPU_MAX_HANDLES];
+static int g_slot_cnt;
+static struct npu_job *g_queue;
+static unsigned int g_seq;
+static struct npu_stat g_stat[NPU_JOB_CLASS_NUM];
+static long long g_stat_t0;
+
+static long long npu_scheduler_us(void)
+{
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000000LL + t.tv_usec;
+}
+
+static bool npu_job_before(struct npu_job *a, struct npu_job *b)
+{
+    if (a->cls != b->cls)
+        return a->cls < b->cls;
+    if (a->deadline != b->deadline) {
+        if (!a->deadline || !b->deadline)
+            return a->deadline != 0;
+        return a->deadline < b->deadline;
+    }
+    return (int)(a->seq - b->seq) < 0;
+}
+
+/* called with g_npu_mutex held, true if a waiter has to be woken up */
+static bool npu_scheduler_dispatch(long long now)
+{
+    struct npu_job **pp, **best;
+    bool wake = false;
+    int slot;
+
+    while (g_queue) {
+        for (slot = 0; slot < g_slot_cnt; slot++)
+            if (!g_slots[slot].busy)
+                break;
+
+        best = &g_queue;
+        for (pp = &g_queue; *pp; pp = &(*pp)->next) {
+            if ((*pp)->deadline && (*pp)->deadline < now) {
+                best = pp;
+                break;
+            }
+            if (npu_job_before(*pp, *best))
+                best = pp;
+        }
+
+        if ((*best)->deadline && (*best)->deadline < now) {
+            (*best)->expired = true;
+            g_stat[(*best)->cls].expired++;
+            *best = (*best)->next;
+            wake = true;
+            continue;
+        }
+        if (slot == g_slot_cnt)
+            break;
+
+        (*best)->slot = slot;
+        g_slots[slot].busy = true;
+        g_slots[slot].cls = (*best)->cls;
+        g_slots[slot].start = now;
+        *best = (*best)->next;
+        wake = true;
+    }
+
+    return wake;
+}
+
+/*
+ * Waits for a free handle, deadline_ms 0 means the job never expires.
+ * Returns the slot to pass to npu_scheduler_put(), -1 if the job expired.
+ */
+int npu_scheduler_get(enum npu_job_class cls, int deadline_ms)
+{
+    struct npu_job job;
+    struct npu_stat *stat = &g_stat[cls];
+    long long now, wait;
+
+    memset(&job, 0, sizeof(job));
+    job.cls = cls;
+    job.slot = -1;
+
+    pthread_mutex_lock(&g_npu_mutex);
+    now = npu_scheduler_us();
+    job.ts = now;
+    job.deadline = deadline_ms > 0 ? now + deadline_ms * 1000LL : 0;
+    job.seq = g_seq++;
+    job.next = g_queue;
+    g_queue = &job;
+    if (npu_scheduler_dispatch(now))
+        pthread_cond_broadcast(&g_npu_cond);
+    while (job.slot < 0 && !job.expired)
+        pthread_cond_wait(&g_npu_cond, &g_npu_mutex);
+
+    if (job.slot >= 0) {
+        wait = npu_scheduler_us() - job.ts;
+        stat->jobs++;
+        stat->wait_sum += wait;
+        if (wait > stat->wait_max)
+            stat->wait_max = wait;
+    }
+    pthread_mutex_unlock(&g_npu_mutex);
+
+    return job.slot;
+}
+
+static void npu_scheduler_stat(long long now)
+{
+    struct npu_stat stat[NPU_JOB_CLASS_NUM];
+
+    pthread_mutex_lock(&g_npu_mutex);
+    if (!g_stat_t0)
+        g_stat_t0 = now;
+    if (now - g_stat_t0 < 1000000) {
+        pthread_mutex_unlock(&g_npu_mutex);
+        return;
+    }
+    memcpy(stat, g_stat, sizeof(stat));
+    memset(g_stat, 0, sizeof(g_stat));
+    g_stat_t0 = now;
+    pthread_mutex_unlock(&g_npu_mutex);
+
+    for (int i = 0; i < NPU_JOB_CLASS_NUM; i++) {
+        if (!stat[i].jobs && !stat[i].expired)
+            continue;
+        printf("npu %s: jobs: %d, expired: %d, queue wait avg: %lldus, max: %lldus, "
+               "run avg: %lldus\n", g_class_name[i], stat[i].jobs, stat[i].expired,
+               stat[i].jobs ? stat[i].wait_sum / stat[i].jobs : 0, stat[i].wait_max,
+               stat[i].jobs ? stat[i].run_sum / stat[i].jobs : 0);
+    }
+}
+
+void npu_scheduler_put(int slot)
+{
+    long long now;
+
+    if (slot < 0 || slot >= g_slot_cnt)
+        return;
+
+    pthread_mutex_lock(&g_npu_mutex);
+    now = npu_scheduler_us();
+    g_stat[g_slots[slot].cls].run_sum += now - g_slots[slot].start;
+    g_slots[slot].busy = false;
+    if (npu_scheduler_dispatch(now))
+        pthread_cond_broadcast(&g_npu_cond);
+    pthread_mutex_unlock(&g_npu_mutex);
+
+    if (g_perf_en)
+        npu_scheduler_stat(now);
+}
+
+rockface_handle_t npu_scheduler_handle(int slot)
+{
+    if (slot < 0 || slot >= g_slot_cnt)
+        return NULL;
+
+    return g_slots[slot].handle;
+}
+
+int npu_scheduler_handles(void)
+{
+    return g_slot_cnt;
+}
+
+int npu_scheduler_init(rockface_handle_t *handles, int cnt)
+{
+    if (cnt <= 0 || cnt > NPU_MAX_HANDLES) {
+        printf("%s: invalid handle number %d\n", __func__, cnt);
+        return -1;
+    }
+
+    memset(g_slots, 0, sizeof(g_slots));
+    for (int i = 0; i < cnt; i++)
+        g_slots[i].handle = handles[i];
+    g_slot_cnt = cnt;
+    g_queue = NULL;
+    memset(g_stat, 0, sizeof(g_stat));
+    g_stat_t0 = 0;
+
+    return 0;
+}
+
+void npu_scheduler_exit(void)
+{
+    pthread_mutex_lock(&g_npu_mutex);
+    g_slot_cnt = 0;
+    pthread_mutex_unlock(&g_npu_mutex);
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __NPU_SCHEDULER_H__
+#define __NPU_SCHEDULER_H__
+
+#include <rockface/rockface.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NPU_MAX_HANDLES 4
+
+/* highest priority first */
+enum npu_job_class {
+    NPU_JOB_GATE,
+    NPU_JOB_DETECT,
+    NPU_JOB_OPPORTUNISTIC,
+    NPU_JOB_CLASS_NUM,
+};
+
+int npu_scheduler_init(rockface_handle_t *handles, int cnt);
+void npu_scheduler_exit(void);
+int npu_scheduler_get(enum npu_job_class cls, int deadline_ms);
+void npu_scheduler_put(int slot);
+rockface_handle_t npu_scheduler_handle(int slot);
+int npu_scheduler_handles(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
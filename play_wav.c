@@ -38,11 +38,19 @@
 #include <alsa/asoundlib.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/time.h>
+
+#include "play_wav.h"
+#include "video_common.h"
 
 #define SOUND_NAME "hw:0,0"
 #define NUM_CHANNELS 2
 #define SAMPLE_RATE 16000
-#define BITS_PER_SAMPLE 16
+#define PERIOD_TIME 32000
+#define BUFFER_TIME 128000
+
+#define PLAY_WAV_QUEUE_LEN 8
+#define PLAY_WAV_STALE_MS 3000
 
 #define ID_RIFF 0x46464952
 #define ID_WAVE 0x45564157
@@ -69,18 +77,58 @@ struct chunk_fmt {
     uint16_t bits_per_sample;
 };
 
+enum {
+    PLAY_WAV_PRIO_LOW,
+    PLAY_WAV_PRIO_NORMAL,
+    PLAY_WAV_PRIO_HIGH,
+};
+
+struct wav_prompt {
+    const char *name;
+    int priority;
+    char *data;
+    int size;
+};
+
+struct wav_request {
+    struct wav_prompt *prompt;
+    struct timeval ts;
+};
+
+static struct wav_prompt g_prompts[] = {
+    {AUTHORIZE_FAIL_WAV, PLAY_WAV_PRIO_NORMAL},
+    {WELCOME_WAV, PLAY_WAV_PRIO_LOW},
+    {REGISTER_SUCCESS_WAV, PLAY_WAV_PRIO_NORMAL},
+    {REGISTER_ALREADY_WAV, PLAY_WAV_PRIO_NORMAL},
+    {REGISTER_START_WAV, PLAY_WAV_PRIO_NORMAL},
+    {REGISTER_TIMEOUT_WAV, PLAY_WAV_PRIO_NORMAL},
+    {REGISTER_LIMIT_WAV, PLAY_WAV_PRIO_NORMAL},
+    {DELETE_SUCCESS_WAV, PLAY_WAV_PRIO_NORMAL},
+    {DELETE_START_WAV, PLAY_WAV_PRIO_NORMAL},
+    {DELETE_TIMEOUT_WAV, PLAY_WAV_PRIO_NORMAL},
+    {PLEASE_GO_THROUGH_WAV, PLAY_WAV_PRIO_HIGH},
+};
+
 static snd_pcm_t *g_handle;
-static char *g_buffer;
-static int g_size;
+static char g_device[64] = SOUND_NAME;
+static unsigned int g_period_time = PERIOD_TIME;
+static unsigned int g_buffer_time = BUFFER_TIME;
+static unsigned int g_rate;
+static unsigned int g_channels;
+static snd_pcm_uframes_t g_period_size;
+static snd_pcm_uframes_t g_buffer_size;
+static int g_frame_bytes;
 
 static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
-static bool g_flag = false;
+static struct wav_request g_queue[PLAY_WAV_QUEUE_LEN];
+static int g_queue_cnt;
+static struct wav_prompt *g_playing;
+static bool g_preempt;
 static pthread_t g_tid;
 static bool g_run;
-static char g_filename[256];
 
-static FILE* wav_file_check(char *name)
+static FILE* wav_file_check(const char *name, struct chunk_fmt *fmt, uint32_t *size)
 {
     FILE *fp;
     struct riff_wave_header wave_header;
@@ -88,6 +136,8 @@ static FILE* wav_file_check(char *name)
     struct chunk_fmt chunk_fmt;
     unsigned int more_chunks = 1;
 
+    memset(&chunk_fmt, 0, sizeof(chunk_fmt));
+
     fp = fopen(name, "rb");
     if (!fp) {
         fprintf(stderr, "failed to open '%s'\n", name);
@@ -116,6 +166,7 @@ static FILE* wav_file_check(char *name)
                 fseek(fp, chunk_header.sz - sizeof(chunk_fmt), SEEK_CUR);
             break;
         case ID_DATA:
+            *size = chunk_header.sz;
             more_chunks = 0;
             break;
         default:
@@ -124,13 +175,14 @@ static FILE* wav_file_check(char *name)
         }
     } while (more_chunks);
 
-    if (chunk_fmt.num_channels != NUM_CHANNELS ||
-        chunk_fmt.sample_rate != SAMPLE_RATE ||
-        chunk_fmt.bits_per_sample != BITS_PER_SAMPLE) {
-        fprintf(stderr, "%s is not %d num_channels, %d sample_rate, %d bits_per_sample\n",
-                name, NUM_CHANNELS, SAMPLE_RATE, BITS_PER_SAMPLE);
+    if (chunk_fmt.audio_format != 1 ||
+        chunk_fmt.num_channels < 1 || chunk_fmt.num_channels > 2 ||
+        chunk_fmt.sample_rate == 0 ||
+        (chunk_fmt.bits_per_sample != 8 && chunk_fmt.bits_per_sample != 16)) {
+        fprintf(stderr, "%s is not 1 or 2 channels 8 or 16 bits pcm\n", name);
         goto exit;
     }
+    memcpy(fmt, &chunk_fmt, sizeof(chunk_fmt));
 
     return fp;
 
@@ -143,13 +195,12 @@ static int play_wav_init(void)
 {
     int rc;
     int dir;
-    unsigned int val;
-    snd_pcm_uframes_t frames;
     snd_pcm_hw_params_t *params;
+    snd_pcm_sw_params_t *sw_params;
 
-    rc = snd_pcm_open(&g_handle, SOUND_NAME, SND_PCM_STREAM_PLAYBACK, 0);
+    rc = snd_pcm_open(&g_handle, g_device, SND_PCM_STREAM_PLAYBACK, 0);
     if (rc < 0) {
-        fprintf(stderr, "unable to open pcm device: %s\n", snd_strerror(rc));
+        fprintf(stderr, "unable to open pcm device %s: %s\n", g_device, snd_strerror(rc));
         return -1;
     }
 
@@ -157,17 +208,23 @@ static int play_wav_init(void)
 
     snd_pcm_hw_params_any(g_handle, params);
 
-    snd_pcm_hw_params_set_access(g_handle, params, SND_PCM_ACCESS_RW_INTERLEAVED);
+    rc = snd_pcm_hw_params_set_access(g_handle, params, SND_PCM_ACCESS_MMAP_INTERLEAVED);
+    if (rc < 0) {
+        fprintf(stderr, "mmap access not available: %s\n", snd_strerror(rc));
+        return -1;
+    }
 
     snd_pcm_hw_params_set_format(g_handle, params, SND_PCM_FORMAT_S16);
 
-    snd_pcm_hw_params_set_channels(g_handle, params, NUM_CHANNELS);
+    g_channels = NUM_CHANNELS;
+    snd_pcm_hw_params_set_channels_near(g_handle, params, &g_channels);
+
+    g_rate = SAMPLE_RATE;
+    snd_pcm_hw_params_set_rate_near(g_handle, params, &g_rate, &dir);
 
-    val = SAMPLE_RATE;
-    snd_pcm_hw_params_set_rate_near(g_handle, params, &val, &dir);
+    snd_pcm_hw_params_set_buffer_time_near(g_handle, params, &g_buffer_time, &dir);
 
-    frames = 64;
-    snd_pcm_hw_params_set_period_size_near(g_handle, params, &frames, &dir);
+    snd_pcm_hw_params_set_period_time_near(g_handle, params, &g_period_time, &dir);
 
     rc = snd_pcm_hw_params(g_handle, params);
     if (rc < 0) {
@@ -175,15 +232,26 @@ static int play_wav_init(void)
         return -1;
     }
 
-    snd_pcm_hw_params_get_period_size(params, &frames, &dir);
-
-    g_size = frames * 2 * NUM_CHANNELS;
-    g_buffer = (char*)malloc(g_size);
-    if (!g_buffer) {
-        fprintf(stderr, "Not enough Memory!\n");
+    snd_pcm_hw_params_get_channels(params, &g_channels);
+    snd_pcm_hw_params_get_rate(params, &g_rate, &dir);
+    snd_pcm_hw_params_get_period_size(params, &g_period_size, &dir);
+    snd_pcm_hw_params_get_buffer_size(params, &g_buffer_size);
+    g_frame_bytes = g_channels * 2;
+
+    /* wake up once per period, start as soon as the buffer has been filled */
+    snd_pcm_sw_params_alloca(&sw_params);
+    snd_pcm_sw_params_current(g_handle, sw_params);
+    snd_pcm_sw_params_set_start_threshold(g_handle, sw_params, g_buffer_size);
+    snd_pcm_sw_params_set_avail_min(g_handle, sw_params, g_period_size);
+    rc = snd_pcm_sw_params(g_handle, sw_params);
+    if (rc < 0) {
+        fprintf(stderr, "unable to set sw parameters: %s\n", snd_strerror(rc));
         return -1;
     }
 
+    printf("%s: %s %u Hz %u ch, period %lu frames, buffer %lu frames\n", __func__,
+           g_device, g_rate, g_channels, g_period_size, g_buffer_size);
+
     return 0;
 }
 
@@ -192,71 +260,306 @@ static void play_wav_exit(void)
     snd_pcm_drop(g_handle);
     snd_pcm_drain(g_handle);
     snd_pcm_close(g_handle);
-    free(g_buffer);
 }
 
-static void play_wav(char *name)
+static int16_t wav_sample(const char *data, int bits, long index)
 {
-    int rc;
-    int num_read;
-    FILE* fp = wav_file_check(name);
+    if (bits == 8)
+        return (int16_t)(((int)(uint8_t)data[index] - 128) << 8);
+    return ((const int16_t *)data)[index];
+}
+
+/* resample and remix to the S16 format the pcm device was opened with */
+static char *wav_convert(const char *src, uint32_t size, struct chunk_fmt *fmt, int *out_size)
+{
+    int in_ch = fmt->num_channels;
+    long in_frames = size / (in_ch * fmt->bits_per_sample / 8);
+    long out_frames = (long)((uint64_t)in_frames * g_rate / fmt->sample_rate);
+    int16_t *dst;
+    int v[2];
+
+    if (in_frames == 0)
+        return NULL;
+
+    dst = (int16_t *)malloc(out_frames * g_frame_bytes);
+    if (!dst)
+        return NULL;
+
+    for (long i = 0; i < out_frames; i++) {
+        /* position in the source in 16.16 fixed point */
+        uint64_t pos = ((uint64_t)i * fmt->sample_rate << 16) / g_rate;
+        long i0 = pos >> 16;
+        long i1 = i0 + 1 < in_frames ? i0 + 1 : i0;
+        int frac = pos & 0xffff;
+
+        for (int c = 0; c < in_ch; c++) {
+            int s0 = wav_sample(src, fmt->bits_per_sample, i0 * in_ch + c);
+            int s1 = wav_sample(src, fmt->bits_per_sample, i1 * in_ch + c);
+            v[c] = s0 + (((s1 - s0) * frac) >> 16);
+        }
+        for (int c = 0; c < g_channels; c++) {
+            if (in_ch == 1)
+                dst[i * g_channels + c] = v[0];
+            else if (g_channels == 1)
+                dst[i * g_channels + c] = (v[0] + v[1]) / 2;
+            else
+                dst[i * g_channels + c] = v[c % in_ch];
+        }
+    }
+
+    *out_size = out_frames * g_frame_bytes;
+    return (char *)dst;
+}
+
+static int play_wav_load(struct wav_prompt *prompt)
+{
+    uint32_t size = 0;
+    struct chunk_fmt fmt;
+    char *data;
+    FILE *fp = wav_file_check(prompt->name, &fmt, &size);
 
     if (!fp)
-        return;
+        return -1;
 
-    do {
-        num_read = fread(g_buffer, 1, g_size, fp);
-        if (num_read > 0) {
-            rc = snd_pcm_writei(g_handle, g_buffer, snd_pcm_bytes_to_frames(g_handle, num_read));
-            if (rc == -EPIPE) {
-                //fprintf(stderr, "underrun occurred\n");
-                snd_pcm_prepare(g_handle);
-            } else if (rc < 0) {
-                fprintf(stderr, "error from writei: %s\n", snd_strerror(rc));
+    data = (char*)malloc(size);
+    if (!data) {
+        fprintf(stderr, "Not enough Memory!\n");
+        fclose(fp);
+        return -1;
+    }
+    size = fread(data, 1, size, fp);
+    fclose(fp);
+
+    if (fmt.num_channels == g_channels && fmt.sample_rate == g_rate &&
+        fmt.bits_per_sample == 16) {
+        prompt->data = data;
+        prompt->size = size;
+        return 0;
+    }
+
+    prompt->data = wav_convert(data, size, &fmt, &prompt->size);
+    free(data);
+    if (!prompt->data) {
+        fprintf(stderr, "%s: convert %s fail\n", __func__, prompt->name);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void play_wav_load_all(void)
+{
+    for (int i = 0; i < sizeof(g_prompts) / sizeof(g_prompts[0]); i++)
+        play_wav_load(&g_prompts[i]);
+}
+
+static void play_wav_unload_all(void)
+{
+    for (int i = 0; i < sizeof(g_prompts) / sizeof(g_prompts[0]); i++) {
+        free(g_prompts[i].data);
+        g_prompts[i].data = NULL;
+        g_prompts[i].size = 0;
+    }
+}
+
+static struct wav_prompt *play_wav_find(const char *name)
+{
+    for (int i = 0; i < sizeof(g_prompts) / sizeof(g_prompts[0]); i++)
+        if (!strcmp(g_prompts[i].name, name))
+            return &g_prompts[i];
+
+    return NULL;
+}
+
+static int play_wav_xrun(int err)
+{
+    err = snd_pcm_recover(g_handle, err, 1);
+    if (err < 0)
+        fprintf(stderr, "%s: %s\n", __func__, snd_strerror(err));
+    return err;
+}
+
+static void play_wav(struct wav_prompt *prompt)
+{
+    int rc;
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, frames;
+    snd_pcm_sframes_t avail, committed;
+    long total = prompt->size / g_frame_bytes;
+    long pos = 0;
+    int wakeups = 0;
+    struct timeval t0, t1;
+    long ms;
+
+    gettimeofday(&t0, NULL);
+    while (pos < total && g_run) {
+        pthread_mutex_lock(&g_mutex);
+        if (g_preempt) {
+            g_preempt = false;
+            pthread_mutex_unlock(&g_mutex);
+            snd_pcm_drop(g_handle);
+            snd_pcm_prepare(g_handle);
+            break;
+        }
+        pthread_mutex_unlock(&g_mutex);
+
+        avail = snd_pcm_avail_update(g_handle);
+        if (avail < 0) {
+            if (play_wav_xrun(avail) < 0)
                 break;
-            }
+            continue;
+        }
+        /* sleep until a whole period is free unless the rest of the prompt fits */
+        if ((snd_pcm_uframes_t)avail < g_period_size && avail < total - pos) {
+            if (snd_pcm_state(g_handle) == SND_PCM_STATE_PREPARED)
+                snd_pcm_start(g_handle);
+            rc = snd_pcm_wait(g_handle, 1000);
+            wakeups++;
+            if (rc < 0 && play_wav_xrun(rc) < 0)
+                break;
+            continue;
         }
-    } while (num_read > 0);
 
-    fclose(fp);
+        frames = avail < total - pos ? avail : total - pos;
+        rc = snd_pcm_mmap_begin(g_handle, &areas, &offset, &frames);
+        if (rc < 0) {
+            if (play_wav_xrun(rc) < 0)
+                break;
+            continue;
+        }
+        memcpy((char *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8,
+               prompt->data + pos * g_frame_bytes, frames * g_frame_bytes);
+        committed = snd_pcm_mmap_commit(g_handle, offset, frames);
+        if (committed < 0 || (snd_pcm_uframes_t)committed != frames) {
+            if (play_wav_xrun(committed >= 0 ? -EPIPE : committed) < 0)
+                break;
+            continue;
+        }
+        pos += frames;
+    }
+    /* short prompts never reach the start threshold */
+    if (snd_pcm_state(g_handle) == SND_PCM_STATE_PREPARED)
+        snd_pcm_start(g_handle);
+
+    if (g_perf_en) {
+        gettimeofday(&t1, NULL);
+        ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_usec - t0.tv_usec) / 1000;
+        printf("%s: %s %ldms audio, %d wakeups in %ldms, %ld/s\n", __func__, prompt->name,
+               pos * 1000 / g_rate, wakeups, ms, ms ? wakeups * 1000L / ms : 0);
+    }
 }
 
-static void play_wav_wait(void)
+static long play_wav_age_ms(struct timeval *ts)
 {
-    pthread_mutex_lock(&g_mutex);
-    if (!g_flag)
-        pthread_cond_wait(&g_cond, &g_mutex);
-    pthread_mutex_unlock(&g_mutex);
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - ts->tv_sec) * 1000 + (now.tv_usec - ts->tv_usec) / 1000;
+}
+
+static void play_wav_remove(int index)
+{
+    g_queue_cnt--;
+    memmove(&g_queue[index], &g_queue[index + 1], (g_queue_cnt - index) * sizeof(g_queue[0]));
 }
 
+/* called with g_mutex held, returns the oldest request of the highest priority */
+static struct wav_prompt *play_wav_dequeue(void)
+{
+    struct wav_prompt *prompt;
+    int best = -1;
+
+    for (int i = 0; i < g_queue_cnt; i++) {
+        if (play_wav_age_ms(&g_queue[i].ts) > PLAY_WAV_STALE_MS) {
+            play_wav_remove(i--);
+            continue;
+        }
+        if (best < 0 || g_queue[i].prompt->priority > g_queue[best].prompt->priority)
+            best = i;
+    }
+    if (best < 0)
+        return NULL;
+
+    prompt = g_queue[best].prompt;
+    play_wav_remove(best);
+    return prompt;
+}
+
+/*
+ * Queue a prompt and return immediately. A prompt that is already queued
+ * is not queued twice, a higher priority prompt drops the lower priority
+ * ones still waiting and interrupts the one being played.
+ */
 void play_wav_signal(char *name)
 {
-    if (name) {
-        while (g_flag)
-            usleep(100000);
-        memset(g_filename, 0, sizeof(g_filename));
-        strncpy(g_filename, name, sizeof(g_filename) - 1);
+    struct wav_prompt *prompt;
+    int i;
+
+    if (!name)
+        return;
+
+    prompt = play_wav_find(name);
+    if (!prompt || !prompt->data) {
+        fprintf(stderr, "%s: %s is not loaded\n", __func__, name);
+        return;
     }
+
     pthread_mutex_lock(&g_mutex);
-    g_flag = true;
+    for (i = 0; i < g_queue_cnt; i++) {
+        if (g_queue[i].prompt == prompt)
+            break;
+        if (g_queue[i].prompt->priority < prompt->priority)
+            play_wav_remove(i--);
+    }
+    if (i == g_queue_cnt) {
+        if (g_queue_cnt == PLAY_WAV_QUEUE_LEN)
+            play_wav_remove(0);
+        g_queue[g_queue_cnt].prompt = prompt;
+        i = g_queue_cnt++;
+    }
+    gettimeofday(&g_queue[i].ts, NULL);
+    if (g_playing && g_playing->priority < prompt->priority)
+        g_preempt = true;
     pthread_cond_signal(&g_cond);
     pthread_mutex_unlock(&g_mutex);
 }
 
 static void *play_wav_thread(void *arg)
 {
+    struct wav_prompt *prompt = NULL;
+
     while (g_run) {
-        play_wav_wait();
+        pthread_mutex_lock(&g_mutex);
+        while (g_run && !(prompt = play_wav_dequeue()))
+            pthread_cond_wait(&g_cond, &g_mutex);
+        g_playing = prompt;
+        g_preempt = false;
+        pthread_mutex_unlock(&g_mutex);
         if (!g_run)
             break;
-        play_wav(g_filename);
-        sleep(1);
-        g_flag = false;
+
+        play_wav(prompt);
+
+        pthread_mutex_lock(&g_mutex);
+        g_playing = NULL;
+        pthread_mutex_unlock(&g_mutex);
     }
 
     pthread_exit(NULL);
 }
 
+void play_wav_set_config(const char *device, int period_ms, int buffer_ms)
+{
+    if (device) {
+        memset(g_device, 0, sizeof(g_device));
+        strncpy(g_device, device, sizeof(g_device) - 1);
+    }
+    if (period_ms > 0)
+        g_period_time = period_ms * 1000;
+    if (buffer_ms > 0)
+        g_buffer_time = buffer_ms * 1000;
+}
+
 int play_wav_thread_init(void)
 {
     system("amixer sset 'Playback Path' SPK");
@@ -265,6 +568,7 @@ int play_wav_thread_init(void)
 
     if (play_wav_init())
         return -1;
+    play_wav_load_all();
     g_run = true;
     if (pthread_create(&g_tid, NULL, play_wav_thread, NULL)) {
         printf("%s create thread failed!\n", __func__);
@@ -275,11 +579,14 @@ int play_wav_thread_init(void)
 
 void play_wav_thread_exit(void)
 {
+    pthread_mutex_lock(&g_mutex);
     g_run = false;
-    play_wav_signal(NULL);
+    pthread_cond_signal(&g_cond);
+    pthread_mutex_unlock(&g_mutex);
     if (g_tid) {
         pthread_join(g_tid, NULL);
         g_tid = 0;
     }
     play_wav_exit();
+    play_wav_unload_all();
 }
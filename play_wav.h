@@ -52,6 +52,7 @@ extern "C" {
 #define PLEASE_GO_THROUGH_WAV "/etc/please_go_through.wav"
 
 void play_wav_signal(char *name);
+void play_wav_set_config(const char *device, int period_ms, int buffer_ms);
 int play_wav_thread_init(void);
 void play_wav_thread_exit(void);
 
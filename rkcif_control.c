@@ -37,59 +37,77 @@
 
 #include <camera_engine_rkisp/interface/rkisp_api.h>
 #include "rga_control.h"
+#include "video_fanout.h"
+#include "video_capture.h"
 #include <linux/media-bus-format.h>
 
-static bo_t g_rotate_bo;
-static int g_rotate_fd = -1;
+/* one CIF (IR) stream, one per lane */
+struct rkcif_control {
+    int lane;
+    int width;
+    int height;
+    bo_t rotate_bo;
+    int rotate_fd;
+    struct video_fanout fanout;
+    struct video_capture capture;
+    char display_name[32];
+    char analysis_name[32];
+};
+
+static struct rkcif_control g_cif[MAX_LANE];
+
+static void rkcif_display(const struct rkisp_api_buf *buf, void *arg)
+{
+    struct rkcif_control *cif = (struct rkcif_control *)arg;
+    rga_info_t src, dst;
+
+    if (!shadow_display_vertical_cb)
+        return;
+
+    memset(&src, 0, sizeof(rga_info_t));
+    src.fd = buf->fd;
+    src.mmuFlag = 1;
+    src.rotation = HAL_TRANSFORM_ROT_270;
+    rga_set_rect(&src.rect, 0, 0, cif->width, cif->height, cif->width, cif->height,
+                 RK_FORMAT_YCbCr_420_SP);
+    memset(&dst, 0, sizeof(rga_info_t));
+    dst.fd = cif->rotate_fd;
+    dst.mmuFlag = 1;
+    rga_set_rect(&dst.rect, 0, 0, cif->height, cif->width, cif->height, cif->width,
+                 RK_FORMAT_YCbCr_420_SP);
+    if (c_RkRgaBlit(&src, &dst, NULL)) {
+        printf("%s: rga fail\n", __func__);
+        return;
+    }
 
-static const struct rkisp_api_ctx *ctx;
-static const struct rkisp_api_buf *buf;
-static bool g_run;
-static pthread_t g_tid;
+    shadow_display_vertical_cb(cif->lane, NULL, cif->rotate_fd, RK_FORMAT_YCbCr_420_SP,
+                               cif->height, cif->width);
+}
 
-static void *process(void *arg)
+static void rkcif_analysis(const struct rkisp_api_buf *buf, void *arg)
 {
-    rga_info_t src, dst;
+    struct rkcif_control *cif = (struct rkcif_control *)arg;
+
+    rockface_control_convert_ir(cif->lane, NULL, buf->fd, cif->width, cif->height,
+                                RK_FORMAT_YCbCr_420_SP, HAL_TRANSFORM_ROT_270);
+}
 
-    do {
-        buf = rkisp_get_frame(ctx, 0);
-        memset((char *)buf->buf + ctx->height * ctx->width, 128, ctx->height * ctx->width / 2);
-
-        memset(&src, 0, sizeof(rga_info_t));
-        src.fd = buf->fd;
-        src.mmuFlag = 1;
-        src.rotation = HAL_TRANSFORM_ROT_270;
-        rga_set_rect(&src.rect, 0, 0, ctx->width, ctx->height, ctx->width, ctx->height,
-                     RK_FORMAT_YCbCr_420_SP);
-        memset(&dst, 0, sizeof(rga_info_t));
-        dst.fd = g_rotate_fd;
-        dst.mmuFlag = 1;
-        rga_set_rect(&dst.rect, 0, 0, ctx->height, ctx->width, ctx->height, ctx->width,
-                     RK_FORMAT_YCbCr_420_SP);
-        if (c_RkRgaBlit(&src, &dst, NULL)) {
-            printf("%s: rga fail\n", __func__);
-            rkisp_put_frame(ctx, buf);
-            continue;
-        }
-
-        rockface_control_convert_ir(g_rotate_bo.ptr, ctx->height, ctx->width,
-                                    RK_FORMAT_YCbCr_420_SP);
-
-        if (!g_isp_en && shadow_display_vertical_cb)
-            shadow_display_vertical_cb(g_rotate_bo.ptr, g_rotate_fd, RK_FORMAT_YCbCr_420_SP,
-                                       ctx->height, ctx->width);
-
-        rkisp_put_frame(ctx, buf);
-    } while (g_run);
-
-    pthread_exit(NULL);
+static void rkcif_frame(struct video_capture *cap, const struct rkisp_api_buf *buf)
+{
+    struct rkcif_control *cif = (struct rkcif_control *)cap->arg;
+
+    memset((char *)buf->buf + cif->height * cif->width, 128, cif->height * cif->width / 2);
+
+    video_fanout_publish(&cif->fanout, buf);
 }
 
-int rkcif_control_init(void)
+static int rkcif_open(struct video_capture *cap)
 {
+    struct rkcif_control *cif = (struct rkcif_control *)cap->arg;
+    const struct rkisp_api_ctx *ctx;
     char name[32];
 
-    int id = get_video_id("stream_cif_dvp");
+    int id = get_video_id(cap->name);
     if (id < 0) {
         printf("%s: get video id fail!\n", __func__);
         return -1;
@@ -105,37 +123,85 @@ int rkcif_control_init(void)
 
     rkisp_set_sensor_fmt(ctx, 1280, 720, MEDIA_BUS_FMT_YUYV8_2X8);
     rkisp_set_fmt(ctx, 1280, 720, ctx->fcc);
+    if (cif->width && (ctx->width != cif->width || ctx->height != cif->height)) {
+        printf("%s: format changed to %dx%d\n", __func__, ctx->width, ctx->height);
+        rkisp_close_device(ctx);
+        return -1;
+    }
+
+    if (rkisp_start_capture(ctx)) {
+        rkisp_close_device(ctx);
+        return -1;
+    }
 
-    if (rga_control_buffer_init(&g_rotate_bo, &g_rotate_fd, ctx->width, ctx->height, 12))
+    cif->width = ctx->width;
+    cif->height = ctx->height;
+    cap->ctx = ctx;
+
+    return 0;
+}
+
+static void rkcif_close(struct video_capture *cap)
+{
+    rkisp_stop_capture(cap->ctx);
+    rkisp_close_device(cap->ctx);
+}
+
+int rkcif_control_init(int lane, const char *name, bool display)
+{
+    struct rkcif_control *cif;
+
+    if (lane < 0 || lane >= MAX_LANE)
         return -1;
 
-    if (rkisp_start_capture(ctx))
+    cif = &g_cif[lane];
+    memset(cif, 0, sizeof(*cif));
+    cif->lane = lane;
+    cif->rotate_fd = -1;
+    video_fanout_init(&cif->fanout, NULL);
+    cif->capture.name = name;
+    cif->capture.open = rkcif_open;
+    cif->capture.close = rkcif_close;
+    cif->capture.frame = rkcif_frame;
+    cif->capture.fanout = &cif->fanout;
+    cif->capture.arg = cif;
+    if (video_capture_open(&cif->capture))
         return -1;
 
-    g_run = true;
-    if (pthread_create(&g_tid, NULL, process, NULL)) {
-        printf("pthread_create fail\n");
+    if (rga_control_buffer_init(&cif->rotate_bo, &cif->rotate_fd, cif->width, cif->height, 12))
         return -1;
-    }
 
-    return 0;
+    snprintf(cif->display_name, sizeof(cif->display_name), "lane %d CIF display", lane);
+    snprintf(cif->analysis_name, sizeof(cif->analysis_name), "lane %d CIF analysis", lane);
+    if (display)
+        video_fanout_add(&cif->fanout, cif->display_name, rkcif_display, cif);
+    video_fanout_add(&cif->fanout, cif->analysis_name, rkcif_analysis, cif);
+    if (video_fanout_start(&cif->fanout))
+        return -1;
+
+    return video_capture_start(&cif->capture);
 }
 
-void rkcif_control_exit(void)
+void rkcif_control_exit(int lane)
 {
-    g_run = false;
-    if (g_tid) {
-        pthread_join(g_tid, NULL);
-        g_tid = 0;
-    }
+    struct rkcif_control *cif;
 
-    rkisp_stop_capture(ctx);
-    rkisp_close_device(ctx);
+    if (lane < 0 || lane >= MAX_LANE)
+        return;
 
-    rga_control_buffer_deinit(&g_rotate_bo, g_rotate_fd);
+    cif = &g_cif[lane];
+    video_capture_stop(&cif->capture);
+    video_fanout_exit(&cif->fanout);
+
+    if (cif->rotate_fd >= 0)
+        rga_control_buffer_deinit(&cif->rotate_bo, cif->rotate_fd);
+    cif->rotate_fd = -1;
 }
 
-bool rkcif_control_run(void)
+bool rkcif_control_run(int lane)
 {
-    return g_run;
+    if (lane < 0 || lane >= MAX_LANE)
+        return false;
+
+    return g_cif[lane].capture.run;
 }
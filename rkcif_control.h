@@ -37,9 +37,9 @@
 extern "C" {
 #endif
 
-int rkcif_control_init(void);
-void rkcif_control_exit(void);
-bool rkcif_control_run(void);
+int rkcif_control_init(int lane, const char *name, bool display);
+void rkcif_control_exit(int lane);
+bool rkcif_control_run(int lane);
 
 #ifdef __cplusplus
 }
@@ -31,86 +31,144 @@
  * SOFTWARE.
  */
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <stdint.h>
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 #include "rockface_control.h"
 #include "video_common.h"
 
 #include <camera_engine_rkisp/interface/rkisp_api.h>
 #include "rga_control.h"
+#include "video_fanout.h"
+#include "video_capture.h"
 
-static bool g_def_expo_weights = false;
-bool g_expo_weights_en = false;
-static unsigned char weights[81];
+#define EXPO_INTERVAL_MS 200
+#define EXPO_DEFAULT_CNT 5
+#define EXPO_STABLE_CNT 2
+#define EXPO_BG_WEIGHT 2
+/* the bg weight follows the face luma between these */
+#define EXPO_BG_MIN 0
+#define EXPO_BG_MAX 4
+#define EXPO_FACE_WEIGHT 31
+#define EXPO_FACE_TARGET 110
+#define EXPO_FACE_RANGE 20
+
+struct expo_box {
+    int left, top, right, bottom;
+    int rotation;
+    bool face;
+};
+
+struct expo_grid {
+    int x, y, w, h;
+    int bg;
+};
+
+/* one ISP stream and its AE steering, one per lane */
+struct rkisp_control {
+    int lane;
+    const struct rkisp_api_ctx *ctx;
+    pthread_mutex_t ctx_mutex;
+    int ctx_gen;
+    int width;
+    int height;
+    bo_t rotate_bo;
+    int rotate_fd;
+    struct video_fanout fanout;
+    struct video_capture capture;
+    char display_name[32];
+    char analysis_name[32];
 
-static bo_t g_rotate_bo;
-static int g_rotate_fd = -1;
+    unsigned char weights[81];
+    struct expo_box expo_box;
+    unsigned int expo_seq;
+    sem_t expo_sem;
+    pthread_t expo_tid;
+    bool expo_run;
+    int expo_requests;
+    int expo_ioctls;
+    long long expo_t0;
 
-static const struct rkisp_api_ctx *ctx;
-static const struct rkisp_api_buf *buf;
-static bool g_run;
-static pthread_t g_tid;
+    int fps;
+    struct timeval fps_t0;
+};
 
-static inline void rkisp_inc_fps(void)
+bool g_expo_weights_en = false;
+bool g_expo_luma_en = false;
+
+static struct rkisp_control g_isp[MAX_LANE];
+
+static inline void rkisp_inc_fps(struct rkisp_control *isp)
 {
-    static int fps = 0;
-    static struct timeval t0;
     struct timeval t1;
 
-    if (!t0.tv_sec)
-        gettimeofday(&t0, NULL);
-    fps++;
+    if (!isp->fps_t0.tv_sec)
+        gettimeofday(&isp->fps_t0, NULL);
+    isp->fps++;
     gettimeofday(&t1, NULL);
-    if ((t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_usec - t0.tv_usec) > 1000000) {
-        printf("ISP fps: %d\n", fps);
-        fps = 0;
-        gettimeofday(&t0, NULL);
+    if ((t1.tv_sec - isp->fps_t0.tv_sec) * 1000000 + (t1.tv_usec - isp->fps_t0.tv_usec) > 1000000) {
+        printf("lane %d ISP fps: %d\n", isp->lane, isp->fps);
+        isp->fps = 0;
+        gettimeofday(&isp->fps_t0, NULL);
     }
 }
 
-static void *process(void *arg)
+static void rkisp_display(const struct rkisp_api_buf *buf, void *arg)
 {
+    struct rkisp_control *isp = (struct rkisp_control *)arg;
     rga_info_t src, dst;
 
-    do {
-#if 0
-        rkisp_inc_fps();
-#endif
-        buf = rkisp_get_frame(ctx, 0);
-
-        memset(&src, 0, sizeof(rga_info_t));
-        src.fd = buf->fd;
-        src.mmuFlag = 1;
-        src.rotation = HAL_TRANSFORM_ROT_90;
-        rga_set_rect(&src.rect, 0, 0, ctx->width, ctx->height, ctx->width, ctx->height,
-                     RK_FORMAT_YCbCr_420_SP);
-        memset(&dst, 0, sizeof(rga_info_t));
-        dst.fd = g_rotate_fd;
-        dst.mmuFlag = 1;
-        rga_set_rect(&dst.rect, 0, 0, ctx->height, ctx->width, ctx->height, ctx->width,
-                     RK_FORMAT_YCbCr_420_SP);
-        if (c_RkRgaBlit(&src, &dst, NULL)) {
-            printf("%s: rga fail\n", __func__);
-            rkisp_put_frame(ctx, buf);
-            continue;
-        }
+    if (!shadow_display_vertical_cb)
+        return;
 
-        rockface_control_convert(g_rotate_bo.ptr, ctx->height, ctx->width,
-                                 RK_FORMAT_YCbCr_420_SP);
-        if (shadow_display_vertical_cb)
-            shadow_display_vertical_cb(g_rotate_bo.ptr, g_rotate_fd, RK_FORMAT_YCbCr_420_SP,
-                                       ctx->height, ctx->width);
+    memset(&src, 0, sizeof(rga_info_t));
+    src.fd = buf->fd;
+    src.mmuFlag = 1;
+    src.rotation = HAL_TRANSFORM_ROT_90;
+    rga_set_rect(&src.rect, 0, 0, isp->width, isp->height, isp->width, isp->height,
+                 RK_FORMAT_YCbCr_420_SP);
+    memset(&dst, 0, sizeof(rga_info_t));
+    dst.fd = isp->rotate_fd;
+    dst.mmuFlag = 1;
+    rga_set_rect(&dst.rect, 0, 0, isp->height, isp->width, isp->height, isp->width,
+                 RK_FORMAT_YCbCr_420_SP);
+    if (c_RkRgaBlit(&src, &dst, NULL)) {
+        printf("%s: rga fail\n", __func__);
+        return;
+    }
 
-        rkisp_put_frame(ctx, buf);
-    } while (g_run);
+    shadow_display_vertical_cb(isp->lane, NULL, isp->rotate_fd, RK_FORMAT_YCbCr_420_SP,
+                               isp->height, isp->width);
+}
 
-    pthread_exit(NULL);
+static void rkisp_analysis(const struct rkisp_api_buf *buf, void *arg)
+{
+    struct rkisp_control *isp = (struct rkisp_control *)arg;
+
+    rockface_control_convert(isp->lane, NULL, buf->fd, isp->width, isp->height,
+                             RK_FORMAT_YCbCr_420_SP, HAL_TRANSFORM_ROT_90);
 }
 
-int rkisp_control_init(void)
+static void rkisp_frame(struct video_capture *cap, const struct rkisp_api_buf *buf)
 {
+    struct rkisp_control *isp = (struct rkisp_control *)cap->arg;
+
+    if (g_perf_en)
+        rkisp_inc_fps(isp);
+    video_fanout_publish(&isp->fanout, buf);
+}
+
+static int rkisp_open(struct video_capture *cap)
+{
+    struct rkisp_control *isp = (struct rkisp_control *)cap->arg;
+    const struct rkisp_api_ctx *c;
     char name[32];
 
-    int id = get_video_id("rkisp1_mainpath");
+    int id = get_video_id(cap->name);
     if (id < 0) {
         printf("%s: get video id fail!\n", __func__);
         return -1;
@@ -118,106 +176,439 @@ int rkisp_control_init(void)
 
     snprintf(name, sizeof(name), "/dev/video%d", id);
     printf("%s: %s\n", __func__, name);
-    ctx = rkisp_open_device(name, 1);
-    if (ctx == NULL) {
+    c = rkisp_open_device(name, 1);
+    if (c == NULL) {
         printf("%s: ctx is NULL\n", __func__);
         return -1;
     }
 
-    rkisp_set_fmt(ctx, 1280, 720, ctx->fcc);
-
-    if (rga_control_buffer_init(&g_rotate_bo, &g_rotate_fd, ctx->width, ctx->height, 12))
+    rkisp_set_fmt(c, 1280, 720, c->fcc);
+    if (isp->width && (c->width != isp->width || c->height != isp->height)) {
+        printf("%s: format changed to %dx%d\n", __func__, c->width, c->height);
+        rkisp_close_device(c);
         return -1;
+    }
 
-    if (rkisp_start_capture(ctx))
+    if (rkisp_start_capture(c)) {
+        rkisp_close_device(c);
         return -1;
+    }
 
-    rkisp_get_expo_weights(ctx, weights, sizeof(weights));
-    printf("default weights:\n");
-    for (int i = 0; i < 81; i++) {
-        printf("0x%02x ", weights[i]);
-        if ((i + 1) % 9 == 0)
-            printf("\n");
+    pthread_mutex_lock(&isp->ctx_mutex);
+    isp->ctx = c;
+    isp->ctx_gen++;
+    pthread_mutex_unlock(&isp->ctx_mutex);
+    isp->width = c->width;
+    isp->height = c->height;
+    cap->ctx = c;
+
+    return 0;
+}
+
+static void rkisp_close(struct video_capture *cap)
+{
+    struct rkisp_control *isp = (struct rkisp_control *)cap->arg;
+
+    pthread_mutex_lock(&isp->ctx_mutex);
+    isp->ctx = NULL;
+    pthread_mutex_unlock(&isp->ctx_mutex);
+
+    rkisp_stop_capture(cap->ctx);
+    rkisp_close_device(cap->ctx);
+}
+
+/* the stream may be in the middle of a restart, skip the ioctl then */
+static void rkisp_expo_set(struct rkisp_control *isp, unsigned char *w)
+{
+    pthread_mutex_lock(&isp->ctx_mutex);
+    if (isp->ctx)
+        rkisp_set_expo_weights(isp->ctx, w, 81);
+    pthread_mutex_unlock(&isp->ctx_mutex);
+}
+
+static void rkisp_expo_grid(struct rkisp_control *isp, struct expo_grid *grid, int rotation,
+                            int left, int top, int right, int bottom)
+{
+    int x, y, w, h;
+
+    if (rotation == 270) {
+        x = isp->width - bottom;
+        y = left;
+    } else {
+        x = isp->width - top;
+        y = isp->height - right;
     }
-    printf("\n");
+    w = bottom - top;
+    h = right - left;
+    grid->x = x * 9 / isp->width;
+    grid->y = y * 9 / isp->height;
+    w = w * 9 / isp->width;
+    h = h * 9 / isp->height;
+    grid->w = w ? : 1;
+    grid->h = h ? : 1;
+    grid->bg = EXPO_BG_WEIGHT;
+}
 
-    g_run = true;
-    if (pthread_create(&g_tid, NULL, process, NULL)) {
-        printf("pthread_create fail\n");
+/*
+ * 16 bin histogram of the face on the Y plane of the rotated frame, every
+ * second row. The display thread may be writing the frame meanwhile, which
+ * is harmless for a brightness estimate.
+ */
+static int rkisp_expo_luma(struct rkisp_control *isp, int left, int top, int right, int bottom,
+                           unsigned int hist[16])
+{
+    const uint8_t *y = (const uint8_t *)isp->rotate_bo.ptr;
+    int stride = isp->height;
+    unsigned long long sum = 0;
+    unsigned int cnt = 0;
+
+    memset(hist, 0, 16 * sizeof(hist[0]));
+    if (left < 0)
+        left = 0;
+    if (top < 0)
+        top = 0;
+    if (right > isp->height)
+        right = isp->height;
+    if (bottom > isp->width)
+        bottom = isp->width;
+    if (right <= left || bottom <= top)
         return -1;
+    for (int j = top; j < bottom; j += 2) {
+        const uint8_t *p = y + j * stride + left;
+        int i = 0;
+#if defined(__ARM_NEON) && defined(__aarch64__)
+        uint8x16_t acc[16];
+        uint32x4_t vsum = vdupq_n_u32(0);
+        int n = 0;
+
+        for (int b = 0; b < 16; b++)
+            acc[b] = vdupq_n_u8(0);
+        for (; i + 16 <= right - left; i += 16) {
+            uint8x16_t v = vld1q_u8(p + i);
+            uint8x16_t bin = vshrq_n_u8(v, 4);
+            vsum = vpadalq_u16(vsum, vpaddlq_u8(v));
+            /* a match is 0xff, subtracting it counts one */
+            for (int b = 0; b < 16; b++)
+                acc[b] = vsubq_u8(acc[b], vceqq_u8(bin, vdupq_n_u8(b)));
+            if (++n == 255) {
+                for (int b = 0; b < 16; b++) {
+                    hist[b] += vaddlvq_u8(acc[b]);
+                    acc[b] = vdupq_n_u8(0);
+                }
+                n = 0;
+            }
+        }
+        for (int b = 0; b < 16; b++)
+            hist[b] += vaddlvq_u8(acc[b]);
+        sum += vaddvq_u32(vsum);
+        cnt += i;
+#endif
+        for (; i < right - left; i++) {
+            hist[p[i] >> 4]++;
+            sum += p[i];
+            cnt++;
+        }
     }
 
-    return 0;
+    return cnt ? sum / cnt : -1;
 }
 
-void rkisp_control_exit(void)
+/*
+ * rkisp_api only exposes the AE weight grid, so the face brightness is
+ * steered by lowering the weight of the background cells until the face
+ * alone meters the scene. Backlit faces get brighter, faces in front of a
+ * dark background get darker.
+ */
+static void rkisp_expo_face(struct rkisp_control *isp, struct expo_grid *grid,
+                            struct expo_box *box, int *bg)
 {
-    g_run = false;
-    if (g_tid) {
-        pthread_join(g_tid, NULL);
-        g_tid = 0;
+    unsigned int hist[16];
+    struct timeval t0, t1;
+    int luma;
+
+    gettimeofday(&t0, NULL);
+    luma = rkisp_expo_luma(isp, box->left, box->top, box->right, box->bottom, hist);
+    gettimeofday(&t1, NULL);
+    /* without a luma the last bg weight stays */
+    grid->bg = *bg;
+    if (luma < 0)
+        return;
+
+    /*
+     * A face off target takes weight from the background, one well inside
+     * the range gives it back, the band between holds the weight.
+     */
+    if (luma < EXPO_FACE_TARGET - EXPO_FACE_RANGE || luma > EXPO_FACE_TARGET + EXPO_FACE_RANGE) {
+        if (*bg > EXPO_BG_MIN)
+            (*bg)--;
+    } else if (luma >= EXPO_FACE_TARGET - EXPO_FACE_RANGE / 2 &&
+               luma <= EXPO_FACE_TARGET + EXPO_FACE_RANGE / 2 && *bg < EXPO_BG_MAX) {
+        (*bg)++;
     }
+    grid->bg = *bg;
+
+    if (g_perf_en)
+        printf("lane %d face luma: %d, dark %u, bright %u, bg weight %d, %ldus\n", isp->lane, luma,
+               hist[0] + hist[1] + hist[2] + hist[3], hist[12] + hist[13] + hist[14] + hist[15],
+               *bg, (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec);
+}
+
+
+static void rkisp_expo_apply(struct rkisp_control *isp, struct expo_grid *grid)
+{
+    unsigned char weights[81];
+
+    memset(weights, grid->bg, sizeof(weights));
+    for (int j = 0; j < 9; j++)
+        for (int i = 0; i < 9; i++)
+            if (i > grid->x && i <= grid->x + grid->w && j > grid->y && j <= grid->y + grid->h)
+                weights[j * 9 + i] = EXPO_FACE_WEIGHT;
+    rkisp_expo_set(isp, weights);
+}
+
+static void rkisp_expo_post(struct rkisp_control *isp, struct expo_box *box)
+{
+    /* single producer: the detect thread of this lane */
+    __atomic_store_n(&isp->expo_seq, isp->expo_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&isp->expo_box, box, sizeof(isp->expo_box));
+    __atomic_store_n(&isp->expo_seq, isp->expo_seq + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&isp->expo_requests, 1, __ATOMIC_RELAXED);
+    sem_post(&isp->expo_sem);
+}
+
+static void rkisp_expo_read(struct rkisp_control *isp, struct expo_box *box)
+{
+    unsigned int seq;
+
+    do {
+        seq = __atomic_load_n(&isp->expo_seq, __ATOMIC_ACQUIRE);
+        memcpy(box, &isp->expo_box, sizeof(*box));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&isp->expo_seq, __ATOMIC_RELAXED));
+}
+
+static long long rkisp_expo_ms(void)
+{
+    struct timeval t;
+
+    gettimeofday(&t, NULL);
+    return t.tv_sec * 1000LL + t.tv_usec / 1000;
+}
+
+static void rkisp_expo_stat(struct rkisp_control *isp, long long now)
+{
+    int requests;
+
+    if (!isp->expo_t0)
+        isp->expo_t0 = now;
+    if (now - isp->expo_t0 < 60000)
+        return;
+    requests = __atomic_exchange_n(&isp->expo_requests, 0, __ATOMIC_RELAXED);
+    if (g_perf_en)
+        printf("lane %d expo weights: %d requests, %d ioctls, %d saved in %llds\n", isp->lane,
+               requests, isp->expo_ioctls, requests - isp->expo_ioctls,
+               (now - isp->expo_t0) / 1000);
+    isp->expo_ioctls = 0;
+    isp->expo_t0 = now;
+}
+
+/*
+ * Applies the newest face box from the mailbox. Unchanged grids are not
+ * written again, a moved grid has to be seen EXPO_STABLE_CNT times in a row,
+ * a lost face only restores the default weights after EXPO_DEFAULT_CNT
+ * empty samples and updates are at least EXPO_INTERVAL_MS apart, so ISP
+ * ioctls stay out of the detect thread.
+ */
+static void *rkisp_expo_thread(void *arg)
+{
+    struct rkisp_control *isp = (struct rkisp_control *)arg;
+    struct expo_box box;
+    struct expo_grid grid;
+    struct expo_grid cur;
+    struct expo_grid cand;
+    bool def = true;
+    int empty = 0;
+    int stable = 0;
+    int bg = EXPO_BG_WEIGHT;
+    long long last = 0;
+    long long now;
+    int gen = isp->ctx_gen;
 
-    rkisp_stop_capture(ctx);
-    rkisp_close_device(ctx);
-
-    rga_control_buffer_deinit(&g_rotate_bo, g_rotate_fd);
-}
-
-void rkisp_control_expo_weights_270(int left, int top, int right, int bottom)
-{
-    if (g_expo_weights_en) {
-        unsigned char weights[81];
-        int x = ctx->width - bottom;
-        int y = left;
-        int w = bottom - top;
-        int h = right - left;
-        x = x * 9 / ctx->width;
-        y = y * 9 / ctx->height;
-        w = w * 9 / ctx->width;
-        h = h * 9 / ctx->height;
-        w = w ? : 1;
-        h = h ? : 1;
-        memset(weights, 2, sizeof(weights));
-        for (int j = 0; j < 9; j++)
-            for (int i = 0; i < 9; i++)
-                if (i > x && i <= x + w && j > y && j <= y + h)
-                    weights[j * 9 + i] = 31;
-        rkisp_set_expo_weights(ctx, weights, sizeof(weights));
-        g_def_expo_weights = false;
+    while (isp->expo_run) {
+        sem_wait(&isp->expo_sem);
+        if (!isp->expo_run)
+            break;
+        /* fold the burst of requests into the newest one */
+        while (sem_trywait(&isp->expo_sem) == 0)
+            ;
+
+        now = rkisp_expo_ms();
+        rkisp_expo_stat(isp, now);
+        if (now - last < EXPO_INTERVAL_MS) {
+            usleep((EXPO_INTERVAL_MS - (now - last)) * 1000);
+            now = rkisp_expo_ms();
+        }
+
+        rkisp_expo_read(isp, &box);
+        if (gen != isp->ctx_gen) {
+            /* a restarted stream comes back with the driver's weights */
+            gen = isp->ctx_gen;
+            memset(&cur, 0, sizeof(cur));
+            def = true;
+            empty = 0;
+        }
+        if (!box.face) {
+            if (def || ++empty < EXPO_DEFAULT_CNT)
+                continue;
+            rkisp_expo_set(isp, isp->weights);
+            def = true;
+            bg = EXPO_BG_WEIGHT;
+        } else {
+            empty = 0;
+            rkisp_expo_grid(isp, &grid, box.rotation, box.left, box.top, box.right, box.bottom);
+            if (g_expo_luma_en)
+                rkisp_expo_face(isp, &grid, &box, &bg);
+            if (!def && !memcmp(&grid, &cur, sizeof(grid)))
+                continue;
+            if (stable && !memcmp(&grid, &cand, sizeof(grid))) {
+                stable++;
+            } else {
+                memcpy(&cand, &grid, sizeof(cand));
+                stable = 1;
+            }
+            if (!def && stable < EXPO_STABLE_CNT)
+                continue;
+            rkisp_expo_apply(isp, &grid);
+            stable = 0;
+            memcpy(&cur, &grid, sizeof(cur));
+            def = false;
+        }
+        isp->expo_ioctls++;
+        last = now;
     }
+
+    pthread_exit(NULL);
 }
 
-void rkisp_control_expo_weights_90(int left, int top, int right, int bottom)
-{
-    if (g_expo_weights_en) {
-        unsigned char weights[81];
-        int x = ctx->width - top;
-        int y = ctx->height - right;
-        int w = bottom - top;
-        int h = right - left;
-        x = x * 9 / ctx->width;
-        y = y * 9 / ctx->height;
-        w = w * 9 / ctx->width;
-        h = h * 9 / ctx->height;
-        w = w ? : 1;
-        h = h ? : 1;
-        memset(weights, 2, sizeof(weights));
-        for (int j = 0; j < 9; j++)
-            for (int i = 0; i < 9; i++)
-                if (i > x && i <= x + w && j > y && j <= y + h)
-                    weights[j * 9 + i] = 31;
-        rkisp_set_expo_weights(ctx, weights, sizeof(weights));
-        g_def_expo_weights = false;
+static int rkisp_expo_init(struct rkisp_control *isp)
+{
+    if (!g_expo_weights_en)
+        return 0;
+
+    sem_init(&isp->expo_sem, 0, 0);
+    isp->expo_run = true;
+    if (pthread_create(&isp->expo_tid, NULL, rkisp_expo_thread, isp)) {
+        printf("%s: pthread_create fail\n", __func__);
+        isp->expo_run = false;
+        return -1;
     }
+
+    return 0;
 }
 
-void rkisp_control_expo_weights_default(void)
+static void rkisp_expo_exit(struct rkisp_control *isp)
 {
-    if (g_expo_weights_en) {
-        if (!g_def_expo_weights) {
-            g_def_expo_weights = true;
-            rkisp_set_expo_weights(ctx, weights, sizeof(weights));
-        }
+    if (!isp->expo_tid)
+        return;
+
+    isp->expo_run = false;
+    sem_post(&isp->expo_sem);
+    pthread_join(isp->expo_tid, NULL);
+    isp->expo_tid = 0;
+    sem_destroy(&isp->expo_sem);
+}
+
+int rkisp_control_init(int lane, const char *name)
+{
+    struct rkisp_control *isp;
+
+    if (lane < 0 || lane >= MAX_LANE)
+        return -1;
+
+    isp = &g_isp[lane];
+    memset(isp, 0, sizeof(*isp));
+    isp->lane = lane;
+    isp->rotate_fd = -1;
+    pthread_mutex_init(&isp->ctx_mutex, NULL);
+    video_fanout_init(&isp->fanout, NULL);
+    isp->capture.name = name;
+    isp->capture.open = rkisp_open;
+    isp->capture.close = rkisp_close;
+    isp->capture.frame = rkisp_frame;
+    isp->capture.fanout = &isp->fanout;
+    isp->capture.arg = isp;
+    if (video_capture_open(&isp->capture))
+        return -1;
+
+    if (rga_control_buffer_init(&isp->rotate_bo, &isp->rotate_fd, isp->width, isp->height, 12))
+        return -1;
+
+    rkisp_get_expo_weights(isp->ctx, isp->weights, sizeof(isp->weights));
+    printf("lane %d default weights:\n", lane);
+    for (int i = 0; i < 81; i++) {
+        printf("0x%02x ", isp->weights[i]);
+        if ((i + 1) % 9 == 0)
+            printf("\n");
     }
+    printf("\n");
+
+    if (rkisp_expo_init(isp))
+        return -1;
+
+    snprintf(isp->display_name, sizeof(isp->display_name), "lane %d ISP display", lane);
+    snprintf(isp->analysis_name, sizeof(isp->analysis_name), "lane %d ISP analysis", lane);
+    video_fanout_add(&isp->fanout, isp->display_name, rkisp_display, isp);
+    video_fanout_add(&isp->fanout, isp->analysis_name, rkisp_analysis, isp);
+    if (video_fanout_start(&isp->fanout))
+        return -1;
+
+    return video_capture_start(&isp->capture);
+}
+
+void rkisp_control_exit(int lane)
+{
+    struct rkisp_control *isp;
+
+    if (lane < 0 || lane >= MAX_LANE)
+        return;
+
+    isp = &g_isp[lane];
+    video_capture_stop(&isp->capture);
+    video_fanout_exit(&isp->fanout);
+    rkisp_expo_exit(isp);
+
+    if (isp->rotate_fd >= 0)
+        rga_control_buffer_deinit(&isp->rotate_bo, isp->rotate_fd);
+    isp->rotate_fd = -1;
+}
+
+static void rkisp_control_expo_post(int lane, struct expo_box *box)
+{
+    if (lane < 0 || lane >= MAX_LANE)
+        return;
+
+    if (g_isp[lane].expo_run)
+        rkisp_expo_post(&g_isp[lane], box);
+}
+
+void rkisp_control_expo_weights_270(int lane, int left, int top, int right, int bottom)
+{
+    struct expo_box box = {left, top, right, bottom, 270, true};
+
+    rkisp_control_expo_post(lane, &box);
+}
+
+void rkisp_control_expo_weights_90(int lane, int left, int top, int right, int bottom)
+{
+    struct expo_box box = {left, top, right, bottom, 90, true};
+
+    rkisp_control_expo_post(lane, &box);
+}
+
+void rkisp_control_expo_weights_default(int lane)
+{
+    struct expo_box box = {0, 0, 0, 0, 0, false};
+
+    rkisp_control_expo_post(lane, &box);
 }
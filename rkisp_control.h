@@ -37,11 +37,11 @@
 extern "C" {
 #endif
 
-int rkisp_control_init(void);
-void rkisp_control_exit(void);
-void rkisp_control_expo_weights_270(int left, int top, int right, int bottom);
-void rkisp_control_expo_weights_90(int left, int top, int right, int bottom);
-void rkisp_control_expo_weights_default(void);
+int rkisp_control_init(int lane, const char *name);
+void rkisp_control_exit(int lane);
+void rkisp_control_expo_weights_270(int lane, int left, int top, int right, int bottom);
+void rkisp_control_expo_weights_90(int lane, int left, int top, int right, int bottom);
+void rkisp_control_expo_weights_default(int lane);
 
 #ifdef __cplusplus
 }
@@ -39,6 +39,7 @@
 #include <sys/time.h>
 #include <pthread.h>
 #include <errno.h>
+#include <math.h>
 
 #include "face_common.h"
 #include "database.h"
@@ -48,6 +49,11 @@
 #include "video_common.h"
 #include "rkisp_control.h"
 #include "rkcif_control.h"
+#include "npu_scheduler.h"
+#include "feature_pool.h"
+#include "face_quality.h"
+#include "face_search.h"
+#include "face_gallery.h"
 
 #define DEFAULT_FACE_NUMBER 1000
 #define DEFAULT_FACE_PATH "/userdata"
@@ -64,46 +70,339 @@
 #define CONVERT_IR_WIDTH 640
 #define FACE_TRACK_FRAME 0
 #define FACE_RETRACK_TIME 1
+/* a detection that waited longer than this is for a frame already replaced */
+#define FACE_DETECT_DEADLINE_MS 100
+/* a new track is watched this long for its best frame, unless one is excellent */
+#define FACE_WINDOW_FRAMES 5
+#define FACE_WINDOW_MS 300
+#define FACE_WINDOW_EXCELLENT 85
 
-static void *g_face_data = NULL;
-static int g_face_index = 0;
+/*
+ * The cosine scan only orders the gallery, a match is decided on the
+ * rockface_feature_compare() similarity of the best hit, smaller is closer,
+ * the score rockface_feature_search() took its 0.7 threshold in. A match is
+ * entered up to FACE_MATCH_ENTER and kept up to FACE_MATCH_STAY, 0.9 is
+ * the distance of unit features a cosine of 0.6 apart.
+ */
+#define FACE_MATCH_ENTER 0.7
+#define FACE_MATCH_STAY 0.9
+/* a new match also needs this cosine lead over the runner-up */
+#define FACE_MATCH_MARGIN 0.05
+/* a hit of this cosine ends the scan and, if the SDK takes it, skips the margin */
+#define FACE_FAST_ACCEPT 0.85
+#define FACE_SEARCH_TOPK 3
+/*
+ * Regulars are taken from the hot set only this close, otherwise the full
+ * search runs. The hot set knows no runner-up from the rest of the gallery,
+ * so it must not take anything short of a fast accept.
+ */
+#define FACE_HOT_ACCEPT FACE_FAST_ACCEPT
+/* the product quantizer is trained on up to this many gallery features */
+#define FACE_PQ_TRAIN_MIN 4096
+#define FACE_PQ_TRAIN_MAX 16384
+#define FACE_PQ_TRAIN_ITERS 8
+#define FACE_FEATURE_DIM (sizeof(((rockface_feature_t *)0)->feature) / sizeof(float))
+/* gallery changes waiting for the update thread */
+#define FACE_UPDATE_QUEUE_LEN 8
+/* imported faces are merged into the live gallery this many or this often */
+#define FACE_IMPORT_MERGE_CNT 64
+#define FACE_IMPORT_MERGE_MS 1000
+#define FACE_IMPORT_PENDING_MAX 256
+
+/* best aligned crop of the current track, extracted once when the window closes */
+struct face_window {
+    int track;
+    int frames;
+    struct timeval t0;
+    int score;
+    rockface_image_t img;
+};
+
+/*
+ * Quality weighted mean of the unit length features of the current track,
+ * searched instead of the single frame feature. match is the identity id
+ * the track last matched, valid while gen equals the library gen.
+ */
+struct face_fusion {
+    int track;
+    int frames;
+    int len;
+    float weight;
+    float norm;
+    float sum[FACE_FEATURE_DIM];
+    int match;
+    int gen;
+};
+
+/*
+ * One version of the gallery, which carries the PQ codes, and its search
+ * index. A reader pins the published version with rockface_library_get()
+ * for as long as it uses ids or names of it. Register and delete build the
+ * next version on the update thread while the lanes keep searching the
+ * current one, either by sharing the current gallery and appending or from
+ * the database, and rockface_library_publish() swaps it in. The old
+ * version is freed by whoever puts its last reference.
+ */
+struct face_library {
+    struct face_gallery gallery;
+    struct face_search_index *index;
+    /* bumped when ids moved, appends keep it */
+    int gen;
+    int refs;
+};
+
+enum face_update_op {
+    FACE_UPDATE_REGISTER,
+    FACE_UPDATE_DELETE,
+    FACE_UPDATE_IMPORT,
+};
+
+struct face_update {
+    enum face_update_op op;
+    rockface_feature_t feature;
+    char name[NAME_LEN];
+};
+
+/*
+ * Every lane (one RGB/IR camera pair) runs its own detect and recognition
+ * thread with its own frames, track and overlay. The gallery and the
+ * recognizer handles are shared, rockface_track() keeps its state in the
+ * handle, so every lane detects on a handle of its own.
+ */
+struct rockface_lane {
+    int id;
+    rockface_handle_t handle;
+
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool flag;
+    pthread_t detect_tid;
+    pthread_mutex_t detect_mutex;
+    pthread_cond_t detect_cond;
+    bool detect_flag;
+
+    int rgb_width, rgb_height;
+    rockface_image_t rgb_img;
+    struct timeval rgb_ts;
+    rockface_det_t rgb_face;
+    bo_t rgb_bo;
+    int rgb_fd;
+    rockface_image_t rgbx_img;
+    struct timeval rgbx_ts;
+    bo_t rgbx_bo;
+    int rgbx_fd;
+    int rgb_track;
+    struct timeval retrack_t0;
+    pthread_mutex_t rgb_track_mutex;
+    struct face_window window;
+    struct face_fusion fusion;
+
+    pthread_mutex_t ir_mutex;
+    pthread_cond_t ir_cond;
+    pthread_mutex_t ir_img_mutex;
+    rockface_image_t ir_img;
+    bo_t ir_bo;
+    int ir_fd;
+
+    /* identity last let through, and the label painted for label_id */
+    int last_id;
+    int last_gen;
+    int label_id;
+    int label_gen;
+    char label[NAME_LEN];
+    int total_cnt;
+    int extract_cnt;
+    int pass_total;
+    int extract_total;
+
+    /* per lane throughput and latency, printed every second */
+    pthread_mutex_t stat_mutex;
+    struct timeval stat_t0;
+    int detects;
+    int searches;
+    int passes;
+    int npu_jobs;
+    long long npu_wait_sum;
+    long long npu_wait_max;
+    long long latency_sum;
+    long long latency_max;
+    int scored;
+    int fast;
+    float score_sum;
+    float margin_sum;
+    /* SDK similarity of the best hits and its largest gap to the cosine */
+    float sdk_sum;
+    float sdk_gap;
+    /* a face that stays keeps its track id, imports must not move it */
+    int track_switches;
+    int import_detects;
+};
+
+/* galleries grow in chunks, g_face_cnt is only the registration limit */
 static int g_face_cnt = DEFAULT_FACE_NUMBER;
+/* optional product quantizer, the codes of every version use it */
+bool g_face_pq_en = false;
+static struct face_pq g_face_pq;
+/* the published version, g_library_mutex guards the pointer and the counts */
+static struct face_library *g_library;
+static pthread_mutex_t g_library_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* serializes searches and publishing, face_search shares its hot set and scratch */
+static pthread_mutex_t g_face_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t g_update_tid;
+static pthread_mutex_t g_update_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_update_cond = PTHREAD_COND_INITIALIZER;
+static struct face_update g_update_queue[FACE_UPDATE_QUEUE_LEN];
+static struct face_update g_update_batch[FACE_UPDATE_QUEUE_LEN];
+static int g_update_cnt;
+/* queued or being built, a registration waits for it to be searchable */
+static int g_update_busy;
+static bool g_update_run;
+/* the published version still lacks the PQ codes, init leaves them to the update thread */
+static bool g_update_codes;
 
+/*
+ * Photos under DEFAULT_FACE_PATH are imported while the gate already runs
+ * on the database gallery. The import thread fills one buffer while the
+ * update thread merges the other, and waits when it is full.
+ */
+static pthread_t g_import_tid;
+static pthread_cond_t g_import_cond = PTHREAD_COND_INITIALIZER;
+/* photos detected so far, for the lane statistics */
+static int g_import_detects;
+static bool g_import_run;
+static struct face_update *g_import_queue;
+static struct face_update *g_import_spare;
+static int g_import_cnt;
+static bool g_import_ready;
+static struct timeval g_import_t0;
+static int g_import_merged;
+
+/* recognizer handles, all NPU work is admitted through npu_scheduler */
 static rockface_handle_t face_handle;
-static int g_total_cnt;
+static rockface_handle_t g_handles[NPU_MAX_HANDLES];
+static int g_handle_cnt;
+
+static pthread_mutex_t g_extract_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct timeval g_extract_t0;
+static int g_extract_cnt[FACE_QUALITY_REASON_NUM];
 
-static pthread_t g_tid;
 static bool g_run;
-static char last_name[NAME_LEN];
-static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t g_cond = PTHREAD_COND_INITIALIZER;
-static bool g_flag;
-static pthread_t g_detect_tid;
-static pthread_mutex_t g_detect_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t g_detect_cond = PTHREAD_COND_INITIALIZER;
-static bool g_detect_flag;
-static int g_rgb_width, g_rgb_height;
-static rockface_image_t g_rgb_img;
-static rockface_det_t g_rgb_face;
-static bo_t g_rgb_bo;
-static int g_rgb_fd = -1;
-static rockface_image_t g_rgbx_img;
-static bo_t g_rgbx_bo;
-static int g_rgbx_fd = -1;
-static int g_rgb_track = -1;
-static pthread_mutex_t g_rgb_track_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-static pthread_mutex_t g_ir_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t g_ir_cond = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t g_ir_img_mutex = PTHREAD_MUTEX_INITIALIZER;
-static rockface_image_t g_ir_img;
-static bo_t g_ir_bo;
-static int g_ir_fd = -1;
+static struct rockface_lane g_lanes[MAX_LANE];
+static int g_lane_num;
 
 static bool g_register = false;
 static int g_register_cnt = 0;
 static bool g_delete = false;
 
+static long long rockface_diff_us(struct timeval *t0, struct timeval *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) * 1000000LL + (t1->tv_usec - t0->tv_usec);
+}
+
+static int rockface_npu_get(struct rockface_lane *lane, enum npu_job_class cls,
+                            int deadline_ms)
+{
+    struct timeval t0, t1;
+    long long wait;
+    int slot;
+
+    gettimeofday(&t0, NULL);
+    slot = npu_scheduler_get(cls, deadline_ms);
+    gettimeofday(&t1, NULL);
+
+    if (!lane || slot < 0)
+        return slot;
+    wait = rockface_diff_us(&t0, &t1);
+    pthread_mutex_lock(&lane->stat_mutex);
+    lane->npu_jobs++;
+    lane->npu_wait_sum += wait;
+    if (wait > lane->npu_wait_max)
+        lane->npu_wait_max = wait;
+    pthread_mutex_unlock(&lane->stat_mutex);
+
+    return slot;
+}
+
+static void rockface_lane_latency(struct rockface_lane *lane, struct timeval *ts)
+{
+    struct timeval t1;
+    long long latency;
+
+    gettimeofday(&t1, NULL);
+    latency = rockface_diff_us(ts, &t1);
+    pthread_mutex_lock(&lane->stat_mutex);
+    lane->searches++;
+    lane->latency_sum += latency;
+    if (latency > lane->latency_max)
+        lane->latency_max = latency;
+    pthread_mutex_unlock(&lane->stat_mutex);
+}
+
+/*
+ * sdk is the rockface_feature_compare() similarity of the hit of cosine
+ * score, the gap is taken to the distance of unit features that far apart.
+ */
+static void rockface_lane_score(struct rockface_lane *lane, float score, float margin,
+                                float sdk, bool fast)
+{
+    float gap = fabsf(sdk - sqrtf(fmaxf(2 - 2 * score, 0)));
+
+    pthread_mutex_lock(&lane->stat_mutex);
+    lane->scored++;
+    lane->score_sum += score;
+    lane->margin_sum += margin;
+    lane->sdk_sum += sdk;
+    if (gap > lane->sdk_gap)
+        lane->sdk_gap = gap;
+    if (fast)
+        lane->fast++;
+    pthread_mutex_unlock(&lane->stat_mutex);
+}
+
+static inline void rockface_lane_stat(struct rockface_lane *lane)
+{
+    struct timeval t1;
+
+    gettimeofday(&t1, NULL);
+    pthread_mutex_lock(&lane->stat_mutex);
+    if (!lane->stat_t0.tv_sec)
+        lane->stat_t0 = t1;
+    lane->detects++;
+    if (rockface_diff_us(&lane->stat_t0, &t1) > 1000000) {
+        int imports = __atomic_load_n(&g_import_detects, __ATOMIC_RELAXED);
+        printf("lane %d detect fps: %d, search: %d, pass: %d, npu wait avg: %lldus, max: %lldus, "
+               "latency avg: %lldus, max: %lldus, score avg: %.3f, margin avg: %.3f, fast: %d, "
+               "sdk avg: %.3f, sdk gap max: %.3f, track switches: %d, import detects: %d\n",
+               lane->id, lane->detects, lane->searches,
+               lane->passes, lane->npu_jobs ? lane->npu_wait_sum / lane->npu_jobs : 0,
+               lane->npu_wait_max, lane->searches ? lane->latency_sum / lane->searches : 0,
+               lane->latency_max, lane->scored ? lane->score_sum / lane->scored : 0,
+               lane->scored ? lane->margin_sum / lane->scored : 0, lane->fast,
+               lane->scored ? lane->sdk_sum / lane->scored : 0, lane->sdk_gap,
+               lane->track_switches, imports - lane->import_detects);
+        lane->track_switches = 0;
+        lane->import_detects = imports;
+        lane->detects = 0;
+        lane->searches = 0;
+        lane->passes = 0;
+        lane->npu_jobs = 0;
+        lane->npu_wait_sum = 0;
+        lane->npu_wait_max = 0;
+        lane->latency_sum = 0;
+        lane->latency_max = 0;
+        lane->scored = 0;
+        lane->fast = 0;
+        lane->score_sum = 0;
+        lane->margin_sum = 0;
+        lane->sdk_sum = 0;
+        lane->sdk_gap = 0;
+        lane->stat_t0 = t1;
+    }
+    pthread_mutex_unlock(&lane->stat_mutex);
+}
+
 static rockface_det_t *get_max_face(rockface_det_array_t *face_array)
 {
     rockface_det_t *max_face = NULL;
@@ -127,9 +426,13 @@ static rockface_det_t *get_max_face(rockface_det_array_t *face_array)
     return max_face;
 }
 
-static int _rockface_control_detect(rockface_image_t *image, rockface_det_t *out_face, int *track)
+/* returns -3 when the job expired in the NPU queue */
+static int _rockface_control_detect(struct rockface_lane *lane, rockface_image_t *image,
+                                    rockface_det_t *out_face)
 {
     int r = 0;
+    int slot;
+    rockface_handle_t handle;
     rockface_ret_t ret;
     rockface_det_array_t face_array0;
     rockface_det_array_t face_array;
@@ -138,11 +441,25 @@ static int _rockface_control_detect(rockface_image_t *image, rockface_det_t *out
     memset(&face_array, 0, sizeof(rockface_det_array_t));
     memset(out_face, 0, sizeof(rockface_det_t));
 
-    ret = rockface_detect(face_handle, image, &face_array0);
-    if (ret != ROCKFACE_RET_SUCCESS)
-        return -1;
-
-    ret = rockface_track(face_handle, image, FACE_TRACK_FRAME, &face_array0, &face_array);
+    if (lane)
+        slot = rockface_npu_get(lane, NPU_JOB_DETECT, FACE_DETECT_DEADLINE_MS);
+    else
+        slot = rockface_npu_get(lane, NPU_JOB_OPPORTUNISTIC, 0);
+    if (slot < 0)
+        return -3;
+    handle = lane ? lane->handle : npu_scheduler_handle(slot);
+    ret = rockface_detect(handle, image, &face_array0);
+    /*
+     * The tracker state lives in the handle, with one handle that of
+     * lane 0. A still photo has nothing to follow and must not feed it.
+     */
+    if (ret == ROCKFACE_RET_SUCCESS && lane)
+        ret = rockface_track(handle, image, FACE_TRACK_FRAME, &face_array0, &face_array);
+    else if (ret == ROCKFACE_RET_SUCCESS)
+        memcpy(&face_array, &face_array0, sizeof(face_array));
+    npu_scheduler_put(slot);
+    if (!lane)
+        __atomic_add_fetch(&g_import_detects, 1, __ATOMIC_RELAXED);
     if (ret != ROCKFACE_RET_SUCCESS)
         return -1;
 
@@ -155,95 +472,393 @@ static int _rockface_control_detect(rockface_image_t *image, rockface_det_t *out
 
     memcpy(out_face, face, sizeof(rockface_det_t));
 
-    if (track) {
-        pthread_mutex_lock(&g_rgb_track_mutex);
-        if (g_delete || g_register)
-            *track = -1;
-        else if (*track == face->id)
+    if (lane) {
+        bool switched = false;
+
+        pthread_mutex_lock(&lane->rgb_track_mutex);
+        if (g_delete || g_register) {
+            lane->rgb_track = -1;
+        } else if (lane->rgb_track == face->id) {
             r = -2;
-        else
-            *track = face->id;
-        pthread_mutex_unlock(&g_rgb_track_mutex);
+        } else {
+            switched = lane->rgb_track >= 0;
+            lane->rgb_track = face->id;
+        }
+        pthread_mutex_unlock(&lane->rgb_track_mutex);
+        if (switched) {
+            pthread_mutex_lock(&lane->stat_mutex);
+            lane->track_switches++;
+            pthread_mutex_unlock(&lane->stat_mutex);
+        }
     }
 
     return r;
 }
 
-static int rockface_control_detect(rockface_image_t *image, rockface_det_t *face)
+static int rockface_control_detect(struct rockface_lane *lane, rockface_image_t *image,
+                                   rockface_det_t *face)
 {
     int ret;
-    static struct timeval t0;
     struct timeval t1;
 
     memset(face, 0, sizeof(rockface_det_t));
 
     gettimeofday(&t1, NULL);
-    pthread_mutex_lock(&g_rgb_track_mutex);
-    if (g_rgb_track >= 0 && (t1.tv_sec - t0.tv_sec) > FACE_RETRACK_TIME) {
-        g_rgb_track = -1;
-        gettimeofday(&t0, NULL);
+    pthread_mutex_lock(&lane->rgb_track_mutex);
+    if (lane->rgb_track >= 0 && (t1.tv_sec - lane->retrack_t0.tv_sec) > FACE_RETRACK_TIME) {
+        lane->rgb_track = -1;
+        gettimeofday(&lane->retrack_t0, NULL);
     }
-    pthread_mutex_unlock(&g_rgb_track_mutex);
-    ret = _rockface_control_detect(image, face, &g_rgb_track);
+    pthread_mutex_unlock(&lane->rgb_track_mutex);
+    ret = _rockface_control_detect(lane, image, face);
+    if (ret == -3)
+        return ret;
     if (face->score > FACE_SCORE_RGB) {
         int left, top, right, bottom;
-        left = face->box.left * g_rgb_width / image->width;
-        top = face->box.top * g_rgb_height / image->height;
-        right = face->box.right * g_rgb_width / image->width;
-        bottom = face->box.bottom * g_rgb_height / image->height;
+        left = face->box.left * lane->rgb_width / image->width;
+        top = face->box.top * lane->rgb_height / image->height;
+        right = face->box.right * lane->rgb_width / image->width;
+        bottom = face->box.bottom * lane->rgb_height / image->height;
         if (shadow_paint_box_cb)
-            shadow_paint_box_cb(left, top, right, bottom);
-        rkisp_control_expo_weights_90(left, top, right, bottom);
+            shadow_paint_box_cb(lane->id, left, top, right, bottom);
+        rkisp_control_expo_weights_90(lane->id, left, top, right, bottom);
     } else {
         if (shadow_paint_box_cb)
-            shadow_paint_box_cb(0, 0, 0, 0);
-        rkisp_control_expo_weights_default();
+            shadow_paint_box_cb(lane->id, 0, 0, 0, 0);
+        rkisp_control_expo_weights_default(lane->id);
     }
 
     return ret;
 }
 
-static int rockface_control_init_library(void *data, int num, size_t size, size_t off)
+static struct face_library *rockface_library_alloc(int gen)
 {
-    rockface_ret_t ret;
+    struct face_library *lib;
 
-    ret = rockface_face_library_init(face_handle, data, num, size, off);
-    if (ret != ROCKFACE_RET_SUCCESS) {
-        printf("%s: int library error %d!\n", __func__, ret);
+    lib = (struct face_library *)calloc(1, sizeof(*lib));
+    if (!lib) {
+        printf("%s: alloc fail\n", __func__);
+        return NULL;
+    }
+    /* with -q the gallery keeps int8 features, the codes do the scan */
+    face_gallery_init(&lib->gallery, g_face_cnt, g_face_pq_en);
+    lib->gen = gen;
+    lib->refs = 1;
+
+    return lib;
+}
+
+static void rockface_library_free(struct face_library *lib)
+{
+    face_search_index_free(lib->index);
+    face_gallery_release(&lib->gallery);
+    free(lib);
+}
+
+static struct face_library *rockface_library_get(void)
+{
+    struct face_library *lib;
+
+    pthread_mutex_lock(&g_library_mutex);
+    lib = g_library;
+    if (lib)
+        lib->refs++;
+    pthread_mutex_unlock(&g_library_mutex);
+
+    return lib;
+}
+
+static void rockface_library_put(struct face_library *lib)
+{
+    bool last;
+
+    if (!lib)
+        return;
+    pthread_mutex_lock(&g_library_mutex);
+    last = !--lib->refs;
+    pthread_mutex_unlock(&g_library_mutex);
+    if (last)
+        rockface_library_free(lib);
+}
+
+/*
+ * The reference lib was allocated with becomes the one of the published
+ * version. stable tells face_search that ids did not move. Searches wait
+ * only for the pointer swap, a search already running finishes on the old
+ * version, which lives on until its last reader puts it.
+ */
+static void rockface_library_publish(struct face_library *lib, bool stable)
+{
+    struct face_library *old;
+
+    pthread_mutex_lock(&g_face_mutex);
+    face_search_publish(lib ? lib->index : NULL, stable);
+    pthread_mutex_lock(&g_library_mutex);
+    old = g_library;
+    g_library = lib;
+    pthread_mutex_unlock(&g_library_mutex);
+    pthread_mutex_unlock(&g_face_mutex);
+    rockface_library_put(old);
+}
+
+static int rockface_library_index(struct face_library *lib)
+{
+    struct face_gallery *gallery = &lib->gallery;
+    bool coded = gallery->code_num && gallery->code_num == gallery->num;
+    size_t own, shared;
+
+    lib->index = face_search_build(gallery->chunks, FACE_GALLERY_CHUNK_SHIFT, gallery->num,
+                                   face_gallery_entry_size(gallery), 0,
+                                   gallery->q8 ? FACE_SEARCH_Q8 : FACE_SEARCH_FP32, &g_face_pq,
+                                   coded ? (const uint8_t *const *)gallery->codes : NULL);
+    if (!lib->index) {
+        printf("%s: init library error!\n", __func__);
         return -1;
     }
+    own = face_gallery_footprint(gallery, &shared);
+    printf("gallery: %d faces in %d chunks, %zu KB, %zu KB shared with the last version\n",
+           gallery->num, gallery->chunk_cnt, own >> 10, shared >> 10);
 
     return 0;
 }
 
-static void rockface_control_release_library(void)
+/* evenly spaced gallery features, once, the codebook then lives in the database */
+static int rockface_control_train_pq(const struct face_gallery *gallery)
+{
+    int num = gallery->num;
+    int n = num < FACE_PQ_TRAIN_MAX ? num : FACE_PQ_TRAIN_MAX;
+    float v[FACE_FEATURE_DIM];
+    int dim = face_gallery_unit(gallery, 0, v);
+    float *vecs;
+    void *blob;
+    int ret = -1;
+
+    if (dim <= 0)
+        return -1;
+    vecs = (float *)calloc((size_t)n * dim, sizeof(float));
+    if (!vecs)
+        return -1;
+    for (int i = 0; i < n; i++)
+        if (face_gallery_unit(gallery, (long)i * num / n, v) == dim)
+            memcpy(vecs + (size_t)i * dim, v, dim * sizeof(float));
+    printf("train product quantizer on %d features\n", n);
+    if (!face_pq_train(&g_face_pq, vecs, n, dim, FACE_PQ_TRAIN_ITERS)) {
+        blob = malloc(face_pq_size(&g_face_pq));
+        if (blob && !face_pq_save(&g_face_pq, blob, face_pq_size(&g_face_pq)))
+            ret = database_set_codebook(blob, face_pq_size(&g_face_pq));
+        free(blob);
+    }
+    free(vecs);
+
+    return ret;
+}
+
+static void rockface_control_encode(const struct face_gallery *gallery, int id, uint8_t *code)
 {
-    rockface_face_library_release(face_handle);
+    float v[FACE_FEATURE_DIM];
+
+    if (face_gallery_unit(gallery, id, v) != g_face_pq.dim) {
+        memset(code, 0, FACE_PQ_CODE);
+        return;
+    }
+    face_pq_encode(&g_face_pq, v, code);
+    database_insert_code(code, FACE_PQ_CODE, face_gallery_name(gallery, id));
 }
 
-static int rockface_control_get_feature(rockface_image_t *in_image,
-                                        rockface_feature_t *out_feature,
-                                        rockface_det_t *in_face)
+/* database rows into the gallery in arg, stops at its limit */
+static int rockface_control_add_data(const void *data, size_t size, const char *name, void *arg)
 {
-    rockface_ret_t ret;
+    if (size > sizeof(rockface_feature_t))
+        return 0;
 
-    rockface_landmark_t landmark;
-    ret = rockface_landmark5(face_handle, in_image, &(in_face->box), &landmark);
-    if (ret != ROCKFACE_RET_SUCCESS || landmark.score < FACE_SCORE_LANDMARK)
-        return -1;
+    return face_gallery_append((struct face_gallery *)arg, data, size, name) < 0 ? -1 : 0;
+}
 
+/*
+ * Codes of the whole gallery of lib. Those of the entries shared from the
+ * last version are kept, the others are read from the database or
+ * encoded. Without a codebook and with too few features to train one,
+ * face_search keeps the binary prefilter and the gallery has no codes.
+ * Training and encoding take a while, so this only runs on the update
+ * thread.
+ */
+static void rockface_library_load_codes(struct face_library *lib)
+{
+    struct face_gallery *gallery = &lib->gallery;
+    int num = gallery->num;
+    uint8_t code[FACE_PQ_CODE];
+    void *blob;
+    size_t size;
+
+    if (!g_face_pq_en || num <= 0)
+        return;
+
+    if (!g_face_pq.centroids) {
+        if (!database_get_codebook(&blob, &size))
+            face_pq_load(&g_face_pq, blob, size);
+        free(blob);
+        if (!g_face_pq.centroids && num >= FACE_PQ_TRAIN_MIN)
+            rockface_control_train_pq(gallery);
+        if (!g_face_pq.centroids)
+            return;
+    }
+
+    database_begin();
+    for (int i = gallery->code_num; i < num; i++) {
+        if (database_get_code(face_gallery_name(gallery, i), code, FACE_PQ_CODE))
+            rockface_control_encode(gallery, i, code);
+        if (face_gallery_append_code(gallery, code, FACE_PQ_CODE))
+            break;
+    }
+    database_commit(true);
+}
+
+/* extraction throughput against the number of recognizer handles */
+static void rockface_extract_stat(enum face_quality_reason reason)
+{
+    struct timeval t1;
+    int avoided = 0;
+
+    gettimeofday(&t1, NULL);
+    pthread_mutex_lock(&g_extract_mutex);
+    if (!g_extract_t0.tv_sec)
+        g_extract_t0 = t1;
+    g_extract_cnt[reason]++;
+    if (rockface_diff_us(&g_extract_t0, &t1) > 1000000) {
+        for (int i = FACE_QUALITY_OK + 1; i < FACE_QUALITY_REASON_NUM; i++)
+            avoided += g_extract_cnt[i];
+        printf("feature extractions: %d/s with %d handles, avoided %d/s",
+               g_extract_cnt[FACE_QUALITY_OK], g_handle_cnt, avoided);
+        for (int i = FACE_QUALITY_OK + 1; i < FACE_QUALITY_REASON_NUM; i++)
+            printf(" %s %d", face_quality_reason_name(i), g_extract_cnt[i]);
+        printf("\n");
+        memset(g_extract_cnt, 0, sizeof(g_extract_cnt));
+        g_extract_t0 = t1;
+    }
+    pthread_mutex_unlock(&g_extract_mutex);
+}
+
+static int rockface_control_extract(rockface_handle_t handle, rockface_image_t *in_image,
+                                    rockface_det_t *in_face, rockface_landmark_t *landmark,
+                                    rockface_feature_t *out_feature)
+{
+    rockface_ret_t ret;
     rockface_image_t out_img;
+
     memset(&out_img, 0, sizeof(rockface_image_t));
-    ret = rockface_align(face_handle, in_image, &(in_face->box), &landmark, &out_img);
+    ret = rockface_align(handle, in_image, &(in_face->box), landmark, &out_img);
     if (ret != ROCKFACE_RET_SUCCESS)
         return -1;
 
-    ret = rockface_feature_extract(face_handle, &out_img, out_feature);
+    ret = rockface_feature_extract(handle, &out_img, out_feature);
     rockface_image_release(&out_img);
-    if (ret != ROCKFACE_RET_SUCCESS)
-        return -1;
 
-    return 0;
+    return ret == ROCKFACE_RET_SUCCESS ? 0 : -1;
+}
+
+/* enrollment images, not quality gated */
+static int rockface_control_get_feature(rockface_image_t *in_image,
+                                        rockface_feature_t *out_feature,
+                                        rockface_det_t *in_face)
+{
+    int r = -1;
+    int slot;
+    rockface_handle_t handle;
+    rockface_ret_t ret;
+    rockface_landmark_t landmark;
+
+    slot = rockface_npu_get(NULL, NPU_JOB_OPPORTUNISTIC, 0);
+    handle = npu_scheduler_handle(slot);
+    ret = rockface_landmark5(handle, in_image, &(in_face->box), &landmark);
+    if (ret == ROCKFACE_RET_SUCCESS && landmark.score >= FACE_SCORE_LANDMARK)
+        r = rockface_control_extract(handle, in_image, in_face, &landmark, out_feature);
+    npu_scheduler_put(slot);
+    if (r == 0 && g_perf_en)
+        rockface_extract_stat(FACE_QUALITY_OK);
+
+    return r;
+}
+
+static void rockface_window_reset(struct face_window *win, int track)
+{
+    if (win->img.data)
+        rockface_image_release(&win->img);
+    memset(win, 0, sizeof(*win));
+    win->track = track;
+}
+
+/*
+ * Live frames of one track are collected for FACE_WINDOW_FRAMES frames or
+ * FACE_WINDOW_MS, whichever ends first. Every frame goes through the CPU
+ * quality checks, blur and lighting before an NPU slot is taken and pose
+ * once landmark5 has run, and only a frame scoring above the best so far
+ * is aligned. The feature is extracted once, on the best crop, or at once
+ * for a frame scoring FACE_WINDOW_EXCELLENT. Returns 1 while the window
+ * is still open, score is the quality of the extracted crop.
+ */
+static int rockface_control_select_feature(struct rockface_lane *lane, rockface_image_t *in_image,
+                                           rockface_feature_t *out_feature,
+                                           rockface_det_t *in_face, int *score)
+{
+    struct face_window *win = &lane->window;
+    struct face_quality quality;
+    enum face_quality_reason reason;
+    rockface_landmark_t landmark;
+    rockface_image_t out_img;
+    rockface_ret_t ret;
+    struct timeval t1;
+    int slot;
+    int r = -1;
+
+    if (win->track != in_face->id)
+        rockface_window_reset(win, in_face->id);
+    if (!win->frames++)
+        gettimeofday(&win->t0, NULL);
+
+    reason = face_quality_image(in_image, &in_face->box, &quality);
+    if (reason == FACE_QUALITY_OK) {
+        slot = rockface_npu_get(lane, NPU_JOB_GATE, 0);
+        ret = rockface_landmark5(npu_scheduler_handle(slot), in_image, &(in_face->box), &landmark);
+        if (ret == ROCKFACE_RET_SUCCESS && landmark.score >= FACE_SCORE_LANDMARK) {
+            reason = face_quality_pose(&landmark, &quality);
+            if (reason == FACE_QUALITY_OK && quality.score > win->score) {
+                memset(&out_img, 0, sizeof(rockface_image_t));
+                ret = rockface_align(npu_scheduler_handle(slot), in_image, &(in_face->box),
+                                     &landmark, &out_img);
+                if (ret == ROCKFACE_RET_SUCCESS) {
+                    if (win->img.data)
+                        rockface_image_release(&win->img);
+                    win->img = out_img;
+                    win->score = quality.score;
+                }
+            }
+        }
+        npu_scheduler_put(slot);
+    }
+    if (reason != FACE_QUALITY_OK && g_perf_en)
+        rockface_extract_stat(reason);
+
+    gettimeofday(&t1, NULL);
+    if (win->score < FACE_WINDOW_EXCELLENT && win->frames < FACE_WINDOW_FRAMES &&
+        rockface_diff_us(&win->t0, &t1) < FACE_WINDOW_MS * 1000)
+        return 1;
+
+    if (win->img.data) {
+        slot = rockface_npu_get(lane, NPU_JOB_GATE, 0);
+        ret = rockface_feature_extract(npu_scheduler_handle(slot), &win->img, out_feature);
+        npu_scheduler_put(slot);
+        if (ret == ROCKFACE_RET_SUCCESS)
+            r = 0;
+        *score = win->score;
+        if (g_perf_en) {
+            printf("lane %d: best frame score %d of %d frames\n", lane->id, win->score, win->frames);
+            if (r == 0)
+                rockface_extract_stat(FACE_QUALITY_OK);
+        }
+    }
+    rockface_window_reset(win, win->track);
+
+    return r;
 }
 
 int rockface_control_get_path_feature(char *path, void *feature)
@@ -254,55 +869,408 @@ int rockface_control_get_path_feature(char *path, void *feature)
     rockface_det_t face;
     if (rockface_image_read(path, &in_img, 1))
         return -1;
-    if (!_rockface_control_detect(&in_img, &face, NULL))
+    if (!_rockface_control_detect(NULL, &in_img, &face))
         ret = rockface_control_get_feature(&in_img, out_feature, &face);
     rockface_image_release(&in_img);
     return ret;
 }
 
-static void *rockface_control_search(rockface_image_t *image, void *data, int *index, int cnt,
-                              size_t size, size_t offset, rockface_det_t *face, int reg)
+/* adds the feature to the track and returns the fused feature in it */
+static void rockface_fusion_add(struct face_fusion *fusion, int track,
+                                rockface_feature_t *feature, int score)
 {
-    rockface_ret_t ret;
-    rockface_search_result_t result;
-    rockface_feature_t feature;
+    int len = feature->len;
+    float w = score > 0 ? score : 1;
+    float norm = 0, mag = 0, scale;
+
+    if (len <= 0 || len > (int)FACE_FEATURE_DIM)
+        return;
+    if (fusion->track != track || fusion->len != len) {
+        memset(fusion, 0, sizeof(*fusion));
+        fusion->track = track;
+        fusion->len = len;
+        fusion->match = -1;
+    }
 
-    if (rockface_control_get_feature(image, &feature, face) == 0) {
-        //printf("g_total_cnt = %d\n", ++g_total_cnt);
-        ret = rockface_feature_search(face_handle, &feature, 0.7, &result);
-        if (ret == ROCKFACE_RET_SUCCESS) {
+    for (int i = 0; i < len; i++)
+        norm += feature->feature[i] * feature->feature[i];
+    norm = sqrtf(norm);
+    if (norm == 0)
+        return;
+    for (int i = 0; i < len; i++)
+        fusion->sum[i] += w * feature->feature[i] / norm;
+    fusion->weight += w;
+    fusion->norm += w * norm;
+    fusion->frames++;
+
+    /* back to the mean length of the inputs, the recognizer may expect it */
+    for (int i = 0; i < len; i++)
+        mag += fusion->sum[i] * fusion->sum[i];
+    mag = sqrtf(mag);
+    if (mag == 0)
+        return;
+    scale = fusion->norm / fusion->weight / mag;
+    for (int i = 0; i < len; i++)
+        feature->feature[i] = fusion->sum[i] * scale;
+}
+
+/* queues a gallery change for the update thread, false when the queue is full */
+static bool rockface_control_request(enum face_update_op op, const rockface_feature_t *feature,
+                                     const char *name)
+{
+    struct face_update *update;
+
+    pthread_mutex_lock(&g_update_mutex);
+    if (g_update_cnt == FACE_UPDATE_QUEUE_LEN) {
+        pthread_mutex_unlock(&g_update_mutex);
+        printf("%s: update queue full\n", __func__);
+        return false;
+    }
+    update = &g_update_queue[g_update_cnt++];
+    memset(update, 0, sizeof(*update));
+    update->op = op;
+    if (feature)
+        update->feature = *feature;
+    if (name)
+        strncpy(update->name, name, sizeof(update->name) - 1);
+    g_update_busy++;
+    pthread_cond_signal(&g_update_cond);
+    pthread_mutex_unlock(&g_update_mutex);
+
+    return true;
+}
+
+static bool rockface_control_update_busy(void)
+{
+    bool busy;
+
+    pthread_mutex_lock(&g_update_mutex);
+    busy = g_update_busy > 0;
+    pthread_mutex_unlock(&g_update_mutex);
+
+    return busy;
+}
+
+/*
+ * Called with g_face_mutex held on the version lib, which is the one
+ * published, returns the identity id or -1. A registration is only
+ * queued, the face is searchable once the update thread published it.
+ */
+static int rockface_control_search(struct rockface_lane *lane, struct face_library *lib,
+                                   rockface_feature_t *feature, rockface_det_t *face, int reg)
+{
+    struct face_search_result result;
+    struct face_search_hit *top;
+    rockface_feature_t hit;
+    float sdk = FACE_MATCH_STAY + 1;
+    int match;
+    bool matched, fast;
+
+    if (feature) {
+        face_search(feature, FACE_SEARCH_TOPK, FACE_FAST_ACCEPT, FACE_HOT_ACCEPT, &result);
+        top = result.cnt ? &result.hits[0] : NULL;
+        match = top ? top->index : -1;
+        if (top) {
+            face_gallery_feature(&lib->gallery, match, &hit);
+            if (rockface_feature_compare(feature, &hit, &sdk) != ROCKFACE_RET_SUCCESS)
+                sdk = FACE_MATCH_STAY + 1;
+        }
+        /*
+         * A new match needs FACE_MATCH_ENTER and a clear lead over the
+         * runner-up, the hot set has none, the match of the last decision
+         * holds up to FACE_MATCH_STAY.
+         */
+        fast = top && top->score >= FACE_FAST_ACCEPT && sdk <= FACE_MATCH_ENTER;
+        matched = fast || (sdk <= FACE_MATCH_ENTER && !result.hot &&
+                           result.margin >= FACE_MATCH_MARGIN) ||
+                  (sdk <= FACE_MATCH_STAY && match == lane->fusion.match &&
+                   lane->fusion.gen == lib->gen);
+        lane->fusion.match = matched ? match : -1;
+        lane->fusion.gen = lib->gen;
+        if (g_perf_en && top)
+            rockface_lane_score(lane, top->score, result.margin, sdk, fast);
+        if (matched) {
+            face_search_hot_update(top->index);
             if (g_register && ++g_register_cnt > FACE_REGISTER_CNT) {
                 g_register = false;
                 g_register_cnt = 0;
                 play_wav_signal(REGISTER_ALREADY_WAV);
             }
-            return result.feature;
+            return match;
         }
-        if (g_register && *index < cnt && face->score > FACE_SCORE_REGISTER && reg) {
-            char name[NAME_LEN];
+        /* the last registration may be this face, wait until it can match */
+        if (g_register && !face_gallery_full(&lib->gallery, 0) &&
+            face->score > FACE_SCORE_REGISTER && reg && !rockface_control_update_busy()) {
+            if (rockface_control_request(FACE_UPDATE_REGISTER, feature, NULL)) {
+                g_register = false;
+                g_register_cnt = 0;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/* an imported face into the database, skipped if its name is taken by now */
+static bool rockface_control_update_import(struct face_library *base, struct face_update *update,
+                                           int added)
+{
+    if (face_gallery_full(&base->gallery, added) || database_is_name_exist(update->name)) {
+        update->name[0] = '\0';
+        return false;
+    }
+    database_insert(&update->feature, sizeof(update->feature), update->name,
+                    sizeof(update->name), false);
+
+    return true;
+}
+
+/* the entries of base the batch does not delete into fresh chunks of lib */
+static int rockface_library_compact(struct face_library *lib, const struct face_library *base,
+                                    const struct face_update *updates, int cnt)
+{
+    const struct face_gallery *gallery = &base->gallery;
+    bool *keep;
+    int ret;
+
+    keep = (bool *)malloc(gallery->num + 1);
+    if (!keep)
+        return -1;
+    for (int i = 0; i < gallery->num; i++) {
+        keep[i] = true;
+        for (int j = 0; j < cnt && keep[i]; j++)
+            if (updates[j].op == FACE_UPDATE_DELETE &&
+                !strcmp(updates[j].name, face_gallery_name(gallery, i)))
+                keep[i] = false;
+    }
+    ret = face_gallery_compact(&lib->gallery, gallery, keep);
+    free(keep);
+
+    return ret;
+}
+
+/*
+ * Applies a batch of changes to the database and builds the next version.
+ * Registrations and imports alone share the current gallery and append,
+ * ids stay. A delete compacts the rest of the gallery into fresh chunks,
+ * ids move, and the batch is appended after it.
+ */
+static void rockface_control_update(struct face_update *updates, int cnt,
+                                    struct face_update *imports, int import_cnt)
+{
+    struct face_library *base = rockface_library_get();
+    struct face_library *lib = NULL;
+    bool moved = false;
+    int registered = 0, deleted = 0, imported = 0;
+
+    for (int i = 0; i < cnt; i++) {
+        struct face_update *update = &updates[i];
+        if (update->op == FACE_UPDATE_DELETE) {
+            printf("delete %s from %s\n", update->name, DATABASE_PATH);
+            database_delete(update->name, false);
+            moved = true;
+            deleted++;
+        } else if (!face_gallery_full(&base->gallery, registered)) {
             int id = database_get_user_name_id();
             if (id < 0) {
                 printf("%s: get id fail!\n", __func__);
-                return NULL;
+                update->name[0] = '\0';
+                continue;
             }
-            snprintf(name, sizeof(name), "%s%d", USER_NAME, id);
-            printf("add %s to %s\n", name, DATABASE_PATH);
-            database_insert(&feature, sizeof(feature), name, sizeof(name), true);
-
-            struct face_data *face_data = (struct face_data*)data + (*index);
-            strncpy(face_data->name, name, sizeof(face_data->name) - 1);
-            memcpy(&face_data->feature, &feature, sizeof(face_data->feature));
-            *index += 1;
-            rockface_control_release_library();
-            rockface_control_init_library(data, *index, size, offset);
-            g_register = false;
-            g_register_cnt = 0;
-            play_wav_signal(REGISTER_SUCCESS_WAV);
-            return &face_data->feature;
+            snprintf(update->name, sizeof(update->name), "%s%d", USER_NAME, id);
+            printf("add %s to %s\n", update->name, DATABASE_PATH);
+            database_insert(&update->feature, sizeof(update->feature), update->name,
+                            sizeof(update->name), false);
+            registered++;
+        } else {
+            update->name[0] = '\0';
         }
     }
+    for (int i = 0; i < import_cnt; i++)
+        if (rockface_control_update_import(base, &imports[i], registered + imported))
+            imported++;
+    sync();
+    if (!registered && !deleted && !imported)
+        goto exit;
 
-    return NULL;
+    lib = rockface_library_alloc(moved ? base->gen + 1 : base->gen);
+    if (!lib)
+        goto exit;
+    if (moved ? rockface_library_compact(lib, base, updates, cnt) :
+        face_gallery_share(&lib->gallery, &base->gallery))
+        goto exit;
+    for (int i = 0; i < cnt; i++)
+        if (updates[i].op != FACE_UPDATE_DELETE && updates[i].name[0])
+            face_gallery_append(&lib->gallery, &updates[i].feature,
+                                sizeof(updates[i].feature), updates[i].name);
+    for (int i = 0; i < import_cnt; i++)
+        if (imports[i].name[0])
+            face_gallery_append(&lib->gallery, &imports[i].feature,
+                                sizeof(imports[i].feature), imports[i].name);
+    rockface_library_load_codes(lib);
+    if (rockface_library_index(lib))
+        goto exit;
+    rockface_library_publish(lib, !moved);
+    lib = NULL;
+    if (imported) {
+        g_import_merged += imported;
+        printf("import: %d faces merged, %d in total\n", imported, g_import_merged);
+    }
+
+    if (registered)
+        play_wav_signal(REGISTER_SUCCESS_WAV);
+    if (deleted)
+        play_wav_signal(DELETE_SUCCESS_WAV);
+
+exit:
+    if (lib)
+        rockface_library_free(lib);
+    rockface_library_put(base);
+}
+
+/*
+ * Trains the codebook if need be and encodes the gallery the gate started
+ * on, the lanes search by the binary prefilter meanwhile.
+ */
+static void rockface_control_update_codes(void)
+{
+    struct face_library *base = rockface_library_get();
+    struct face_library *lib = NULL;
+
+    /* an update may have built them already */
+    if (base->gallery.code_num == base->gallery.num)
+        goto exit;
+    lib = rockface_library_alloc(base->gen);
+    if (!lib)
+        goto exit;
+    if (face_gallery_share(&lib->gallery, &base->gallery))
+        goto exit;
+    rockface_library_load_codes(lib);
+    if (lib->gallery.code_num < lib->gallery.num || rockface_library_index(lib))
+        goto exit;
+    rockface_library_publish(lib, true);
+    lib = NULL;
+
+exit:
+    if (lib)
+        rockface_library_free(lib);
+    rockface_library_put(base);
+}
+
+static void *rockface_control_update_thread(void *arg)
+{
+    struct face_update *imports;
+    int cnt, import_cnt;
+
+    pthread_mutex_lock(&g_update_mutex);
+    while (g_update_run) {
+        if (!g_update_cnt && !(g_import_ready && g_import_cnt) && !g_update_codes) {
+            pthread_cond_wait(&g_update_cond, &g_update_mutex);
+            continue;
+        }
+        cnt = g_update_cnt;
+        memcpy(g_update_batch, g_update_queue, cnt * sizeof(g_update_batch[0]));
+        g_update_cnt = 0;
+        /* a registration or delete takes the imports so far along */
+        imports = g_import_queue;
+        import_cnt = g_import_cnt;
+        if (import_cnt) {
+            g_import_queue = g_import_spare;
+            g_import_spare = imports;
+            g_import_cnt = 0;
+            g_import_ready = false;
+            pthread_cond_signal(&g_import_cond);
+        }
+        if (!cnt && !import_cnt)
+            g_update_codes = false;
+        pthread_mutex_unlock(&g_update_mutex);
+
+        if (cnt || import_cnt)
+            rockface_control_update(g_update_batch, cnt, imports, import_cnt);
+        else
+            rockface_control_update_codes();
+
+        pthread_mutex_lock(&g_update_mutex);
+        g_update_busy -= cnt;
+    }
+    pthread_mutex_unlock(&g_update_mutex);
+
+    pthread_exit(NULL);
+}
+
+static long long rockface_diff_ms(struct timeval *t0, struct timeval *t1)
+{
+    return rockface_diff_us(t0, t1) / 1000;
+}
+
+/*
+ * load_feature callback on the import thread, non zero ends the import.
+ * The name may be taken by the time the batch is merged, so
+ * rockface_control_update_import() checks it again before the insert.
+ */
+static int rockface_control_import(const rockface_feature_t *feature, const char *name,
+                                   void *arg)
+{
+    struct face_library *lib;
+    struct face_update *update;
+    struct timeval t1;
+    bool full;
+
+    pthread_mutex_lock(&g_update_mutex);
+    while (g_import_run && g_import_cnt == FACE_IMPORT_PENDING_MAX)
+        pthread_cond_wait(&g_import_cond, &g_update_mutex);
+    lib = rockface_library_get();
+    full = face_gallery_full(&lib->gallery, g_import_cnt);
+    rockface_library_put(lib);
+    if (!g_import_run || full) {
+        pthread_mutex_unlock(&g_update_mutex);
+        return -1;
+    }
+
+    update = &g_import_queue[g_import_cnt++];
+    memset(update, 0, sizeof(*update));
+    update->op = FACE_UPDATE_IMPORT;
+    update->feature = *feature;
+    strncpy(update->name, name, sizeof(update->name) - 1);
+
+    gettimeofday(&t1, NULL);
+    if (g_import_cnt >= FACE_IMPORT_MERGE_CNT ||
+        rockface_diff_ms(&g_import_t0, &t1) >= FACE_IMPORT_MERGE_MS) {
+        g_import_ready = true;
+        g_import_t0 = t1;
+        pthread_cond_signal(&g_update_cond);
+    }
+    pthread_mutex_unlock(&g_update_mutex);
+
+    return 0;
+}
+
+/*
+ * Extraction runs on the feature pool as NPU_JOB_OPPORTUNISTIC jobs, so
+ * the lanes keep the NPU whenever they need it.
+ */
+static void *rockface_control_import_thread(void *arg)
+{
+    struct timeval t0, t1;
+    int cnt;
+
+    gettimeofday(&t0, NULL);
+    pthread_mutex_lock(&g_update_mutex);
+    g_import_t0 = t0;
+    pthread_mutex_unlock(&g_update_mutex);
+
+    printf("import face feature from %s\n", DEFAULT_FACE_PATH);
+    cnt = load_feature(DEFAULT_FACE_PATH, ".jpg", rockface_control_import, NULL);
+
+    pthread_mutex_lock(&g_update_mutex);
+    g_import_ready = true;
+    pthread_cond_signal(&g_update_cond);
+    pthread_mutex_unlock(&g_update_mutex);
+    gettimeofday(&t1, NULL);
+    printf("import: %d new faces from %s in %lld ms\n", cnt, DEFAULT_FACE_PATH,
+           rockface_diff_ms(&t0, &t1));
+
+    pthread_exit(NULL);
 }
 
 void rockface_control_set_delete(void)
@@ -319,108 +1287,143 @@ void rockface_control_set_register(void)
     g_delete = true;
 }
 
-static void rockface_control_detect_wait(void)
+static void rockface_control_detect_wait(struct rockface_lane *lane)
 {
-    pthread_mutex_lock(&g_detect_mutex);
-    if (g_detect_flag)
-        pthread_cond_wait(&g_detect_cond, &g_detect_mutex);
-    pthread_mutex_unlock(&g_detect_mutex);
+    pthread_mutex_lock(&lane->detect_mutex);
+    if (lane->detect_flag)
+        pthread_cond_wait(&lane->detect_cond, &lane->detect_mutex);
+    pthread_mutex_unlock(&lane->detect_mutex);
 }
 
-static void rockface_control_detect_signal(void)
+static void rockface_control_detect_signal(struct rockface_lane *lane)
 {
-    pthread_mutex_lock(&g_detect_mutex);
-    g_detect_flag = false;
-    pthread_cond_signal(&g_detect_cond);
-    pthread_mutex_unlock(&g_detect_mutex);
+    pthread_mutex_lock(&lane->detect_mutex);
+    lane->detect_flag = false;
+    pthread_cond_signal(&lane->detect_cond);
+    pthread_mutex_unlock(&lane->detect_mutex);
 }
 
-static void rockface_control_wait(void)
+static void rockface_control_wait(struct rockface_lane *lane)
 {
-    pthread_mutex_lock(&g_mutex);
-    if (g_flag)
-        pthread_cond_wait(&g_cond, &g_mutex);
-    pthread_mutex_unlock(&g_mutex);
+    pthread_mutex_lock(&lane->mutex);
+    if (lane->flag)
+        pthread_cond_wait(&lane->cond, &lane->mutex);
+    pthread_mutex_unlock(&lane->mutex);
 }
 
-static void rockface_control_signal(void)
+static void rockface_control_signal(struct rockface_lane *lane)
 {
-    pthread_mutex_lock(&g_mutex);
-    g_flag = false;
-    pthread_cond_signal(&g_cond);
-    pthread_mutex_unlock(&g_mutex);
+    pthread_mutex_lock(&lane->mutex);
+    lane->flag = false;
+    pthread_cond_signal(&lane->cond);
+    pthread_mutex_unlock(&lane->mutex);
 }
 
-int rockface_control_convert(void *ptr, int width, int height, RgaSURF_FORMAT rga_fmt)
+static void rockface_control_set_rga_src(rga_info_t *src, void *ptr, int fd, int rotation)
 {
+    memset(src, 0, sizeof(rga_info_t));
+    if (ptr) {
+        src->fd = -1;
+        src->virAddr = ptr;
+    } else {
+        src->fd = fd;
+    }
+    src->mmuFlag = 1;
+    src->rotation = rotation;
+}
+
+static void rockface_control_rotate_size(int rotation, int width, int height, int *w, int *h)
+{
+    if (rotation == HAL_TRANSFORM_ROT_90 || rotation == HAL_TRANSFORM_ROT_270) {
+        *w = height;
+        *h = width;
+    } else {
+        *w = width;
+        *h = height;
+    }
+}
+
+/*
+ * Rotate, downscale and convert the sensor frame to RGB888 in one RGA pass.
+ * When ptr is NULL the source is read through fd, so the dequeued dma-buf
+ * can be handed over directly without a rotated intermediate copy.
+ */
+int rockface_control_convert(int id, void *ptr, int fd, int width, int height,
+                             RgaSURF_FORMAT rga_fmt, int rotation)
+{
+    struct rockface_lane *lane;
     rga_info_t src, dst;
+    int rot_w, rot_h;
 
-    if (!g_run)
+    if (!g_run || id < 0 || id >= g_lane_num)
         return -1;
+    lane = &g_lanes[id];
 
-    if (!g_detect_flag)
+    if (!lane->detect_flag)
         return -1;
 
-    g_rgb_width = width;
-    g_rgb_height = height;
-    memset(&g_rgb_img, 0, sizeof(rockface_image_t));
-    if (width > height) {
-        g_rgb_img.width = CONVERT_RGB_WIDTH;
-        g_rgb_img.height = CONVERT_RGB_WIDTH * height / width;
+    rockface_control_rotate_size(rotation, width, height, &rot_w, &rot_h);
+    lane->rgb_width = rot_w;
+    lane->rgb_height = rot_h;
+    memset(&lane->rgb_img, 0, sizeof(rockface_image_t));
+    if (rot_w > rot_h) {
+        lane->rgb_img.width = CONVERT_RGB_WIDTH;
+        lane->rgb_img.height = CONVERT_RGB_WIDTH * rot_h / rot_w;
     } else {
-        g_rgb_img.width = CONVERT_RGB_WIDTH * width / height;
-        g_rgb_img.height = CONVERT_RGB_WIDTH;
+        lane->rgb_img.width = CONVERT_RGB_WIDTH * rot_w / rot_h;
+        lane->rgb_img.height = CONVERT_RGB_WIDTH;
     }
-    g_rgb_img.pixel_format = ROCKFACE_PIXEL_FORMAT_RGB888;
-    if (g_rgb_fd < 0) {
-        if (rga_control_buffer_init(&g_rgb_bo, &g_rgb_fd, g_rgb_img.width, g_rgb_img.height, 24))
+    lane->rgb_img.pixel_format = ROCKFACE_PIXEL_FORMAT_RGB888;
+    if (lane->rgb_fd < 0) {
+        if (rga_control_buffer_init(&lane->rgb_bo, &lane->rgb_fd,
+                                    lane->rgb_img.width, lane->rgb_img.height, 24))
             return -1;
     }
-    g_rgb_img.data = g_rgb_bo.ptr;
-    memset(&src, 0, sizeof(rga_info_t));
-    src.fd = -1;
-    src.virAddr = ptr;
-    src.mmuFlag = 1;
+    lane->rgb_img.data = lane->rgb_bo.ptr;
+    rockface_control_set_rga_src(&src, ptr, fd, rotation);
     rga_set_rect(&src.rect, 0, 0, width, height, width, height, rga_fmt);
     memset(&dst, 0, sizeof(rga_info_t));
-    dst.fd = -1;
-    dst.virAddr = g_rgb_bo.ptr;
+    dst.fd = lane->rgb_fd;
     dst.mmuFlag = 1;
-    rga_set_rect(&dst.rect, 0, 0, g_rgb_img.width, g_rgb_img.height,
-                 g_rgb_img.width, g_rgb_img.height, RK_FORMAT_RGB_888);
+    rga_set_rect(&dst.rect, 0, 0, lane->rgb_img.width, lane->rgb_img.height,
+                 lane->rgb_img.width, lane->rgb_img.height, RK_FORMAT_RGB_888);
     if (c_RkRgaBlit(&src, &dst, NULL)) {
         printf("%s: rga fail\n", __func__);
         return -1;
     }
+    gettimeofday(&lane->rgb_ts, NULL);
 
-    rockface_control_detect_signal();
+    rockface_control_detect_signal(lane);
 
     return 0;
 }
 
-static bool rockface_control_liveness_ir(void)
+static bool rockface_control_liveness_ir(struct rockface_lane *lane)
 {
     bool real = false;
     rockface_ret_t ret;
-    rockface_image_t image;
     rockface_det_array_t face_array;
     rockface_liveness_t result;
+    int slot;
 
-    if (pthread_mutex_trylock(&g_ir_img_mutex))
+    if (pthread_mutex_trylock(&lane->ir_img_mutex))
         return real;
 
-    ret = rockface_detect(face_handle, &g_ir_img, &face_array);
+    /* lane->handle belongs to the detect thread, use the handle of the slot */
+    slot = rockface_npu_get(lane, NPU_JOB_GATE, 0);
+    ret = rockface_detect(npu_scheduler_handle(slot), &lane->ir_img, &face_array);
     if (ret != ROCKFACE_RET_SUCCESS)
         goto exit;
 
     rockface_det_t* face = get_max_face(&face_array);
     if (face == NULL || face->score < FACE_SCORE_IR ||
-        face->box.right - face->box.left < MIN_FACE_WIDTH(g_ir_img.width) ||
+        face->box.right - face->box.left < MIN_FACE_WIDTH(lane->ir_img.width) ||
         face->box.left < 0 || face->box.top < 0 ||
-        face->box.right > g_ir_img.width || face->box.bottom > g_ir_img.height)
+        face->box.right > lane->ir_img.width || face->box.bottom > lane->ir_img.height)
         goto exit;
 
-    ret = rockface_liveness_detect(face_handle, &g_ir_img, &face->box, &result);
+    ret = rockface_liveness_detect(npu_scheduler_handle(slot), &lane->ir_img, &face->box,
+                                   &result);
     if (ret != ROCKFACE_RET_SUCCESS)
         goto exit;
 
@@ -430,71 +1433,73 @@ static bool rockface_control_liveness_ir(void)
     real = true;
 
 exit:
-    pthread_mutex_unlock(&g_ir_img_mutex);
+    npu_scheduler_put(slot);
+    pthread_mutex_unlock(&lane->ir_img_mutex);
     return real;
 }
 
-static bool rockface_control_wait_ir(void)
+static bool rockface_control_wait_ir(struct rockface_lane *lane)
 {
     bool ret = false;
     struct timeval now;
     struct timespec timeout;
-    static int cnt = 0;
 
-    pthread_mutex_lock(&g_ir_mutex);
+    pthread_mutex_lock(&lane->ir_mutex);
     gettimeofday(&now, NULL);
     timeout.tv_sec = now.tv_sec + 1;
     timeout.tv_nsec = now.tv_usec * 1000;
-    if (!pthread_cond_timedwait(&g_ir_cond, &g_ir_mutex, &timeout))
+    if (!pthread_cond_timedwait(&lane->ir_cond, &lane->ir_mutex, &timeout))
         ret = true;
-    pthread_mutex_unlock(&g_ir_mutex);
+    pthread_mutex_unlock(&lane->ir_mutex);
     return ret;
 }
 
-static void rockface_control_signal_ir(void)
+static void rockface_control_signal_ir(struct rockface_lane *lane)
 {
-    pthread_mutex_lock(&g_ir_mutex);
-    pthread_cond_signal(&g_ir_cond);
-    pthread_mutex_unlock(&g_ir_mutex);
+    pthread_mutex_lock(&lane->ir_mutex);
+    pthread_cond_signal(&lane->ir_cond);
+    pthread_mutex_unlock(&lane->ir_mutex);
 }
 
-int rockface_control_convert_ir(void *ptr, int width, int height, RgaSURF_FORMAT rga_fmt)
+int rockface_control_convert_ir(int id, void *ptr, int fd, int width, int height,
+                                RgaSURF_FORMAT rga_fmt, int rotation)
 {
+    struct rockface_lane *lane;
     int ret = -1;
     rga_info_t src, dst;
+    int rot_w, rot_h;
 
-    if (!g_run)
+    if (!g_run || id < 0 || id >= g_lane_num)
         return ret;
+    lane = &g_lanes[id];
 
-    if (pthread_mutex_trylock(&g_ir_img_mutex))
+    if (pthread_mutex_trylock(&lane->ir_img_mutex))
         return ret;
 
-    memset(&g_ir_img, 0, sizeof(rockface_image_t));
+    memset(&lane->ir_img, 0, sizeof(rockface_image_t));
 
-    if (width > height) {
-        g_ir_img.width = CONVERT_IR_WIDTH;
-        g_ir_img.height = CONVERT_IR_WIDTH * height / width;
+    rockface_control_rotate_size(rotation, width, height, &rot_w, &rot_h);
+    if (rot_w > rot_h) {
+        lane->ir_img.width = CONVERT_IR_WIDTH;
+        lane->ir_img.height = CONVERT_IR_WIDTH * rot_h / rot_w;
     } else {
-        g_ir_img.width = CONVERT_IR_WIDTH * width / height;
-        g_ir_img.height = CONVERT_IR_WIDTH;
+        lane->ir_img.width = CONVERT_IR_WIDTH * rot_w / rot_h;
+        lane->ir_img.height = CONVERT_IR_WIDTH;
     }
-    g_ir_img.pixel_format = ROCKFACE_PIXEL_FORMAT_RGB888;
-    if (g_ir_fd < 0) {
-        if (rga_control_buffer_init(&g_ir_bo, &g_ir_fd, g_ir_img.width, g_ir_img.height, 24))
+    lane->ir_img.pixel_format = ROCKFACE_PIXEL_FORMAT_RGB888;
+    if (lane->ir_fd < 0) {
+        if (rga_control_buffer_init(&lane->ir_bo, &lane->ir_fd,
+                                    lane->ir_img.width, lane->ir_img.height, 24))
             goto exit;
     }
-    g_ir_img.data = g_ir_bo.ptr;
-    memset(&src, 0, sizeof(rga_info_t));
-    src.fd = -1;
-    src.virAddr = ptr;
-    src.mmuFlag = 1;
+    lane->ir_img.data = lane->ir_bo.ptr;
+    rockface_control_set_rga_src(&src, ptr, fd, rotation);
     rga_set_rect(&src.rect, 0, 0, width, height, width, height, rga_fmt);
     memset(&dst, 0, sizeof(rga_info_t));
-    dst.fd = -1;
-    dst.virAddr = g_ir_bo.ptr;
+    dst.fd = lane->ir_fd;
     dst.mmuFlag = 1;
-    rga_set_rect(&dst.rect, 0, 0, g_ir_img.width, g_ir_img.height,
-                 g_ir_img.width, g_ir_img.height, RK_FORMAT_RGB_888);
+    rga_set_rect(&dst.rect, 0, 0, lane->ir_img.width, lane->ir_img.height,
+                 lane->ir_img.width, lane->ir_img.height, RK_FORMAT_RGB_888);
     if (c_RkRgaBlit(&src, &dst, NULL)) {
         printf("%s: rga fail\n", __func__);
         goto exit;
@@ -503,67 +1508,69 @@ int rockface_control_convert_ir(void *ptr, int width, int height, RgaSURF_FORMAT
     ret = 0;
 
 exit:
-    pthread_mutex_unlock(&g_ir_img_mutex);
+    pthread_mutex_unlock(&lane->ir_img_mutex);
     if (ret == 0)
-        rockface_control_signal_ir();
+        rockface_control_signal_ir(lane);
     return ret;
 }
 
 static void *rockface_control_detect_thread(void *arg)
 {
-    rockface_ret_t ret;
-    rockface_image_t image;
+    struct rockface_lane *lane = (struct rockface_lane *)arg;
     rockface_det_t face;
     rga_info_t src, dst;
     int det;
 
     while (g_run) {
-        pthread_mutex_lock(&g_detect_mutex);
-        g_detect_flag = true;
-        pthread_mutex_unlock(&g_detect_mutex);
-        rockface_control_detect_wait();
+        pthread_mutex_lock(&lane->detect_mutex);
+        lane->detect_flag = true;
+        pthread_mutex_unlock(&lane->detect_mutex);
+        rockface_control_detect_wait(lane);
         if (!g_run)
             break;
 
-        det = rockface_control_detect(&g_rgb_img, &face);
+        if (g_perf_en)
+            rockface_lane_stat(lane);
+        det = rockface_control_detect(lane, &lane->rgb_img, &face);
         if (det) {
             if (det == -1)
-                memset(last_name, 0, sizeof(last_name));
+                lane->last_id = -1;
             continue;
         }
 
-        if (!g_flag)
+        if (!lane->flag)
             continue;
 
-        g_rgbx_img.width = g_rgb_img.width;
-        g_rgbx_img.height = g_rgb_img.height;
-        g_rgbx_img.pixel_format = ROCKFACE_PIXEL_FORMAT_RGB888;
-        if (g_rgbx_fd < 0) {
-            if (rga_control_buffer_init(&g_rgbx_bo, &g_rgbx_fd,
-                        g_rgbx_img.width, g_rgbx_img.height, 24))
+        lane->rgbx_img.width = lane->rgb_img.width;
+        lane->rgbx_img.height = lane->rgb_img.height;
+        lane->rgbx_img.pixel_format = ROCKFACE_PIXEL_FORMAT_RGB888;
+        if (lane->rgbx_fd < 0) {
+            if (rga_control_buffer_init(&lane->rgbx_bo, &lane->rgbx_fd,
+                        lane->rgbx_img.width, lane->rgbx_img.height, 24))
                 continue;
         }
-        g_rgbx_img.data = g_rgbx_bo.ptr;
+        lane->rgbx_img.data = lane->rgbx_bo.ptr;
 
         memset(&src, 0, sizeof(rga_info_t));
         src.fd = -1;
-        src.virAddr = g_rgb_bo.ptr;
+        src.virAddr = lane->rgb_bo.ptr;
         src.mmuFlag = 1;
-        rga_set_rect(&src.rect, 0, 0, g_rgb_img.width, g_rgb_img.height,
-                g_rgb_img.width, g_rgb_img.height, RK_FORMAT_RGB_888);
+        rga_set_rect(&src.rect, 0, 0, lane->rgb_img.width, lane->rgb_img.height,
+                lane->rgb_img.width, lane->rgb_img.height, RK_FORMAT_RGB_888);
         memset(&dst, 0, sizeof(rga_info_t));
         dst.fd = -1;
-        dst.virAddr = g_rgbx_bo.ptr;
+        dst.virAddr = lane->rgbx_bo.ptr;
         dst.mmuFlag = 1;
-        rga_set_rect(&dst.rect, 0, 0, g_rgbx_img.width, g_rgbx_img.height,
-                g_rgbx_img.width, g_rgbx_img.height, RK_FORMAT_RGB_888);
+        rga_set_rect(&dst.rect, 0, 0, lane->rgbx_img.width, lane->rgbx_img.height,
+                lane->rgbx_img.width, lane->rgbx_img.height, RK_FORMAT_RGB_888);
         if (c_RkRgaBlit(&src, &dst, NULL)) {
             printf("%s: rga fail\n", __func__);
             continue;
         }
 
-        memcpy(&g_rgb_face, &face, sizeof(rockface_det_t));
-        rockface_control_signal();
+        memcpy(&lane->rgb_face, &face, sizeof(rockface_det_t));
+        lane->rgbx_ts = lane->rgb_ts;
+        rockface_control_signal(lane);
     }
 
     pthread_exit(NULL);
@@ -571,24 +1578,47 @@ static void *rockface_control_detect_thread(void *arg)
 
 static void *rockface_control_thread(void *arg)
 {
-    int index;
-    struct face_data *result;
+    struct rockface_lane *lane = (struct rockface_lane *)arg;
+    struct face_library *lib;
+    int id;
+    int gen;
+    bool deleting;
     rockface_det_t face;
-    char name[NAME_LEN];
-    char *end;
-    struct timeval t0, t1;
+    rockface_feature_t feature;
+    bool extracted;
+    int ret;
+    int score = 0;
     int del_timeout = 0;
     int reg_timeout = 0;
     bool real = false;
 
     while (g_run) {
-        pthread_mutex_lock(&g_mutex);
-        g_flag = true;
-        pthread_mutex_unlock(&g_mutex);
+        pthread_mutex_lock(&lane->mutex);
+        lane->flag = true;
+        pthread_mutex_unlock(&lane->mutex);
         real = false;
-        rockface_control_wait();
+        rockface_control_wait(lane);
         if (!g_run)
             break;
+        /* extract outside the gallery lock so the lanes overlap on the NPU */
+        memcpy(&face, &lane->rgb_face, sizeof(face));
+        lane->total_cnt++;
+        ret = rockface_control_select_feature(lane, &lane->rgbx_img, &feature, &face, &score);
+        if (ret > 0) {
+            /* window still open, hand over the next frame of the track */
+            pthread_mutex_lock(&lane->rgb_track_mutex);
+            lane->rgb_track = -1;
+            pthread_mutex_unlock(&lane->rgb_track_mutex);
+            continue;
+        }
+        extracted = !ret;
+        if (extracted) {
+            lane->extract_cnt++;
+            rockface_fusion_add(&lane->fusion, face.id, &feature, score);
+        }
+
+        pthread_mutex_lock(&g_face_mutex);
+        lib = rockface_library_get();
         if (g_delete) {
             if (!del_timeout) {
                 play_wav_signal(DELETE_START_WAV);
@@ -602,7 +1632,7 @@ static void *rockface_control_thread(void *arg)
         } else {
             del_timeout = 0;
         }
-        if (g_register && g_face_index < g_face_cnt) {
+        if (g_register && !face_gallery_full(&lib->gallery, 0)) {
             if (!reg_timeout) {
                 play_wav_signal(REGISTER_START_WAV);
             }
@@ -612,67 +1642,77 @@ static void *rockface_control_thread(void *arg)
                 g_register = false;
                 play_wav_signal(REGISTER_TIMEOUT_WAV);
             }
-        } else if (g_register && g_face_index >= g_face_cnt) {
+        } else if (g_register && face_gallery_full(&lib->gallery, 0)) {
             g_register = false;
             g_register_cnt = 0;
             play_wav_signal(REGISTER_LIMIT_WAV);
         } else {
             reg_timeout = 0;
         }
-        memcpy(&face, &g_rgb_face, sizeof(face));
-        gettimeofday(&t0, NULL);
-        result = (struct face_data*)rockface_control_search(&g_rgbx_img, g_face_data, &g_face_index,
-                        g_face_cnt, sizeof(struct face_data), 0, &face, reg_timeout);
-        gettimeofday(&t1, NULL);
-        if (g_delete && del_timeout && result) {
-            printf("delete %s from %s\n", result->name, DATABASE_PATH);
-            database_delete(result->name, true);
-            memset(g_face_data, 0, g_face_cnt * sizeof(struct face_data));
-            g_face_index = database_get_data(g_face_data, g_face_cnt,
-                    sizeof(rockface_feature_t), 0, NAME_LEN, sizeof(rockface_feature_t));
-            rockface_control_release_library();
-            rockface_control_init_library(g_face_data, g_face_index,
-                    sizeof(struct face_data), 0);
+        id = rockface_control_search(lane, lib, extracted ? &feature : NULL, &face, reg_timeout);
+        deleting = g_delete && del_timeout && id >= 0;
+        if (deleting) {
             del_timeout = 0;
             g_delete = false;
-            play_wav_signal(DELETE_SUCCESS_WAV);
+        }
+        pthread_mutex_unlock(&g_face_mutex);
+        if (g_perf_en)
+            rockface_lane_latency(lane, &lane->rgbx_ts);
+        /*
+         * Names are taken from the pinned version whatever got published
+         * meanwhile, the label is only copied out for another identity.
+         */
+        gen = lib->gen;
+        if (deleting) {
+            rockface_control_request(FACE_UPDATE_DELETE, NULL,
+                                     face_gallery_name(&lib->gallery, id));
+        } else if (id >= 0 && (lane->label_id != id || lane->label_gen != gen)) {
+            memset(lane->label, 0, sizeof(lane->label));
+            strncpy(lane->label, face_gallery_label(&lib->gallery, id), sizeof(lane->label) - 1);
+            lane->label_id = id;
+            lane->label_gen = gen;
+        }
+        rockface_library_put(lib);
+        if (deleting) {
             if (shadow_paint_name_cb)
-                shadow_paint_name_cb(NULL, false);
-        } else if (result && face.score > FACE_SCORE_RGB) {
-            end = strrchr(result->name, '.');
-            if (end) {
-                memset(name, 0, sizeof(name));
-                memcpy(name, result->name, end - result->name);
-            } else {
-                memset(name, 0, sizeof(name));
-                strncpy(name, result->name, sizeof(name) - 1);
-            }
-            //printf("name: %s\n", name);
-            //printf("time: %ldus\n", (t1.tv_sec - t0.tv_sec) * 1000000 + t1.tv_usec - t0.tv_usec);
-            if (rkcif_control_run()) {
-                if (rockface_control_wait_ir())
-                    if (rockface_control_liveness_ir())
+                shadow_paint_name_cb(lane->id, NULL, false);
+        } else if (id >= 0 && face.score > FACE_SCORE_RGB) {
+            if (rkcif_control_run(lane->id)) {
+                if (rockface_control_wait_ir(lane))
+                    if (rockface_control_liveness_ir(lane))
                         real = true;
             }
             if (shadow_paint_name_cb)
-                shadow_paint_name_cb(name, real);
-            if (!g_register && real && memcmp(last_name, name, sizeof(last_name))) {
-                printf("name: %s\n", name);
-                memset(last_name, 0, sizeof(last_name));
-                strncpy(last_name, name, sizeof(last_name) - 1);
+                shadow_paint_name_cb(lane->id, lane->label, real);
+            if (!g_register && real && (lane->last_id != id || lane->last_gen != gen)) {
+                printf("lane %d name: %s\n", lane->id, lane->label);
+                lane->last_id = id;
+                lane->last_gen = gen;
                 if (real) {
                     play_wav_signal(PLEASE_GO_THROUGH_WAV);
                 }
+                lane->pass_total++;
+                lane->extract_total += lane->extract_cnt;
+                if (g_perf_en) {
+                    printf("lane %d recognized after %d attempts, %d extractions, %.2f per pass\n",
+                           lane->id, lane->total_cnt, lane->extract_cnt,
+                           (float)lane->extract_total / lane->pass_total);
+                    pthread_mutex_lock(&lane->stat_mutex);
+                    lane->passes++;
+                    pthread_mutex_unlock(&lane->stat_mutex);
+                }
+                lane->total_cnt = 0;
+                lane->extract_cnt = 0;
             }
         } else {
             if (shadow_paint_name_cb)
-                shadow_paint_name_cb(NULL, false);
+                shadow_paint_name_cb(lane->id, NULL, false);
         }
         if (!real) {
-            memset(last_name, 0, sizeof(last_name));
-            pthread_mutex_lock(&g_rgb_track_mutex);
-            g_rgb_track = -1;
-            pthread_mutex_unlock(&g_rgb_track_mutex);
+            lane->last_id = -1;
+            pthread_mutex_lock(&lane->rgb_track_mutex);
+            lane->rgb_track = -1;
+            pthread_mutex_unlock(&lane->rgb_track_mutex);
         }
 #if 0
         if (face.score > FACE_SCORE_RGB)
@@ -684,111 +1724,246 @@ static void *rockface_control_thread(void *arg)
     pthread_exit(NULL);
 }
 
-int rockface_control_init(int face_cnt)
+static rockface_handle_t rockface_control_create_handle(bool recognizer)
 {
+    rockface_handle_t handle;
     rockface_ret_t ret;
 
-    face_handle = rockface_create_handle();
+    handle = rockface_create_handle();
 
-    ret = rockface_set_licence(face_handle, LICENCE_PATH);
+    ret = rockface_set_licence(handle, LICENCE_PATH);
     if (ret != ROCKFACE_RET_SUCCESS) {
         printf("%s: authorization error %d!\n", __func__, ret);
         play_wav_signal(AUTHORIZE_FAIL_WAV);
-        return -1;
+        goto fail;
     }
-    ret = rockface_set_data_path(face_handle, FACE_DATA_PATH);
+    ret = rockface_set_data_path(handle, FACE_DATA_PATH);
     if (ret != ROCKFACE_RET_SUCCESS) {
         printf("%s: set data path error %d!\n", __func__, ret);
-        return -1;
+        goto fail;
     }
 
-    ret = rockface_init_detector(face_handle);
+    ret = rockface_init_detector(handle);
     if (ret != ROCKFACE_RET_SUCCESS) {
         printf("%s: init detector error %d!\n", __func__, ret);
-        return -1;
+        goto fail;
     }
 
-    ret = rockface_init_recognizer(face_handle);
+    if (!recognizer)
+        return handle;
+
+    ret = rockface_init_recognizer(handle);
     if (ret != ROCKFACE_RET_SUCCESS) {
         printf("%s: init recognizer error %d!\n", __func__, ret);
-        return -1;
+        goto fail;
     }
 
-    ret = rockface_init_liveness_detector(face_handle);
+    ret = rockface_init_liveness_detector(handle);
     if (ret != ROCKFACE_RET_SUCCESS) {
         printf("%s: init liveness detector error %d!\n", __func__, ret);
+        goto fail;
+    }
+
+    return handle;
+
+fail:
+    rockface_release_handle(handle);
+    return NULL;
+}
+
+static int rockface_lane_init(struct rockface_lane *lane, int id)
+{
+    memset(lane, 0, sizeof(*lane));
+    lane->id = id;
+    lane->rgb_fd = -1;
+    lane->rgbx_fd = -1;
+    lane->ir_fd = -1;
+    lane->rgb_track = -1;
+    lane->window.track = -1;
+    lane->fusion.track = -1;
+    lane->fusion.match = -1;
+    lane->last_id = -1;
+    lane->label_id = -1;
+    pthread_mutex_init(&lane->mutex, NULL);
+    pthread_cond_init(&lane->cond, NULL);
+    pthread_mutex_init(&lane->detect_mutex, NULL);
+    pthread_cond_init(&lane->detect_cond, NULL);
+    pthread_mutex_init(&lane->rgb_track_mutex, NULL);
+    pthread_mutex_init(&lane->ir_mutex, NULL);
+    pthread_cond_init(&lane->ir_cond, NULL);
+    pthread_mutex_init(&lane->ir_img_mutex, NULL);
+    pthread_mutex_init(&lane->stat_mutex, NULL);
+
+    /*
+     * With a single recognizer handle all NPU work is serialized anyway and
+     * the first lane can track on it, otherwise every lane needs its own.
+     */
+    if (id == 0 && g_handle_cnt == 1)
+        lane->handle = face_handle;
+    else
+        lane->handle = rockface_control_create_handle(false);
+    if (!lane->handle)
         return -1;
+
+    return 0;
+}
+
+static void rockface_lane_exit(struct rockface_lane *lane)
+{
+    if (lane->handle && lane->handle != face_handle)
+        rockface_release_handle(lane->handle);
+    lane->handle = NULL;
+    rockface_window_reset(&lane->window, -1);
+
+    rga_control_buffer_deinit(&lane->rgb_bo, lane->rgb_fd);
+    rga_control_buffer_deinit(&lane->rgbx_bo, lane->rgbx_fd);
+    rga_control_buffer_deinit(&lane->ir_bo, lane->ir_fd);
+}
+
+int rockface_control_init(int face_cnt, int lane_cnt, int npu_cnt)
+{
+    struct face_library *lib;
+
+    if (npu_cnt <= 0 || npu_cnt > NPU_MAX_HANDLES)
+        npu_cnt = 1;
+    for (g_handle_cnt = 0; g_handle_cnt < npu_cnt; g_handle_cnt++) {
+        g_handles[g_handle_cnt] = rockface_control_create_handle(true);
+        if (!g_handles[g_handle_cnt])
+            return -1;
     }
+    face_handle = g_handles[0];
+    if (npu_scheduler_init(g_handles, g_handle_cnt))
+        return -1;
+    if (feature_pool_init(g_handle_cnt))
+        return -1;
 
     if (face_cnt <= 0)
         g_face_cnt = DEFAULT_FACE_NUMBER;
     else
         g_face_cnt = face_cnt;
-    g_face_data = calloc(g_face_cnt, sizeof(struct face_data));
-    if (!g_face_data) {
-        printf("face data alloc failed!\n");
+    lib = rockface_library_alloc(0);
+    if (!lib)
         return -1;
-    }
 
     if (access(DATABASE_PATH, F_OK) == 0) {
         printf("load face feature from %s\n", DATABASE_PATH);
         if (database_init())
-            return -1;
-        g_face_index += database_get_data(g_face_data, g_face_cnt, sizeof(rockface_feature_t), 0,
-                                          NAME_LEN, sizeof(rockface_feature_t));
+            goto fail;
+        database_for_each_data(rockface_control_add_data, &lib->gallery);
         database_exit();
     }
 
     if (database_init())
+        goto fail;
+    printf("face number is %d\n", lib->gallery.num);
+    if (rockface_library_index(lib))
+        goto fail;
+    rockface_library_publish(lib, false);
+
+    g_update_codes = g_face_pq_en;
+    g_update_run = true;
+    if (pthread_create(&g_update_tid, NULL, rockface_control_update_thread, NULL)) {
+        printf("%s: pthread_create error!\n", __func__);
         return -1;
-    printf("load face feature from %s\n", DEFAULT_FACE_PATH);
-    g_face_index += load_feature(DEFAULT_FACE_PATH, ".jpg",
-                        (struct face_data*)g_face_data + g_face_index, g_face_cnt - g_face_index);
-    printf("face number is %d\n", g_face_index);
-    sync();
-    if (rockface_control_init_library(g_face_data, g_face_index, sizeof(struct face_data), 0))
-        return -1;
+    }
+
+    if (lane_cnt <= 0 || lane_cnt > MAX_LANE)
+        lane_cnt = 1;
+    for (g_lane_num = 0; g_lane_num < lane_cnt; g_lane_num++)
+        if (rockface_lane_init(&g_lanes[g_lane_num], g_lane_num))
+            return -1;
 
     g_run = true;
-    if (pthread_create(&g_detect_tid, NULL, rockface_control_detect_thread, NULL)) {
-        printf("%s: pthread_create error!\n", __func__);
-        g_run = false;
-        return -1;
+    for (int i = 0; i < g_lane_num; i++) {
+        struct rockface_lane *lane = &g_lanes[i];
+        if (pthread_create(&lane->detect_tid, NULL, rockface_control_detect_thread, lane)) {
+            printf("%s: pthread_create error!\n", __func__);
+            return -1;
+        }
+        if (pthread_create(&lane->tid, NULL, rockface_control_thread, lane)) {
+            printf("%s: pthread_create error!\n", __func__);
+            return -1;
+        }
     }
-    if (pthread_create(&g_tid, NULL, rockface_control_thread, NULL)) {
+
+    /* the gate runs on the database gallery, new photos come in behind it */
+    g_import_queue = (struct face_update *)calloc(FACE_IMPORT_PENDING_MAX,
+                                                  sizeof(struct face_update));
+    g_import_spare = (struct face_update *)calloc(FACE_IMPORT_PENDING_MAX,
+                                                  sizeof(struct face_update));
+    if (!g_import_queue || !g_import_spare) {
+        printf("%s: alloc import buffers fail, %s is not imported\n", __func__,
+               DEFAULT_FACE_PATH);
+        return 0;
+    }
+    g_import_run = true;
+    if (pthread_create(&g_import_tid, NULL, rockface_control_import_thread, NULL)) {
         printf("%s: pthread_create error!\n", __func__);
-        g_run = false;
         return -1;
     }
 
     return 0;
+
+fail:
+    rockface_library_free(lib);
+    return -1;
 }
 
 void rockface_control_exit(void)
 {
+    pthread_mutex_lock(&g_update_mutex);
+    g_import_run = false;
+    pthread_cond_broadcast(&g_import_cond);
+    pthread_mutex_unlock(&g_update_mutex);
+    if (g_import_tid) {
+        pthread_join(g_import_tid, NULL);
+        g_import_tid = 0;
+    }
+
     g_run = false;
-    rockface_control_detect_signal();
-    if (g_detect_tid) {
-        pthread_join(g_detect_tid, NULL);
-        g_detect_tid = 0;
+    for (int i = 0; i < g_lane_num; i++) {
+        struct rockface_lane *lane = &g_lanes[i];
+        rockface_control_detect_signal(lane);
+        if (lane->detect_tid) {
+            pthread_join(lane->detect_tid, NULL);
+            lane->detect_tid = 0;
+        }
+        rockface_control_signal(lane);
+        if (lane->tid) {
+            pthread_join(lane->tid, NULL);
+            lane->tid = 0;
+        }
+        rockface_lane_exit(lane);
     }
-    rockface_control_signal();
-    if (g_tid) {
-        pthread_join(g_tid, NULL);
-        g_tid = 0;
+    g_lane_num = 0;
+
+    pthread_mutex_lock(&g_update_mutex);
+    g_update_run = false;
+    pthread_cond_signal(&g_update_cond);
+    pthread_mutex_unlock(&g_update_mutex);
+    if (g_update_tid) {
+        pthread_join(g_update_tid, NULL);
+        g_update_tid = 0;
     }
-
-    rockface_control_release_library();
-    rockface_release_handle(face_handle);
+    g_update_cnt = 0;
+    g_update_busy = 0;
+    free(g_import_queue);
+    free(g_import_spare);
+    g_import_queue = NULL;
+    g_import_spare = NULL;
+    g_import_cnt = 0;
+    g_import_ready = false;
+
+    feature_pool_exit();
+    rockface_library_publish(NULL, false);
+    face_search_exit();
+    npu_scheduler_exit();
+    for (int i = 0; i < g_handle_cnt; i++)
+        rockface_release_handle(g_handles[i]);
+    g_handle_cnt = 0;
+    face_handle = NULL;
 
     database_exit();
 
-    if (g_face_data) {
-        free(g_face_data);
-        g_face_data = NULL;
-    }
-
-    rga_control_buffer_deinit(&g_rgb_bo, g_rgb_fd);
-    rga_control_buffer_deinit(&g_rgbx_bo, g_rgbx_fd);
-    rga_control_buffer_deinit(&g_ir_bo, g_ir_fd);
+    face_pq_release(&g_face_pq);
 }
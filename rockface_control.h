@@ -40,13 +40,15 @@ extern "C" {
 
 #include "rga_control.h"
 
-int rockface_control_init(int face_cnt);
+int rockface_control_init(int face_cnt, int lane_cnt, int npu_cnt);
 void rockface_control_exit(void);
 int rockface_control_get_path_feature(char *path, void *feature);
-int rockface_control_convert(void *ptr, int width, int height, RgaSURF_FORMAT rga_fmt);
+int rockface_control_convert(int lane, void *ptr, int fd, int width, int height,
+                             RgaSURF_FORMAT rga_fmt, int rotation);
 void rockface_control_set_delete(void);
 void rockface_control_set_register(void);
-int rockface_control_convert_ir(void *ptr, int width, int height, RgaSURF_FORMAT rga_fmt);
+int rockface_control_convert_ir(int lane, void *ptr, int fd, int width, int height,
+                                RgaSURF_FORMAT rga_fmt, int rotation);
 
 #ifdef __cplusplus
 }
@@ -34,9 +34,15 @@
 #include <rga/RgaApi.h>
 #include "shadow_display.h"
 #include "ui.h"
+#include "video_common.h"
 
-static int g_crop_video_x, g_crop_video_y, g_crop_video_w, g_crop_video_h;
-static int g_crop_screen_w, g_crop_screen_h;
+/* which part of the video is shown where on the screen, per lane */
+struct shadow_crop {
+    int video_x, video_y, video_w, video_h;
+    int screen_x, screen_y, screen_w, screen_h;
+};
+
+static struct shadow_crop g_crop[MAX_LANE];
 
 void shadow_display(void *src_ptr, int src_fd, int src_fmt, int src_w, int src_h)
 {
@@ -58,12 +64,12 @@ void shadow_display(void *src_ptr, int src_fd, int src_fmt, int src_w, int src_h
         dst_h = scale * src_h;
         src_act_w = src_h * dst_w / dst_h;
         src_act_h = src_h;
-        g_crop_video_x = (src_w - src_act_w) / 2;
-        g_crop_video_y = (src_h - src_act_h) / 2;
-        g_crop_video_w = src_act_w;
-        g_crop_video_h = src_act_h;
-        g_crop_screen_w = dst_w;
-        g_crop_screen_h = dst_h;
+        g_crop[0].video_x = (src_w - src_act_w) / 2;
+        g_crop[0].video_y = (src_h - src_act_h) / 2;
+        g_crop[0].video_w = src_act_w;
+        g_crop[0].video_h = src_act_h;
+        g_crop[0].screen_w = dst_w;
+        g_crop[0].screen_h = dst_h;
 
         memset(&src, 0, sizeof(rga_info_t));
         if (src_ptr) {
@@ -92,12 +98,70 @@ void shadow_display(void *src_ptr, int src_fd, int src_fmt, int src_w, int src_h
     }
 }
 
-void shadow_display_vertical(void *src_ptr, int src_fd, int src_fmt, int src_w, int src_h)
+/*
+ * With several lanes the screen is split into horizontal bands, one per
+ * lane, and every lane scales its video into the middle of its band.
+ */
+static void shadow_display_band(int lane, void *src_ptr, int src_fd, int src_fmt,
+                                int src_w, int src_h, int dst_fd, int screen_w, int screen_h)
 {
+    struct shadow_crop *crop = &g_crop[lane];
+    int band_h = screen_h / g_lane_cnt;
+    int dst_x, dst_y, dst_w, dst_h;
+    rga_info_t src, dst;
+
+    dst_w = screen_w;
+    dst_h = screen_w * src_h / src_w;
+    if (dst_h > band_h) {
+        dst_h = band_h;
+        dst_w = (band_h * src_w / src_h) & ~1;
+    }
+    dst_x = ((screen_w - dst_w) / 2) & ~1;
+    dst_y = (lane * band_h + (band_h - dst_h) / 2) & ~1;
+    crop->video_x = 0;
+    crop->video_y = 0;
+    crop->video_w = src_w;
+    crop->video_h = src_h;
+    crop->screen_x = dst_x;
+    crop->screen_y = dst_y;
+    crop->screen_w = dst_w;
+    crop->screen_h = dst_h;
+
+    memset(&src, 0, sizeof(rga_info_t));
+    if (src_ptr) {
+        src.fd = -1;
+        src.virAddr = src_ptr;
+    } else {
+        src.fd = src_fd;
+    }
+    src.mmuFlag = 1;
+    rga_set_rect(&src.rect, 0, 0, src_w, src_h, src_w, src_h, src_fmt);
+
+    memset(&dst, 0, sizeof(rga_info_t));
+    dst.fd = dst_fd;
+    dst.mmuFlag = 1;
+    rga_set_rect(&dst.rect, dst_x, dst_y, dst_w, dst_h, screen_w, screen_h, src_fmt);
+
+    if (c_RkRgaBlit(&src, &dst, NULL)) {
+        printf("%s: rga fail\n", __func__);
+        return;
+    }
+
+    shadow_rga_switch(NULL, dst.fd, src_fmt, screen_w, screen_h);
+}
+
+void shadow_display_vertical(int lane, void *src_ptr, int src_fd, int src_fmt,
+                             int src_w, int src_h)
+{
+    struct shadow_crop *crop;
     int dst_fd, dst_w, dst_h;
     int screen_w, screen_h;
     rga_info_t src, dst;
 
+    if (lane < 0 || lane >= g_lane_cnt)
+        return;
+    crop = &g_crop[lane];
+
     shadow_rga_get_user_fd(&dst_fd, &screen_w, &screen_h);
     if (dst_fd <= 0 || screen_w <= 0 || screen_h <= 0) {
         printf("%s: get data fail\n", __func__);
@@ -105,23 +169,26 @@ void shadow_display_vertical(void *src_ptr, int src_fd, int src_fmt, int src_w,
     }
 
     if (screen_w < screen_h) {
-        if (src_w == screen_w && src_h == screen_h) {
-            g_crop_video_x = 0;
-            g_crop_video_y = 0;
-            g_crop_video_w = src_w;
-            g_crop_video_h = src_h;
-            g_crop_screen_w = src_w;
-            g_crop_screen_h = src_h;
+        if (g_lane_cnt > 1) {
+            shadow_display_band(lane, src_ptr, src_fd, src_fmt, src_w, src_h,
+                                dst_fd, screen_w, screen_h);
+        } else if (src_w == screen_w && src_h == screen_h) {
+            crop->video_x = 0;
+            crop->video_y = 0;
+            crop->video_w = src_w;
+            crop->video_h = src_h;
+            crop->screen_w = src_w;
+            crop->screen_h = src_h;
             shadow_rga_switch(NULL, src_fd, src_fmt, src_w, src_h);
         } else {
             dst_w = screen_w;
             dst_h = screen_w * src_h / src_w;
-            g_crop_video_x = 0;
-            g_crop_video_y = 0;
-            g_crop_video_w = src_w;
-            g_crop_video_h = src_h;
-            g_crop_screen_w = dst_w;
-            g_crop_screen_h = dst_h;
+            crop->video_x = 0;
+            crop->video_y = 0;
+            crop->video_w = src_w;
+            crop->video_h = src_h;
+            crop->screen_w = dst_w;
+            crop->screen_h = dst_h;
 
             memset(&src, 0, sizeof(rga_info_t));
             if (src_ptr) {
@@ -150,20 +217,24 @@ void shadow_display_vertical(void *src_ptr, int src_fd, int src_fmt, int src_w,
     }
 }
 
-void shadow_paint_box(int left, int top, int right, int bottom)
+void shadow_paint_box(int lane, int left, int top, int right, int bottom)
 {
-    ui_paint_box(g_crop_video_w, g_crop_video_h,
-            left - g_crop_video_x, top - g_crop_video_y,
-            right - g_crop_video_x, bottom - g_crop_video_y);
+    struct shadow_crop *crop = &g_crop[lane];
+
+    ui_paint_box(lane, crop->video_w, crop->video_h,
+            left - crop->video_x, top - crop->video_y,
+            right - crop->video_x, bottom - crop->video_y);
 }
 
-void shadow_paint_name(char *name, bool real)
+void shadow_paint_name(int lane, char *name, bool real)
 {
-    ui_paint_name(name, real);
+    ui_paint_name(lane, name, real);
 }
 
-void shadow_get_crop_screen(int *width, int *height)
+void shadow_get_crop_screen(int lane, int *x, int *y, int *width, int *height)
 {
-    *width = g_crop_screen_w;
-    *height = g_crop_screen_h;
+    *x = g_crop[lane].screen_x;
+    *y = g_crop[lane].screen_y;
+    *width = g_crop[lane].screen_w;
+    *height = g_crop[lane].screen_h;
 }
@@ -40,10 +40,11 @@ extern "C" {
 #include <stdbool.h>
 
 void shadow_display(void *src_ptr, int src_fd, int src_fmt, int src_w, int src_h);
-void shadow_display_vertical(void *src_ptr, int src_fd, int src_fmt, int src_w, int src_h);
-void shadow_paint_box(int left, int top, int right, int bottom);
-void shadow_paint_name(char *name, bool real);
-void shadow_get_crop_screen(int *width, int *height);
+void shadow_display_vertical(int lane, void *src_ptr, int src_fd, int src_fmt,
+                             int src_w, int src_h);
+void shadow_paint_box(int lane, int left, int top, int right, int bottom);
+void shadow_paint_name(int lane, char *name, bool real);
+void shadow_get_crop_screen(int lane, int *x, int *y, int *width, int *height);
 
 #ifdef __cplusplus
 }
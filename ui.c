@@ -30,10 +30,15 @@
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
  * SOFTWARE.
  */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #include <minigui/common.h>
 #include <minigui/minigui.h>
@@ -45,13 +50,18 @@
 #include "face_common.h"
 #include "rockface_control.h"
 #include "shadow_display.h"
+#include "video_common.h"
 
-#define ID_TIMER 100
+#define MSG_OVERLAY_UPDATE (MSG_USER + 1)
 
 #define IDC_REGISTER 500
 #define IDC_DELETE 501
 #define IDC_LOGO 502
 
+/* the UI thread cpu is sampled from a timer, in MiniGUI ticks of 10 ms */
+#define IDT_CPU 600
+#define UI_CPU_TICKS 500
+
 #define BUTTON_WIDTH 150
 #define BUTTON_HEIGHT 60
 
@@ -71,13 +81,30 @@ void *image_array[][2] = {
     {img_logo, &img_logo_bmap},
 };
 
-static unsigned int g_left, g_top, g_right, g_bottom;
-static char g_name[NAME_LEN];
-static bool g_update = false;
-static bool g_real = false;
+struct ui_overlay {
+    int left, top, right, bottom;
+    char name[NAME_LEN];
+    bool real;
+};
+
+/*
+ * Overlay state, one per lane, published by the vision threads through a
+ * seqlock. The writers only serialize against each other, the MiniGUI
+ * thread never takes a lock and simply retries its copy if it raced with
+ * a writer.
+ */
+static struct ui_overlay g_pub[MAX_LANE];
+static unsigned int g_seq;
+static int g_post;
 
+/* serializes the vision threads, never taken by the MiniGUI thread */
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* owned by the MiniGUI thread */
+static struct ui_overlay g_overlay[MAX_LANE];
+static RECT g_overlay_rect[MAX_LANE];
+static int g_repaint_cnt;
+
 int loadres(void)
 {
     char img[256];
@@ -107,45 +134,146 @@ static int draw_text(HDC hdc, const char *buf, int n, int left, int top,
     return DrawText(hdc, buf, n, &rc, format);
 }
 
+static void ui_paint_overlay(HDC hdc, struct ui_overlay *overlay)
+{
+    if (overlay->right <= overlay->left || overlay->bottom <= overlay->top)
+        return;
+
+    if (strlen(overlay->name)) {
+        if (overlay->real) {
+            SetTextColor(hdc, PIXEL_green);
+            SetPenColor(hdc, PIXEL_green);
+        } else {
+            SetTextColor(hdc, PIXEL_yellow);
+            SetPenColor(hdc, PIXEL_yellow);
+        }
+        draw_text(hdc, overlay->name, -1, overlay->left + 1, overlay->top + 1,
+                  overlay->right, overlay->bottom,
+                  DT_NOCLIP | DT_SINGLELINE | DT_LEFT | DT_TOP);
+    } else {
+        SetTextColor(hdc, PIXEL_red);
+        SetPenColor(hdc, PIXEL_red);
+    }
+    Rectangle(hdc, overlay->left, overlay->top, overlay->right, overlay->bottom);
+}
+
 static void ui_paint(HWND hwnd)
 {
     HDC hdc;
     hdc = BeginPaint(hwnd);
     SetBkColor(hdc, g_bkcolor);
-    pthread_mutex_lock(&mutex);
-    if (g_update) {
-        if (strlen(g_name)) {
-            if (g_real) {
-                SetTextColor(hdc, PIXEL_green);
-                SetPenColor(hdc, PIXEL_green);
-            } else {
-                SetTextColor(hdc, PIXEL_yellow);
-                SetPenColor(hdc, PIXEL_yellow);
-            }
-            draw_text(hdc, g_name, -1, g_left + 1, g_top + 1, g_right, g_bottom,
-                    DT_NOCLIP | DT_SINGLELINE | DT_LEFT | DT_TOP);
-        } else {
-            SetTextColor(hdc, PIXEL_red);
-            SetPenColor(hdc, PIXEL_red);
-        }
-        Rectangle(hdc, g_left, g_top, g_right, g_bottom);
-        g_update = false;
-    }
-    pthread_mutex_unlock(&mutex);
+    for (int i = 0; i < g_lane_cnt; i++)
+        ui_paint_overlay(hdc, &g_overlay[i]);
     EndPaint(hwnd, hdc);
+    g_repaint_cnt++;
+}
+
+static void ui_overlay_get_rect(HWND hwnd, struct ui_overlay *overlay, RECT *rect)
+{
+    HDC hdc;
+    SIZE size;
+    RECT text;
+
+    if (overlay->right <= overlay->left || overlay->bottom <= overlay->top) {
+        SetRectEmpty(rect);
+        return;
+    }
+
+    /* Rectangle() includes the right and bottom edge */
+    SetRect(rect, overlay->left, overlay->top, overlay->right + 1, overlay->bottom + 1);
+    if (strlen(overlay->name)) {
+        hdc = GetClientDC(hwnd);
+        GetTextExtent(hdc, overlay->name, -1, &size);
+        ReleaseDC(hdc);
+        SetRect(&text, overlay->left + 1, overlay->top + 1,
+                overlay->left + 1 + size.cx, overlay->top + 1 + size.cy);
+        UnionRect(rect, rect, &text);
+    }
+    InflateRect(rect, 1, 1);
 }
 
-static void ui_paint_refresh(void)
+static void ui_report_cpu(void)
+{
+    static struct timeval t0;
+    static struct rusage r0;
+    static int cnt0;
+    struct timeval t1;
+    struct rusage r1;
+    long long wall, cpu;
+
+    gettimeofday(&t1, NULL);
+    getrusage(RUSAGE_THREAD, &r1);
+    wall = (t1.tv_sec - t0.tv_sec) * 1000000LL + (t1.tv_usec - t0.tv_usec);
+    if (!t0.tv_sec || wall <= 0) {
+        t0 = t1;
+        r0 = r1;
+        cnt0 = g_repaint_cnt;
+        return;
+    }
+    cpu = (r1.ru_utime.tv_sec - r0.ru_utime.tv_sec + r1.ru_stime.tv_sec - r0.ru_stime.tv_sec) *
+          1000000LL + (r1.ru_utime.tv_usec - r0.ru_utime.tv_usec) +
+          (r1.ru_stime.tv_usec - r0.ru_stime.tv_usec);
+    printf("UI thread cpu: %lld.%lld%%, repaint: %d in %llds\n", cpu * 100 / wall,
+           cpu * 1000 / wall % 10, g_repaint_cnt - cnt0, wall / 1000000);
+    t0 = t1;
+    r0 = r1;
+    cnt0 = g_repaint_cnt;
+}
+
+static void ui_overlay_read(struct ui_overlay *overlay)
+{
+    unsigned int seq;
+
+    do {
+        seq = __atomic_load_n(&g_seq, __ATOMIC_ACQUIRE);
+        memcpy(overlay, g_pub, sizeof(g_pub));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&g_seq, __ATOMIC_RELAXED));
+}
+
+/* called by the vision threads with mutex held */
+static void ui_overlay_publish(int lane, struct ui_overlay *overlay)
+{
+    __atomic_store_n(&g_seq, g_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&g_pub[lane], overlay, sizeof(g_pub[lane]));
+    __atomic_store_n(&g_seq, g_seq + 1, __ATOMIC_RELEASE);
+}
+
+static void ui_overlay_post(void)
 {
-    int ui_width, ui_height;
-    shadow_get_crop_screen(&ui_width, &ui_height);
-    RECT rect = {0, IMG_LOGO_HEIGHT, ui_width, ui_height - IMG_LOGO_HEIGHT};
     if (g_main_hwnd == HWND_INVALID)
         return;
-    if (g_update)
-        InvalidateRect(g_main_hwnd, &rect, TRUE);
-    else
-        InvalidateRect(g_main_hwnd, &rect, FALSE);
+    if (__atomic_exchange_n(&g_post, 1, __ATOMIC_ACQ_REL))
+        return;
+    if (PostMessage(g_main_hwnd, MSG_OVERLAY_UPDATE, 0, 0))
+        __atomic_store_n(&g_post, 0, __ATOMIC_RELEASE);
+}
+
+static void ui_overlay_update(HWND hwnd)
+{
+    struct ui_overlay overlay[MAX_LANE];
+    RECT rect, dirty;
+
+    __atomic_store_n(&g_post, 0, __ATOMIC_RELEASE);
+    ui_overlay_read(overlay);
+    for (int i = 0; i < g_lane_cnt; i++) {
+        if (!memcmp(&overlay[i], &g_overlay[i], sizeof(overlay[i])))
+            continue;
+        memcpy(&g_overlay[i], &overlay[i], sizeof(g_overlay[i]));
+
+        /* repaint only the old and the new box together with their name text */
+        ui_overlay_get_rect(hwnd, &g_overlay[i], &rect);
+        if (IsRectEmpty(&g_overlay_rect[i]))
+            dirty = rect;
+        else if (IsRectEmpty(&rect))
+            dirty = g_overlay_rect[i];
+        else
+            UnionRect(&dirty, &g_overlay_rect[i], &rect);
+        g_overlay_rect[i] = rect;
+        if (!IsRectEmpty(&dirty))
+            InvalidateRect(hwnd, &dirty, TRUE);
+    }
 }
 
 static LRESULT ui_win_proc(HWND hwnd, UINT message, WPARAM w_param, LPARAM l_param)
@@ -154,19 +282,21 @@ static LRESULT ui_win_proc(HWND hwnd, UINT message, WPARAM w_param, LPARAM l_par
 
     switch (message) {
     case MSG_CREATE:
-        SetTimer(hwnd, ID_TIMER, 3);
 #if 0
         CreateWindow(CTRL_STATIC, "",
                 SS_REALSIZEIMAGE | SS_CENTERIMAGE | SS_BITMAP | WS_CHILD | WS_VISIBLE,
                 IDC_LOGO, 0, 0, g_rcScr.right, IMG_LOGO_HEIGHT, hwnd, (DWORD)&img_logo_bmap);
 #endif
-        break;
-    case MSG_CLOSE:
-        KillTimer(hwnd, ID_TIMER);
+        /* also while no overlay changes, an idle UI must show as idle */
+        if (g_perf_en && SetTimer(hwnd, IDT_CPU, UI_CPU_TICKS))
+            ui_report_cpu();
         break;
     case MSG_TIMER:
-        if (w_param == ID_TIMER)
-            ui_paint_refresh();
+        if (w_param == IDT_CPU)
+            ui_report_cpu();
+        break;
+    case MSG_OVERLAY_UPDATE:
+        ui_overlay_update(hwnd);
         break;
     case MSG_PAINT:
         ui_paint(hwnd);
@@ -262,6 +392,8 @@ void ui_run(void)
         DispatchMessage(&msg);
     }
 
+    if (g_perf_en)
+        KillTimer(g_main_hwnd, IDT_CPU);
     DestroyLogFont(g_font);
     DestroyWindow(reg_hwnd);
     DestroyWindow(del_hwnd);
@@ -270,60 +402,80 @@ void ui_run(void)
     unloadres();
 }
 
-void ui_paint_box(int width, int height, int left, int top, int right, int bottom)
+void ui_paint_box(int lane, int width, int height, int left, int top, int right, int bottom)
 {
 #define MIN_POS_DIFF 10
-    int ui_width, ui_height;
+    int ui_x, ui_y, ui_width, ui_height;
     int l, t, r, b;
-    shadow_get_crop_screen(&ui_width, &ui_height);
+    bool update = false;
+    struct ui_overlay overlay;
+
+    if (lane < 0 || lane >= MAX_LANE)
+        return;
+
+    shadow_get_crop_screen(lane, &ui_x, &ui_y, &ui_width, &ui_height);
+    pthread_mutex_lock(&mutex);
+    memcpy(&overlay, &g_pub[lane], sizeof(overlay));
     if (width > 0 && height > 0 && left > 0 && right < width && top > 0 && bottom < height) {
-        l = ui_width * left / width;
-        t = ui_height * top / height;
-        r = ui_width * right / width;
-        b = ui_height * bottom / height;
-        if (abs(g_left - l) > MIN_POS_DIFF || abs(g_top - t) > MIN_POS_DIFF ||
-            abs(g_right - r) > MIN_POS_DIFF || abs(g_bottom - b) > MIN_POS_DIFF) {
-            pthread_mutex_lock(&mutex);
-            g_left = l;
-            g_top = t;
-            g_right = r;
-            g_bottom = b;
-            g_update = true;
-            pthread_mutex_unlock(&mutex);
+        l = ui_x + ui_width * left / width;
+        t = ui_y + ui_height * top / height;
+        r = ui_x + ui_width * right / width;
+        b = ui_y + ui_height * bottom / height;
+        if (abs(overlay.left - l) > MIN_POS_DIFF || abs(overlay.top - t) > MIN_POS_DIFF ||
+            abs(overlay.right - r) > MIN_POS_DIFF || abs(overlay.bottom - b) > MIN_POS_DIFF) {
+            overlay.left = l;
+            overlay.top = t;
+            overlay.right = r;
+            overlay.bottom = b;
+            update = true;
         }
     } else {
-        if (g_left || g_top || g_right || g_bottom) {
-            pthread_mutex_lock(&mutex);
-            g_left = 0;
-            g_top = 0;
-            g_right = 0;
-            g_bottom = 0;
-            g_update = true;
-            pthread_mutex_unlock(&mutex);
+        if (overlay.left || overlay.top || overlay.right || overlay.bottom) {
+            overlay.left = 0;
+            overlay.top = 0;
+            overlay.right = 0;
+            overlay.bottom = 0;
+            update = true;
         }
     }
+    if (update)
+        ui_overlay_publish(lane, &overlay);
+    pthread_mutex_unlock(&mutex);
+
+    if (update)
+        ui_overlay_post();
 }
 
-void ui_paint_name(char *name, bool real)
+void ui_paint_name(int lane, char *name, bool real)
 {
-    char temp[NAME_LEN];
-    memset(temp, 0, sizeof(temp));
+    bool update = false;
+    struct ui_overlay overlay;
+
+    if (lane < 0 || lane >= MAX_LANE)
+        return;
+
     pthread_mutex_lock(&mutex);
+    memcpy(&overlay, &g_pub[lane], sizeof(overlay));
     if (name) {
-        if (strncmp(g_name, name, sizeof(g_name))) {
-            memset(g_name, 0, sizeof(g_name));
-            strncpy(g_name, name, sizeof(g_name) - 1);
-            g_update = true;
+        if (strncmp(overlay.name, name, sizeof(overlay.name))) {
+            memset(overlay.name, 0, sizeof(overlay.name));
+            strncpy(overlay.name, name, sizeof(overlay.name) - 1);
+            update = true;
         }
     } else {
-        if (memcmp(g_name, temp, sizeof(g_name))) {
-            memset(g_name, 0, sizeof(g_name));
-            g_update = true;
+        if (overlay.name[0]) {
+            memset(overlay.name, 0, sizeof(overlay.name));
+            update = true;
         }
     }
-    if (g_real != real) {
-        g_update = true;
-        g_real = real;
+    if (overlay.real != real) {
+        overlay.real = real;
+        update = true;
     }
+    if (update)
+        ui_overlay_publish(lane, &overlay);
     pthread_mutex_unlock(&mutex);
+
+    if (update)
+        ui_overlay_post();
 }
@@ -43,8 +43,8 @@ extern "C" {
 #include <minigui/window.h>
 
 void ui_run(void);
-void ui_paint_box(int width, int height, int left, int top, int right, int bottom);
-void ui_paint_name(char *name, bool real);
+void ui_paint_box(int lane, int width, int height, int left, int top, int right, int bottom);
+void ui_paint_name(int lane, char *name, bool real);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "video_common.h"
+#include "video_capture.h"
+
+#define VIDEO_CAPTURE_TIMEOUT_MS 1000
+#define VIDEO_CAPTURE_STALL_CNT 3
+#define VIDEO_CAPTURE_BACKOFF_MIN_MS 100
+#define VIDEO_CAPTURE_BACKOFF_MAX_MS 5000
+#define VIDEO_CAPTURE_FAULT_PERIOD 300
+
+/*
+ * Capture supervisor shared by rkisp and rkcif. rkisp_get_frame() is called
+ * with a timeout that acts as the frame watchdog, a stream that stalls
+ * VIDEO_CAPTURE_STALL_CNT times in a row or whose node disappears is torn
+ * down and reopened with exponential backoff. The consumers simply see no
+ * frames meanwhile, so the recognition pipeline keeps running.
+ *
+ * Building with -DVIDEO_CAPTURE_FAULT turns the real device into a faulty
+ * one: every VIDEO_CAPTURE_FAULT_PERIOD frames the stream stalls and every
+ * other reopen fails once. The fault state is kept per capture, so rkisp and
+ * rkcif fail independently. video_capture_fake runs the same supervisor on
+ * a host against a fake device tree.
+ */
+
+#ifdef VIDEO_CAPTURE_FAULT
+static const struct rkisp_api_buf *video_capture_fault_frame(struct video_capture *cap,
+                                                             const struct rkisp_api_buf *buf)
+{
+    /* frames stands still while stalled, inject once per period */
+    if (cap->frames && cap->frames % VIDEO_CAPTURE_FAULT_PERIOD == 0 &&
+        cap->frames != cap->fault_frames) {
+        printf("%s: %s inject stall\n", __func__, cap->name);
+        cap->fault_frames = cap->frames;
+        cap->fault_stall = VIDEO_CAPTURE_STALL_CNT;
+    }
+    if (cap->fault_stall && buf) {
+        cap->fault_stall--;
+        rkisp_put_frame(cap->ctx, buf);
+        usleep(VIDEO_CAPTURE_TIMEOUT_MS * 1000);
+        return NULL;
+    }
+
+    return buf;
+}
+
+static int video_capture_fault_open(struct video_capture *cap)
+{
+    if (cap->recoveries && (++cap->fault_opens % 2)) {
+        printf("%s: %s inject open failure\n", __func__, cap->name);
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+static void video_capture_hotplug(const char *name, int id, bool add, void *arg)
+{
+    struct video_capture *cap = (struct video_capture *)arg;
+
+    (void)name;
+    (void)id;
+    if (add)
+        cap->backoff_ms = 0;
+    else
+        cap->lost = true;
+}
+
+static void video_capture_close(struct video_capture *cap)
+{
+    if (!cap->ctx)
+        return;
+
+    /* every buffer has to be back before the device goes away */
+    video_fanout_flush(cap->fanout);
+    cap->close(cap);
+    cap->ctx = NULL;
+    video_fanout_set_ctx(cap->fanout, NULL);
+}
+
+int video_capture_open(struct video_capture *cap)
+{
+#ifdef VIDEO_CAPTURE_FAULT
+    if (video_capture_fault_open(cap))
+        return -1;
+#endif
+    if (cap->open(cap))
+        return -1;
+
+    cap->lost = false;
+    video_fanout_set_ctx(cap->fanout, cap->ctx);
+
+    return 0;
+}
+
+static void video_capture_backoff(struct video_capture *cap)
+{
+    for (int ms = 0; ms < cap->backoff_ms && cap->run; ms += 10) {
+        /* a hotplug arrival resets the backoff */
+        if (cap->backoff_ms == 0)
+            break;
+        usleep(10000);
+    }
+    if (cap->backoff_ms < VIDEO_CAPTURE_BACKOFF_MIN_MS)
+        cap->backoff_ms = VIDEO_CAPTURE_BACKOFF_MIN_MS;
+    else if (cap->backoff_ms < VIDEO_CAPTURE_BACKOFF_MAX_MS)
+        cap->backoff_ms *= 2;
+}
+
+static void *video_capture_thread(void *arg)
+{
+    struct video_capture *cap = (struct video_capture *)arg;
+    const struct rkisp_api_buf *buf;
+    int stall = 0;
+
+    while (cap->run) {
+        if (!cap->ctx) {
+            video_capture_backoff(cap);
+            if (!cap->run)
+                break;
+            if (video_capture_open(cap)) {
+                printf("%s: %s reopen fail, retry in %dms\n", __func__, cap->name,
+                       cap->backoff_ms);
+                continue;
+            }
+            cap->recoveries++;
+            cap->backoff_ms = 0;
+            stall = 0;
+            printf("%s: %s recovered, recoveries: %d, timeouts: %d\n", __func__,
+                   cap->name, cap->recoveries, cap->timeouts);
+        }
+
+        buf = rkisp_get_frame(cap->ctx, VIDEO_CAPTURE_TIMEOUT_MS);
+#ifdef VIDEO_CAPTURE_FAULT
+        buf = video_capture_fault_frame(cap, buf);
+#endif
+        if (buf) {
+            stall = 0;
+            cap->frames++;
+            cap->frame(cap, buf);
+        } else {
+            cap->timeouts++;
+            stall++;
+        }
+
+        if (stall >= VIDEO_CAPTURE_STALL_CNT || cap->lost) {
+            printf("%s: %s %s, restart stream\n", __func__, cap->name,
+                   cap->lost ? "lost" : "stalled");
+            video_capture_close(cap);
+        }
+    }
+
+    video_capture_close(cap);
+    pthread_exit(NULL);
+}
+
+int video_capture_start(struct video_capture *cap)
+{
+    video_device_register(cap->name, video_capture_hotplug, cap);
+
+    cap->run = true;
+    if (pthread_create(&cap->tid, NULL, video_capture_thread, cap)) {
+        printf("%s: pthread_create fail\n", __func__);
+        cap->run = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+void video_capture_stop(struct video_capture *cap)
+{
+    cap->run = false;
+    if (cap->tid) {
+        pthread_join(cap->tid, NULL);
+        cap->tid = 0;
+    }
+    /* init may have failed after the first open */
+    video_capture_close(cap);
+}
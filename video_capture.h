@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __VIDEO_CAPTURE_H__
+#define __VIDEO_CAPTURE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "video_fanout.h"
+
+struct video_capture;
+
+typedef int (*video_capture_open_callback)(struct video_capture *cap);
+typedef void (*video_capture_close_callback)(struct video_capture *cap);
+typedef void (*video_capture_frame_callback)(struct video_capture *cap,
+                                             const struct rkisp_api_buf *buf);
+
+struct video_capture {
+    const char *name;
+    video_capture_open_callback open;
+    video_capture_close_callback close;
+    video_capture_frame_callback frame;
+    void *arg;
+    struct video_fanout *fanout;
+    const struct rkisp_api_ctx *ctx;
+    pthread_t tid;
+    bool run;
+    bool lost;
+    int backoff_ms;
+    int timeouts;
+    int recoveries;
+    int frames;
+    /* -DVIDEO_CAPTURE_FAULT state */
+    int fault_stall;
+    int fault_frames;
+    int fault_opens;
+};
+
+int video_capture_open(struct video_capture *cap);
+int video_capture_start(struct video_capture *cap);
+void video_capture_stop(struct video_capture *cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
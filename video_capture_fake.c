@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "video_common.h"
+#include "video_capture.h"
+
+/*
+ * Host run of the capture supervisor. The rkisp api below is a fake device
+ * that serves synthetic frames while its node exists under a fake /dev,
+ * video_device_init() watches the matching fake sysfs tree. Two streams run
+ * with -DVIDEO_CAPTURE_FAULT and one of them is unplugged and plugged back
+ * midway, both have to recover and give back every buffer.
+ * Usage: video_capture_fake [seconds].
+ */
+
+#define VIDEO_CAPTURE_FAKE_SECONDS 12
+#define VIDEO_CAPTURE_FAKE_FRAME_US 5000
+#define VIDEO_CAPTURE_FAKE_BUFS 4
+#define VIDEO_CAPTURE_FAKE_SIZE (64 * 48 * 3 / 2)
+
+struct video_capture_fake_dev {
+    struct rkisp_api_ctx ctx;
+    struct rkisp_api_buf bufs[VIDEO_CAPTURE_FAKE_BUFS];
+    bool queued[VIDEO_CAPTURE_FAKE_BUFS];
+    pthread_mutex_t mutex;
+};
+
+struct video_capture_fake {
+    struct video_capture capture;
+    struct video_fanout fanout;
+    int consumed;
+};
+
+static char g_fake_root[64];
+
+const struct rkisp_api_ctx *rkisp_open_device(const char *dev_path, int uapi)
+{
+    struct video_capture_fake_dev *fake;
+
+    if (access(dev_path, F_OK))
+        return NULL;
+    fake = (struct video_capture_fake_dev *)calloc(1, sizeof(*fake));
+    if (!fake)
+        return NULL;
+    snprintf(fake->ctx.dev_path, sizeof(fake->ctx.dev_path), "%s", dev_path);
+    fake->ctx.uapi = uapi;
+    fake->ctx.width = 64;
+    fake->ctx.height = 48;
+    pthread_mutex_init(&fake->mutex, NULL);
+    for (int i = 0; i < VIDEO_CAPTURE_FAKE_BUFS; i++) {
+        fake->bufs[i].buf = calloc(1, VIDEO_CAPTURE_FAKE_SIZE);
+        fake->bufs[i].fd = -1;
+        fake->bufs[i].size = VIDEO_CAPTURE_FAKE_SIZE;
+        fake->queued[i] = true;
+    }
+
+    return &fake->ctx;
+}
+
+void rkisp_close_device(const struct rkisp_api_ctx *ctx)
+{
+    struct video_capture_fake_dev *fake = (struct video_capture_fake_dev *)ctx;
+
+    for (int i = 0; i < VIDEO_CAPTURE_FAKE_BUFS; i++) {
+        if (!fake->queued[i])
+            printf("%s: %s buffer %d still out\n", __func__, ctx->dev_path, i);
+        free(fake->bufs[i].buf);
+    }
+    pthread_mutex_destroy(&fake->mutex);
+    free(fake);
+}
+
+const struct rkisp_api_buf *rkisp_get_frame(const struct rkisp_api_ctx *ctx, int timeout_ms)
+{
+    struct video_capture_fake_dev *fake = (struct video_capture_fake_dev *)ctx;
+    const struct rkisp_api_buf *buf = NULL;
+
+    /* an unplugged node times out like a stalled sensor */
+    if (access(ctx->dev_path, F_OK)) {
+        usleep(timeout_ms * 1000);
+        return NULL;
+    }
+    usleep(VIDEO_CAPTURE_FAKE_FRAME_US);
+
+    pthread_mutex_lock(&fake->mutex);
+    for (int i = 0; i < VIDEO_CAPTURE_FAKE_BUFS; i++) {
+        if (fake->queued[i]) {
+            fake->queued[i] = false;
+            gettimeofday(&fake->bufs[i].timestamp, NULL);
+            buf = &fake->bufs[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fake->mutex);
+
+    return buf;
+}
+
+void rkisp_put_frame(const struct rkisp_api_ctx *ctx, const struct rkisp_api_buf *buf)
+{
+    struct video_capture_fake_dev *fake = (struct video_capture_fake_dev *)ctx;
+
+    pthread_mutex_lock(&fake->mutex);
+    fake->queued[buf - fake->bufs] = true;
+    pthread_mutex_unlock(&fake->mutex);
+}
+
+static int video_capture_fake_node(int id, const char *name, bool add)
+{
+    char path[128];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/dev/video%d", g_fake_root, id);
+    if (!add)
+        return unlink(path);
+    fp = fopen(path, "w");
+    if (!fp)
+        return -1;
+    fclose(fp);
+
+    snprintf(path, sizeof(path), "%s/sys/video%d", g_fake_root, id);
+    mkdir(path, 0755);
+    snprintf(path, sizeof(path), "%s/sys/video%d/name", g_fake_root, id);
+    fp = fopen(path, "w");
+    if (!fp)
+        return -1;
+    fprintf(fp, "%s\n", name);
+    fclose(fp);
+
+    return 0;
+}
+
+static int video_capture_fake_open(struct video_capture *cap)
+{
+    char path[128];
+    int id = get_video_id(cap->name);
+
+    if (id < 0)
+        return -1;
+    snprintf(path, sizeof(path), "%s/dev/video%d", g_fake_root, id);
+    cap->ctx = rkisp_open_device(path, 1);
+
+    return cap->ctx ? 0 : -1;
+}
+
+static void video_capture_fake_close(struct video_capture *cap)
+{
+    rkisp_close_device(cap->ctx);
+}
+
+static void video_capture_fake_frame(struct video_capture *cap, const struct rkisp_api_buf *buf)
+{
+    video_fanout_publish(cap->fanout, buf);
+}
+
+static void video_capture_fake_consume(const struct rkisp_api_buf *buf, void *arg)
+{
+    struct video_capture_fake *fake = (struct video_capture_fake *)arg;
+
+    (void)buf;
+    fake->consumed++;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *names[] = { "rkisp_mainpath", "stream_cif" };
+    static struct video_capture_fake fakes[2];
+    int seconds = argc > 1 ? atoi(argv[1]) : VIDEO_CAPTURE_FAKE_SECONDS;
+    char path[128], dev[128];
+    int ret = 0;
+
+    snprintf(g_fake_root, sizeof(g_fake_root), "/tmp/video_capture_fake.XXXXXX");
+    if (seconds <= 0 || !mkdtemp(g_fake_root))
+        return -1;
+    snprintf(path, sizeof(path), "%s/sys", g_fake_root);
+    snprintf(dev, sizeof(dev), "%s/dev", g_fake_root);
+    mkdir(path, 0755);
+    mkdir(dev, 0755);
+    for (int i = 0; i < 2; i++)
+        video_capture_fake_node(i, names[i], true);
+    if (video_device_init(path, dev))
+        return -1;
+
+    for (int i = 0; i < 2; i++) {
+        struct video_capture_fake *f = &fakes[i];
+
+        video_fanout_init(&f->fanout, NULL);
+        video_fanout_add(&f->fanout, names[i], video_capture_fake_consume, f);
+        video_fanout_start(&f->fanout);
+        f->capture.name = names[i];
+        f->capture.open = video_capture_fake_open;
+        f->capture.close = video_capture_fake_close;
+        f->capture.frame = video_capture_fake_frame;
+        f->capture.arg = f;
+        f->capture.fanout = &f->fanout;
+        if (video_capture_open(&f->capture) || video_capture_start(&f->capture)) {
+            printf("%s: %s start fail\n", __func__, names[i]);
+            return -1;
+        }
+    }
+
+    /* unplug the second stream for a while in the middle of the run */
+    sleep(seconds / 3);
+    video_capture_fake_node(1, names[1], false);
+    sleep(2);
+    video_capture_fake_node(1, names[1], true);
+    sleep(seconds - seconds / 3 - 2 > 0 ? seconds - seconds / 3 - 2 : 1);
+
+    for (int i = 0; i < 2; i++) {
+        struct video_capture_fake *f = &fakes[i];
+
+        video_capture_stop(&f->capture);
+        video_fanout_exit(&f->fanout);
+        printf("%s: frames %d, consumed %d, timeouts %d, recoveries %d\n", names[i],
+               f->capture.frames, f->consumed, f->capture.timeouts, f->capture.recoveries);
+        if (!f->consumed || !f->capture.recoveries)
+            ret = -1;
+    }
+    video_device_exit();
+
+    for (int i = 0; i < 2; i++) {
+        video_capture_fake_node(i, names[i], false);
+        snprintf(path, sizeof(path), "%s/sys/video%d/name", g_fake_root, i);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/sys/video%d", g_fake_root, i);
+        rmdir(path);
+    }
+    snprintf(path, sizeof(path), "%s/sys", g_fake_root);
+    rmdir(path);
+    rmdir(dev);
+    rmdir(g_fake_root);
+    printf("%s\n", ret ? "FAIL" : "PASS");
+
+    return ret;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __VIDEO_CAPTURE_FAKE_H__
+#define __VIDEO_CAPTURE_FAKE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <sys/time.h>
+
+/*
+ * The part of camera_engine_rkisp/interface/rkisp_api.h the capture
+ * supervisor and the fan-out use, what video_capture_fake.c implements, so
+ * the host build needs no SDK headers.
+ */
+struct rkisp_api_ctx {
+    int fd;
+    char dev_path[256];
+    int uapi;
+    int width;
+    int height;
+    int fcc;
+};
+
+struct rkisp_api_buf {
+    void *buf;
+    int fd;
+    int size;
+    struct timeval timestamp;
+};
+
+const struct rkisp_api_ctx *rkisp_open_device(const char *dev_path, int uapi);
+void rkisp_close_device(const struct rkisp_api_ctx *ctx);
+const struct rkisp_api_buf *rkisp_get_frame(const struct rkisp_api_ctx *ctx, int timeout_ms);
+void rkisp_put_frame(const struct rkisp_api_ctx *ctx, const struct rkisp_api_buf *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -34,12 +34,44 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
 #include "video_common.h"
 
 #define MAX_VIDEO_ID 20
+#define MAX_VIDEO_LISTENER (MAX_LANE * 2)
+#define VIDEO_NAME_LEN 64
+#define SYSFS_VIDEO_ROOT "/sys/class/video4linux"
+#define DEV_ROOT "/dev"
+
+struct video_device {
+    bool present;
+    char name[VIDEO_NAME_LEN];
+};
+
+struct video_listener {
+    const char *name;
+    video_device_callback cb;
+    void *arg;
+};
 
 bool g_isp_en = false;
 bool g_cif_en = false;
+bool g_perf_en = false;
+int g_lane_cnt = 1;
+
+static char g_sysfs_root[128] = SYSFS_VIDEO_ROOT;
+static char g_dev_root[128] = DEV_ROOT;
+static struct video_device g_video_devices[MAX_VIDEO_ID];
+static bool g_video_scanned;
+static struct video_listener g_listeners[MAX_VIDEO_LISTENER];
+static int g_listener_cnt;
+static pthread_mutex_t g_video_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int g_inotify_fd = -1;
+static pthread_t g_video_tid;
+static bool g_video_run;
 
 shadow_paint_box_callback shadow_paint_box_cb = NULL;
 void register_shadow_paint_box(shadow_paint_box_callback cb)
@@ -65,29 +97,175 @@ void register_shadow_display_vertical(shadow_display_vertical_callback cb)
     shadow_display_vertical_cb = cb;
 }
 
-int get_video_id(char *name)
+static int video_device_read_name(int id, char *name, int size)
+{
+    char path[256];
+    int fd, len;
+
+    snprintf(path, sizeof(path), "%s/video%d/name", g_sysfs_root, id);
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    len = read(fd, name, size - 1);
+    close(fd);
+    if (len <= 0)
+        return -1;
+    name[len] = '\0';
+    if (name[len - 1] == '\n')
+        name[len - 1] = '\0';
+
+    return 0;
+}
+
+static void video_device_notify(int id, const char *name, bool add)
+{
+    for (int i = 0; i < g_listener_cnt; i++)
+        if (strstr(name, g_listeners[i].name))
+            g_listeners[i].cb(g_listeners[i].name, id, add, g_listeners[i].arg);
+}
+
+/* called with g_video_mutex held */
+static void video_device_update(int id)
+{
+    struct video_device *dev = &g_video_devices[id];
+    char path[256];
+
+    memset(dev, 0, sizeof(*dev));
+    snprintf(path, sizeof(path), "%s/video%d", g_dev_root, id);
+    if (!video_device_read_name(id, dev->name, sizeof(dev->name)) && !access(path, F_OK))
+        dev->present = true;
+}
+
+static void video_device_scan(void)
+{
+    for (int i = 0; i < MAX_VIDEO_ID; i++)
+        video_device_update(i);
+    g_video_scanned = true;
+}
+
+static void video_device_changed(int id)
+{
+    struct video_device old, cur;
+
+    pthread_mutex_lock(&g_video_mutex);
+    memcpy(&old, &g_video_devices[id], sizeof(old));
+    video_device_update(id);
+    memcpy(&cur, &g_video_devices[id], sizeof(cur));
+    pthread_mutex_unlock(&g_video_mutex);
+
+    if (old.present && (!cur.present || strcmp(old.name, cur.name))) {
+        printf("%s: video%d %s removed\n", __func__, id, old.name);
+        video_device_notify(id, old.name, false);
+    }
+    if (cur.present && (!old.present || strcmp(old.name, cur.name))) {
+        printf("%s: video%d %s arrived\n", __func__, id, cur.name);
+        video_device_notify(id, cur.name, true);
+    }
+}
+
+static void *video_device_thread(void *arg)
 {
-    FILE *fp = NULL;
-    char buf[1024];
-    int i;
-    char cmd[128];
-    bool exist = false;
-
-    for (i = 0; i < MAX_VIDEO_ID; i++) {
-        snprintf(cmd, sizeof(cmd), "/sys/class/video4linux/video%d/name", i);
-        if (access(cmd, F_OK))
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd pfd;
+    int len, id;
+
+    (void)arg;
+    pfd.fd = g_inotify_fd;
+    pfd.events = POLLIN;
+    while (g_video_run) {
+        if (poll(&pfd, 1, 500) <= 0)
             continue;
-        snprintf(cmd, sizeof(cmd), "cat /sys/class/video4linux/video%d/name", i);
-        fp = popen(cmd, "r");
-        if (fp) {
-            if (fgets(buf, sizeof(buf), fp)) {
-                if (strstr(buf, name))
-                    exist = true;
-            }
-            pclose(fp);
+        len = read(g_inotify_fd, buf, sizeof(buf));
+        for (char *p = buf; p < buf + len; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->len && sscanf(event->name, "video%d", &id) == 1 &&
+                id >= 0 && id < MAX_VIDEO_ID)
+                video_device_changed(id);
+            p += sizeof(struct inotify_event) + event->len;
         }
-        if (exist)
+    }
+
+    pthread_exit(NULL);
+}
+
+/*
+ * Build the name to node cache from sysfs and watch both trees for video
+ * nodes coming and going. NULL roots select /sys/class/video4linux and
+ * /dev, other roots allow running against a fake tree.
+ */
+int video_device_init(const char *sysfs_root, const char *dev_root)
+{
+    snprintf(g_sysfs_root, sizeof(g_sysfs_root), "%s", sysfs_root ? sysfs_root : SYSFS_VIDEO_ROOT);
+    snprintf(g_dev_root, sizeof(g_dev_root), "%s", dev_root ? dev_root : DEV_ROOT);
+
+    pthread_mutex_lock(&g_video_mutex);
+    video_device_scan();
+    pthread_mutex_unlock(&g_video_mutex);
+
+    g_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (g_inotify_fd < 0) {
+        printf("%s: inotify_init fail\n", __func__);
+        return -1;
+    }
+    inotify_add_watch(g_inotify_fd, g_dev_root, IN_CREATE | IN_DELETE | IN_ATTRIB);
+    inotify_add_watch(g_inotify_fd, g_sysfs_root, IN_CREATE | IN_DELETE);
+
+    g_video_run = true;
+    if (pthread_create(&g_video_tid, NULL, video_device_thread, NULL)) {
+        printf("%s: pthread_create fail\n", __func__);
+        g_video_run = false;
+        return -1;
+    }
+
+    return 0;
+}
+
+void video_device_exit(void)
+{
+    g_video_run = false;
+    if (g_video_tid) {
+        pthread_join(g_video_tid, NULL);
+        g_video_tid = 0;
+    }
+    if (g_inotify_fd >= 0) {
+        close(g_inotify_fd);
+        g_inotify_fd = -1;
+    }
+    g_listener_cnt = 0;
+}
+
+int video_device_register(const char *name, video_device_callback cb, void *arg)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&g_video_mutex);
+    if (g_listener_cnt < MAX_VIDEO_LISTENER) {
+        g_listeners[g_listener_cnt].name = name;
+        g_listeners[g_listener_cnt].cb = cb;
+        g_listeners[g_listener_cnt].arg = arg;
+        g_listener_cnt++;
+    } else {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&g_video_mutex);
+
+    return ret;
+}
+
+int get_video_id(const char *name)
+{
+    int id = -1;
+
+    pthread_mutex_lock(&g_video_mutex);
+    if (!g_video_scanned)
+        video_device_scan();
+    for (int i = 0; i < MAX_VIDEO_ID; i++) {
+        if (g_video_devices[i].present && strstr(g_video_devices[i].name, name)) {
+            id = i;
             break;
+        }
     }
-    return (i == MAX_VIDEO_ID ? -1 : i);
+    pthread_mutex_unlock(&g_video_mutex);
+
+    return id;
 }
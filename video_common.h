@@ -37,14 +37,19 @@
 extern "C" {
 #endif
 
+/* camera pairs driven by one process, each with its own pipeline */
+#define MAX_LANE 4
+
 extern bool g_isp_en;
 extern bool g_cif_en;
+extern bool g_perf_en;
+extern int g_lane_cnt;
 
-typedef void (*shadow_paint_box_callback)(int left, int top, int right, int bottom);
+typedef void (*shadow_paint_box_callback)(int lane, int left, int top, int right, int bottom);
 void register_shadow_paint_box(shadow_paint_box_callback cb);
 extern shadow_paint_box_callback shadow_paint_box_cb;
 
-typedef void (*shadow_paint_name_callback)(char *name, bool real);
+typedef void (*shadow_paint_name_callback)(int lane, char *name, bool real);
 void register_shadow_paint_name(shadow_paint_name_callback cb);
 extern shadow_paint_name_callback shadow_paint_name_cb;
 
@@ -52,11 +57,16 @@ typedef void (*shadow_display_callback)(void *src_ptr, int src_fd, int src_fmt,
 void register_shadow_display(shadow_display_callback cb);
 extern shadow_display_callback shadow_display_cb;
 
-typedef void (*shadow_display_vertical_callback)(void *src_ptr, int src_fd, int src_fmt, int src_w, int src_h);
+typedef void (*shadow_display_vertical_callback)(int lane, void *src_ptr, int src_fd, int src_fmt,
+                                                 int src_w, int src_h);
 void register_shadow_display_vertical(shadow_display_vertical_callback cb);
 extern shadow_display_vertical_callback shadow_display_vertical_cb;
 
-int get_video_id(char *name);
+typedef void (*video_device_callback)(const char *name, int id, bool add, void *arg);
+int video_device_init(const char *sysfs_root, const char *dev_root);
+void video_device_exit(void);
+int video_device_register(const char *name, video_device_callback cb, void *arg);
+int get_video_id(const char *name);
 
 #ifdef __cplusplus
 }
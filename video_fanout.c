@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "video_common.h"
+#include "video_fanout.h"
+
+/*
+ * Every dequeued frame is handed to each consumer through a one-slot
+ * mailbox. A consumer that is still busy only ever sees the newest frame,
+ * older pending frames are dropped, so a slow consumer never holds back
+ * the capture thread or the other consumers. The V4L2 buffer is returned
+ * to the driver once the last reference is gone.
+ */
+
+static long long video_fanout_diff_us(struct timeval *t0, struct timeval *t1)
+{
+    return (t1->tv_sec - t0->tv_sec) * 1000000LL + (t1->tv_usec - t0->tv_usec);
+}
+
+static void video_fanout_unref(struct video_fanout *fanout, struct video_fanout_frame *frame)
+{
+    const struct rkisp_api_buf *buf = NULL;
+
+    pthread_mutex_lock(&fanout->mutex);
+    if (--frame->ref == 0) {
+        buf = frame->buf;
+        frame->buf = NULL;
+    }
+    pthread_mutex_unlock(&fanout->mutex);
+
+    if (buf)
+        rkisp_put_frame(fanout->ctx, buf);
+}
+
+static void video_fanout_stat(struct video_fanout_consumer *c, struct video_fanout_frame *frame)
+{
+    struct timeval t1;
+    long long age;
+
+    gettimeofday(&t1, NULL);
+    age = video_fanout_diff_us(&frame->ts, &t1);
+    c->frames++;
+    c->age_sum += age;
+    if (age > c->age_max)
+        c->age_max = age;
+
+    if (!c->t0.tv_sec)
+        c->t0 = t1;
+    if (video_fanout_diff_us(&c->t0, &t1) > 1000000) {
+        if (g_perf_en)
+            printf("%s fps: %d, drop: %d, frame age avg: %lldus, max: %lldus\n",
+                   c->name, c->frames, c->drops, c->age_sum / c->frames, c->age_max);
+        c->frames = 0;
+        c->drops = 0;
+        c->age_sum = 0;
+        c->age_max = 0;
+        c->t0 = t1;
+    }
+}
+
+static void *video_fanout_thread(void *arg)
+{
+    struct video_fanout_consumer *c = (struct video_fanout_consumer *)arg;
+    struct video_fanout *fanout = c->fanout;
+    struct video_fanout_frame *frame;
+
+    while (fanout->run) {
+        pthread_mutex_lock(&c->mutex);
+        while (!c->pending && fanout->run)
+            pthread_cond_wait(&c->cond, &c->mutex);
+        frame = c->pending;
+        c->pending = NULL;
+        pthread_mutex_unlock(&c->mutex);
+        if (!frame)
+            break;
+
+        video_fanout_stat(c, frame);
+        c->cb(frame->buf, c->arg);
+        video_fanout_unref(fanout, frame);
+    }
+
+    pthread_exit(NULL);
+}
+
+int video_fanout_init(struct video_fanout *fanout, const struct rkisp_api_ctx *ctx)
+{
+    memset(fanout, 0, sizeof(*fanout));
+    fanout->ctx = ctx;
+    pthread_mutex_init(&fanout->mutex, NULL);
+
+    return 0;
+}
+
+int video_fanout_add(struct video_fanout *fanout, const char *name,
+                     video_fanout_callback cb, void *arg)
+{
+    struct video_fanout_consumer *c;
+
+    if (fanout->count >= VIDEO_FANOUT_MAX_CONSUMERS) {
+        printf("%s: too many consumers!\n", __func__);
+        return -1;
+    }
+
+    c = &fanout->consumers[fanout->count];
+    memset(c, 0, sizeof(*c));
+    c->name = name;
+    c->cb = cb;
+    c->arg = arg;
+    c->fanout = fanout;
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    fanout->count++;
+
+    return 0;
+}
+
+int video_fanout_start(struct video_fanout *fanout)
+{
+    fanout->run = true;
+    for (int i = 0; i < fanout->count; i++) {
+        if (pthread_create(&fanout->consumers[i].tid, NULL, video_fanout_thread,
+                           &fanout->consumers[i])) {
+            printf("%s: pthread_create %s fail\n", __func__, fanout->consumers[i].name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void video_fanout_publish(struct video_fanout *fanout, const struct rkisp_api_buf *buf)
+{
+    struct video_fanout_frame *frame = NULL;
+    struct video_fanout_frame *drop;
+
+    pthread_mutex_lock(&fanout->mutex);
+    for (int i = 0; i < VIDEO_FANOUT_MAX_FRAMES; i++) {
+        if (!fanout->frames[i].buf) {
+            frame = &fanout->frames[i];
+            frame->buf = buf;
+            /* the publisher holds one reference until all consumers are fed */
+            frame->ref = 1 + fanout->count;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fanout->mutex);
+
+    if (!frame) {
+        printf("%s: no free frame slot\n", __func__);
+        rkisp_put_frame(fanout->ctx, buf);
+        return;
+    }
+    gettimeofday(&frame->ts, NULL);
+
+    for (int i = 0; i < fanout->count; i++) {
+        struct video_fanout_consumer *c = &fanout->consumers[i];
+        pthread_mutex_lock(&c->mutex);
+        drop = c->pending;
+        c->pending = frame;
+        if (drop)
+            c->drops++;
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+        if (drop)
+            video_fanout_unref(fanout, drop);
+    }
+
+    video_fanout_unref(fanout, frame);
+}
+
+void video_fanout_set_ctx(struct video_fanout *fanout, const struct rkisp_api_ctx *ctx)
+{
+    pthread_mutex_lock(&fanout->mutex);
+    fanout->ctx = ctx;
+    pthread_mutex_unlock(&fanout->mutex);
+}
+
+/*
+ * Drop the frames nobody has picked up yet and wait for the consumers to
+ * hand back the ones they are working on, so the device can be closed.
+ */
+void video_fanout_flush(struct video_fanout *fanout)
+{
+    bool busy = true;
+
+    for (int i = 0; i < fanout->count; i++) {
+        struct video_fanout_consumer *c = &fanout->consumers[i];
+        struct video_fanout_frame *drop;
+
+        pthread_mutex_lock(&c->mutex);
+        drop = c->pending;
+        c->pending = NULL;
+        pthread_mutex_unlock(&c->mutex);
+        if (drop)
+            video_fanout_unref(fanout, drop);
+    }
+
+    while (busy) {
+        busy = false;
+        pthread_mutex_lock(&fanout->mutex);
+        for (int i = 0; i < VIDEO_FANOUT_MAX_FRAMES; i++)
+            if (fanout->frames[i].buf)
+                busy = true;
+        pthread_mutex_unlock(&fanout->mutex);
+        if (busy)
+            usleep(1000);
+    }
+}
+
+void video_fanout_exit(struct video_fanout *fanout)
+{
+    fanout->run = false;
+    for (int i = 0; i < fanout->count; i++) {
+        struct video_fanout_consumer *c = &fanout->consumers[i];
+        pthread_mutex_lock(&c->mutex);
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+        if (c->tid) {
+            pthread_join(c->tid, NULL);
+            c->tid = 0;
+        }
+        if (c->pending) {
+            video_fanout_unref(fanout, c->pending);
+            c->pending = NULL;
+        }
+    }
+    fanout->count = 0;
+}
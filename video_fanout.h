@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2019 Rockchip Electronics Co., Ltd.
+ * author: Zhihua Wang, hogan.wang@rock-chips.com
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL), available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+#ifndef __VIDEO_FANOUT_H__
+#define __VIDEO_FANOUT_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#ifdef VIDEO_CAPTURE_FAKE
+#include "video_capture_fake.h"
+#else
+#include <camera_engine_rkisp/interface/rkisp_api.h>
+#endif
+
+#define VIDEO_FANOUT_MAX_CONSUMERS 2
+#define VIDEO_FANOUT_MAX_FRAMES 8
+
+typedef void (*video_fanout_callback)(const struct rkisp_api_buf *buf, void *arg);
+
+struct video_fanout;
+
+struct video_fanout_frame {
+    const struct rkisp_api_buf *buf;
+    struct timeval ts;
+    int ref;
+};
+
+struct video_fanout_consumer {
+    const char *name;
+    video_fanout_callback cb;
+    void *arg;
+    struct video_fanout *fanout;
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct video_fanout_frame *pending;
+    struct timeval t0;
+    int frames;
+    int drops;
+    long long age_sum;
+    long long age_max;
+};
+
+struct video_fanout {
+    const struct rkisp_api_ctx *ctx;
+    pthread_mutex_t mutex;
+    struct video_fanout_frame frames[VIDEO_FANOUT_MAX_FRAMES];
+    struct video_fanout_consumer consumers[VIDEO_FANOUT_MAX_CONSUMERS];
+    int count;
+    bool run;
+};
+
+int video_fanout_init(struct video_fanout *fanout, const struct rkisp_api_ctx *ctx);
+int video_fanout_add(struct video_fanout *fanout, const char *name,
+                     video_fanout_callback cb, void *arg);
+int video_fanout_start(struct video_fanout *fanout);
+void video_fanout_publish(struct video_fanout *fanout, const struct rkisp_api_buf *buf);
+void video_fanout_set_ctx(struct video_fanout *fanout, const struct rkisp_api_ctx *ctx);
+void video_fanout_flush(struct video_fanout *fanout);
+void video_fanout_exit(struct video_fanout *fanout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif